@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2025 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#ifndef foopalcapturesharefoo
+#define foopalcapturesharefoo
+
+#include <pulse/channelmap.h>
+#include <pulse/sample.h>
+#include <pulsecore/fdsem.h>
+
+#include <PalApi.h>
+#include <PalDefs.h>
+
+/* One PAL capture stream shared by the sources of a "share-group". The
+ * stream runs at the widest format and the most channels of the members and
+ * is only opened while at least one consumer is attached. A capture thread
+ * reads it and hands every period to the attached consumers, converted to
+ * their own format and channels. */
+typedef struct pa_pal_capture_share pa_pal_capture_share;
+
+/* the receiving end of one source, read by its IO thread */
+typedef struct pa_pal_capture_consumer pa_pal_capture_consumer;
+
+/* Called from main context. Joins (or creates) the group, NULL if the member
+ * can not share its stream: other stream type, device or rate */
+pa_pal_capture_share* pa_pal_capture_share_get(const char *group, pal_stream_type_t type, const struct pal_device *device,
+                                               const pa_sample_spec *ss, const pa_channel_map *map, size_t buffer_size,
+                                               size_t buffer_count);
+void pa_pal_capture_share_unref(pa_pal_capture_share *share);
+
+/* the device the shared stream captures from, fixed by the first member */
+pal_device_id_t pa_pal_capture_share_get_device_id(pa_pal_capture_share *share);
+
+/* Called from main context, ss and map are the ones of the source */
+pa_pal_capture_consumer* pa_pal_capture_consumer_new(pa_pal_capture_share *share, const pa_sample_spec *ss, const pa_channel_map *map,
+                                                     size_t buffer_size, size_t buffer_count);
+void pa_pal_capture_consumer_free(pa_pal_capture_consumer *c);
+
+/* Called from IO thread context. Attaching starts the delivery, the shared
+ * stream is opened by the capture thread for the first consumer and closed
+ * once the last one detached. Others keep capturing meanwhile */
+void pa_pal_capture_consumer_attach(pa_pal_capture_consumer *c);
+void pa_pal_capture_consumer_detach(pa_pal_capture_consumer *c);
+
+/* posted by the capture thread for every period delivered */
+pa_fdsem* pa_pal_capture_consumer_get_fdsem(pa_pal_capture_consumer *c);
+
+/* Called from IO thread context. Copies up to length bytes of queued audio,
+ * whole frames only, returns the number of bytes copied */
+size_t pa_pal_capture_consumer_read(pa_pal_capture_consumer *c, void *data, size_t length);
+size_t pa_pal_capture_consumer_get_queued(pa_pal_capture_consumer *c);
+
+/* periods dropped because the consumer did not read in time, since the last call */
+unsigned pa_pal_capture_consumer_take_overruns(pa_pal_capture_consumer *c);
+
+/* duration of one period of the shared stream */
+pa_usec_t pa_pal_capture_consumer_get_period_usec(pa_pal_capture_consumer *c);
+
+#endif
@@ -24,6 +24,11 @@
 #define PAL_PCM_CHANNEL_RLC  15  /* Rear left of center.                          */
 #define PAL_PCM_CHANNEL_RRC  16  /* Rear right of center.                         */
 
+#define PA_PAL_CARD_DEFAULT_DEVICE_BIT_WIDTH 16
+
+/* devices a combo port can route one stream to */
+#define PA_PAL_CARD_MAX_PORT_DEVICES 4
+
 typedef enum {
     PA_PAL_CARD_SINK_NONE= 0x0,
     PA_PAL_CARD_SINK_LL_0 = 0x1,
@@ -71,6 +76,9 @@ typedef struct {
     pa_channel_map default_map;
     uint32_t priority;
     pal_device_id_t device;
+    pal_device_id_t devices[PA_PAL_CARD_MAX_PORT_DEVICES]; /* more than one for a combo port, device is devices[0] */
+    uint32_t n_devices;
+    uint32_t bit_width;
 
     pa_idxset *formats;
 
@@ -115,13 +123,32 @@ typedef enum {
     PA_PAL_NO_EVENT = -1,
     PA_PAL_VOLUME_APPLY = 1,
     PA_PAL_DEVICE_SWITCH,
+    PA_PAL_MUTE_APPLY,
+    PA_PAL_SET_PARAM,
 } pa_pal_ctrl_event_t;
 
+/* Control command posted from the main thread to a sink/source I/O thread.
+ * The I/O thread applies it between periods and posts it back with rc set,
+ * the main thread then frees it. */
+typedef struct {
+    pa_pal_ctrl_event_t event;
+    struct pal_volume_data *volume_data; /* always allocated, room for PA_CHANNELS_MAX pairs */
+    bool mute;
+    struct pal_device devices[PA_PAL_CARD_MAX_PORT_DEVICES];
+    uint32_t n_devices;
+    uint32_t param_id;
+    pal_param_payload *param_payload;
+    int rc;
+} pa_pal_ctrl_cmd;
+
 typedef struct {
     pal_device_id_t device;
+    pal_device_id_t devices[PA_PAL_CARD_MAX_PORT_DEVICES]; /* more than one for a combo port, device is devices[0] */
+    uint32_t n_devices;
     pa_pal_card_usecase_id_t usecase_id;
     pa_sample_spec default_spec;
     pa_channel_map default_map;
+    uint32_t bit_width; /* of the PAL device behind the port */
     bool is_connected;
     char *pal_devicepp_config;
 } pa_pal_card_port_device_data;
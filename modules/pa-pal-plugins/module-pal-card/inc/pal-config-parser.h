@@ -7,6 +7,7 @@
 #define foopalconfparserfoo
 
 #include <pulsecore/conf-parser.h>
+#include <pulsecore/dynarray.h>
 
 #include <PalApi.h>
 #include <PalDefs.h>
@@ -19,6 +20,7 @@ typedef struct {
     pa_hashmap *sinks;
     pa_hashmap *sources;
     pa_hashmap *loopbacks;
+    pa_dynarray *routing_rules; /* of pa_pal_routing_rule, in conf order */
     char *default_profile;
 } pa_pal_config_data;
 
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2025 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#ifndef foopallatencysmootherhfoo
+#define foopallatencysmootherhfoo
+
+#include <pulse/sample.h>
+
+#include <PalApi.h>
+#include <PalDefs.h>
+
+/* Estimates the DSP session position from pal_get_timestamp samples. The
+ * samples are filtered by a delay-locked loop, PAL is queried at most once
+ * per fetch interval and the position is interpolated in between. */
+typedef struct pa_pal_latency_smoother pa_pal_latency_smoother;
+
+pa_pal_latency_smoother* pa_pal_latency_smoother_new(pa_usec_t fetch_interval_us);
+void pa_pal_latency_smoother_free(pa_pal_latency_smoother *s);
+
+/* forget the loop state, to be called whenever the session time restarts */
+void pa_pal_latency_smoother_reset(pa_pal_latency_smoother *s);
+
+/* session time in usec the DSP has reached now, returns < 0 if no estimate is available */
+int pa_pal_latency_smoother_get(pa_pal_latency_smoother *s, pal_stream_handle_t *stream_handle, uint64_t *session_time_us);
+
+/* last raw session time reported by PAL */
+uint64_t pa_pal_latency_smoother_get_raw(pa_pal_latency_smoother *s);
+
+/* current time of the counter PAL uses for absolute_time, in usec */
+uint64_t pa_pal_qtimer_now_us(void);
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2025 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#ifndef foopalpcmtaphfoo
+#define foopalpcmtaphfoo
+
+#include <pulse/sample.h>
+
+/* wav files are rotated once they reach this size */
+#define PA_PAL_PCM_TAP_MAX_FILE_SIZE (64 * 1024 * 1024)
+
+/* Copy of the PCM a sink hands to PAL or a source gets from PAL, streamed to
+ * <prefix>-<n>.wav files by a writer thread of its own. */
+typedef struct pa_pal_pcm_tap pa_pal_pcm_tap;
+
+/* Called from main thread context, NULL if the first file can't be created */
+pa_pal_pcm_tap* pa_pal_pcm_tap_new(const char *prefix, const pa_sample_spec *ss, size_t max_file_size);
+/* Called from main thread context, the IO thread must not use the tap anymore */
+void pa_pal_pcm_tap_free(pa_pal_pcm_tap *t);
+
+/* Called from IO thread context, never blocks. Data not fitting in the ring is
+ * dropped and counted */
+void pa_pal_pcm_tap_write(pa_pal_pcm_tap *t, const void *data, size_t length);
+
+/* spec the wav files are written with */
+const pa_sample_spec* pa_pal_pcm_tap_get_sample_spec(pa_pal_pcm_tap *t);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2025 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#ifndef foopalroutingfoo
+#define foopalroutingfoo
+
+#include <pulse/format.h>
+#include <pulsecore/core.h>
+#include <pulsecore/dynarray.h>
+
+/* One "rule =" line of the [Routing] section. All conditions present have to
+ * match, the first matching rule picks the sink */
+typedef struct {
+    char *roles;                 /* comma separated media.role values, NULL for any */
+    pa_encoding_t *encodings;    /* NULL for any */
+    uint32_t n_encodings;
+    pa_usec_t max_latency_us;    /* requested latency at or below, 0 for any */
+    pa_usec_t min_latency_us;    /* requested latency at or above, 0 for any */
+    char *sink_name;
+} pa_pal_routing_rule;
+
+/* role:a,b encoding:x,y max-latency-ms:n min-latency-ms:n sink:name */
+pa_pal_routing_rule* pa_pal_routing_rule_parse(const char *str);
+void pa_pal_routing_rule_free(pa_pal_routing_rule *rule);
+
+/* Moves new sink inputs without a sink of their own to the sink of the first
+ * matching rule */
+typedef struct pa_pal_routing pa_pal_routing;
+
+pa_pal_routing* pa_pal_routing_new(pa_core *core, pa_dynarray *rules);
+void pa_pal_routing_free(pa_pal_routing *r);
+
+#endif
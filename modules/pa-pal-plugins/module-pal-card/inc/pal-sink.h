@@ -12,23 +12,18 @@
 #include <pulsecore/card.h>
 #include <pulsecore/core.h>
 #include <pulsecore/core-util.h>
+#include <pulsecore/memblockq.h>
 
 #include <PalApi.h>
 #include <PalDefs.h>
 
 #include "pal-card.h"
+#include "pal-latency-smoother.h"
+#include "pal-pcm-tap.h"
+#include "pal-stats.h"
 
-typedef enum {
-    PAL_SINK_MESSAGE_WRITE_READY,
-} pal_msgs_t;
-
-typedef struct {
-    pa_msgobject parent;
-    void *userdata;
-} pal_msg_obj;
-
-PA_DEFINE_PRIVATE_CLASS(pal_msg_obj, pa_msgobject);
-#define PAL_MSG_OBJ(o) (pal_msg_obj_cast(o))
+/* single producer, single consumer queue of rendered chunks */
+typedef struct pa_pal_chunk_queue pa_pal_chunk_queue;
 
 typedef struct {
     char *name;
@@ -49,12 +44,23 @@ typedef struct {
     pa_pal_card_usecase_type_t usecase_type;
     uint32_t buffer_size;
     uint32_t buffer_count;
+    bool tsched;
+    uint32_t tsched_watermark_ms;
+    uint32_t rewind_buffer_count;
+    bool dynamic_latency;
+    uint32_t min_latency_ms;
+    uint32_t max_latency_ms;
+    bool mmap;
+    bool gapless;
+    uint32_t standby_hysteresis_ms;
+    bool prewarm;
 } pa_pal_sink_config;
 
 typedef struct {
     pal_stream_handle_t *stream_handle;
 
-    struct pal_device *pal_device;
+    struct pal_device *pal_device; /* n_pal_devices entries, more than one on a combo port */
+    uint32_t n_pal_devices;
     struct pal_stream_attributes *stream_attributes;
     const char *device_url;
 
@@ -62,32 +68,91 @@ typedef struct {
     size_t buffer_count;
     uint32_t sink_latency_us;
     uint64_t bytes_written;
+    pa_pal_latency_smoother *smoother;
+
+    /* timer based scheduling */
+    bool tsched;
+    pa_usec_t tsched_watermark_us;
+
+    /* rendered audio not yet handed to PAL, kept rewindable */
+    pa_memblockq *staging;
+    size_t rewind_buffer_count;
+
+    /* period follows the latency requested by clients */
+    bool dynamic_latency;
+    pa_usec_t min_latency_us;
+    pa_usec_t max_latency_us;
+    size_t pending_buffer_size; /* taken once stopped or idle, 0 if none. IO thread only */
+    pa_usec_t fill_limit_us; /* tsched fill cap until then, 0 if none. IO thread only */
+
+    /* mix is rendered straight into the PAL mmap ring */
+    bool mmap;
+    struct pal_mmap_buffer mmap_buffer;
+    uint64_t mmap_frames_written;
+    uint64_t mmap_hw_frames;
+    uint32_t mmap_last_position;
 
-    int write_fd;
     int index;
 
     bool standby;
     pa_mutex *mutex;
+    pa_mutex *device_mutex; /* pal_device and n_pal_devices, never held across PAL calls */
+
+    /* keep-warm standby, a stopped session is only closed at standby_close_time */
+    pa_usec_t standby_hysteresis_us;
+    pa_usec_t standby_close_time;
+
+    /* keep the session opened in the background while idle */
+    bool prewarm;
+
+    pa_pal_stats *stats;
+    pa_usec_t wakeup_deadline; /* when the current timer wakeup is due, 0 if none */
+
+    /* runtime pcm dump, the IO thread copy is swapped by PA_PAL_SINK_MESSAGE_SET_PCM_TAP */
+    pa_pal_pcm_tap *pcm_tap;
+    char *pcm_tap_prefix; /* main thread only */
 
     /* Sink events */
     pa_fdsem *pal_fdsem;
-    pa_cond *cond_ctrl_thread;
-    pa_pal_ctrl_event_t sink_event_id;
 
-    /* PAL sink_write thread */
-    pal_msg_obj *pal_msg;
-    pa_thread_mq pal_thread_mq;
+    /* PAL sink_write thread, consumer of offload_queue */
     pa_thread *pal_thread;
-    pa_rtpoll *pal_thread_rtpoll;
-    pa_rtpoll_item *pal_rtpoll_item;
+    pa_pal_chunk_queue *offload_queue;
+    pa_atomic_t pal_thread_exit;
+    pa_atomic_t drain_requested;
     pa_atomic_t restart_in_progress;
-    pa_atomic_t write_done;
     pa_atomic_t close_output;
+    pa_atomic_t session_id; /* bumped on every open, offload chunks carry the one they were rendered for */
 
     pa_encoding_t encoding;
     bool compressed;
+
+    /* IEC61937 passthrough, PAL gets the bursts as S16LE pcm. The pcm config
+     * is kept to go back to when the passthrough stream is gone */
+    bool passthrough;
+    pa_sample_spec pcm_spec;
+    pa_channel_map pcm_map;
+
+    /* float mix, PAL gets it as S32 from convert_buf */
+    bool convert_float;
+    int32_t *convert_buf; /* IO thread only */
+    size_t convert_buf_size;
+
+    /* last volume and mute sent to PAL, re-applied when a session starts. IO thread only */
+    struct pal_volume_data *hw_volume;
+    bool hw_mute;
+
     bool dynamic_usecase;
     pal_snd_dec_t *pal_snd_dec;
+
+    /* offload failure, compressed formats are refused until offload_retry_time */
+    pa_atomic_t offload_failed; /* set by the write thread on a dead session */
+    pa_usec_t offload_retry_time; /* main thread only */
+
+    /* gapless offload, tracks are switched without closing the session */
+    bool gapless;
+    struct pal_compr_gapless_mdata gapless_mdata;
+    pa_atomic_t track_drained;
 } pal_sink_data;
 
 typedef struct {
@@ -99,6 +164,8 @@ typedef struct {
     pa_rtpoll_item *rtpoll_item;
     pa_idxset *formats;
     pa_pal_card_avoid_processing_config_id_t avoid_config_processing;
+    pa_time_event *stats_event;
+    int stats_generation;
 } pa_sink_data;
 
 typedef struct {
@@ -118,6 +185,10 @@ typedef struct {
 
 typedef enum {
     PA_PAL_SINK_MESSAGE_DRAIN_READY = PA_SINK_MESSAGE_MAX + 1,
+    PA_PAL_SINK_MESSAGE_CTRL,
+    PA_PAL_SINK_MESSAGE_CTRL_DONE,
+    PA_PAL_SINK_MESSAGE_SET_PCM_TAP,
+    PA_PAL_SINK_MESSAGE_OFFLOAD_FAILED,
 } pa_pal_sink_msgs_t;
 
 bool pa_pal_sink_is_supported_sample_rate(uint32_t sample_rate);
@@ -128,16 +199,61 @@ void pa_pal_sink_module_init(void);
 void pa_pal_sink_module_deinit(void);
 int pa_pal_sink_get_media_config(pa_pal_sink_handle_t *handle, pa_sample_spec *ss, pa_channel_map *map, pa_encoding_t *encoding);
 pa_idxset* pa_pal_sink_get_config(pa_pal_sink_handle_t *handle);
+/* current pal.stats.* of a pal sink as key=value lines, free with pa_xfree */
+char* pa_pal_sink_get_stats(pa_sink *s);
+/* dump what a pcm pal sink writes to <prefix>-<n>.wav files, NULL prefix stops it */
+int pa_pal_sink_set_pcm_tap(pa_sink *s, const char *prefix);
 int pa_pal_sink_set_a2dp_suspend(const char *prm_value);
 
+static inline bool pa_pal_sink_is_iec61937_encoding(pa_encoding_t encoding) {
+    switch (encoding) {
+        case PA_ENCODING_AC3_IEC61937:
+        case PA_ENCODING_EAC3_IEC61937:
+        case PA_ENCODING_MPEG_IEC61937:
+        case PA_ENCODING_DTS_IEC61937:
+        case PA_ENCODING_MPEG2_AAC_IEC61937:
+#if HAVE_DECL_PA_ENCODING_TRUEHD_IEC61937
+        case PA_ENCODING_TRUEHD_IEC61937:
+#endif
+#if HAVE_DECL_PA_ENCODING_DTSHD_IEC61937
+        case PA_ENCODING_DTSHD_IEC61937:
+#endif
+            return true;
+        default:
+            return false;
+    }
+}
+
 static inline bool pa_pal_sink_is_supported_encoding(pa_encoding_t encoding) {
     bool supported = true;
 
+    /* passthrough is pcm for PAL, decoded by the receiver */
+    if (pa_pal_sink_is_iec61937_encoding(encoding))
+        return true;
+
     switch (encoding) {
         case PA_ENCODING_PCM:
 #ifndef PAL_DISABLE_COMPRESS_AUDIO_SUPPORT
         case PA_ENCODING_MPEG:
         case PA_ENCODING_AAC:
+#if HAVE_DECL_PA_ENCODING_FLAC
+        case PA_ENCODING_FLAC:
+#endif
+#if HAVE_DECL_PA_ENCODING_ALAC
+        case PA_ENCODING_ALAC:
+#endif
+#if HAVE_DECL_PA_ENCODING_VORBIS
+        case PA_ENCODING_VORBIS:
+#endif
+#if HAVE_DECL_PA_ENCODING_OPUS && HAVE_DECL_PAL_AUDIO_FMT_OPUS
+        case PA_ENCODING_OPUS:
+#endif
+#if HAVE_DECL_PA_ENCODING_WMA
+        case PA_ENCODING_WMA:
+#endif
+#if HAVE_DECL_PA_ENCODING_WMA_PRO
+        case PA_ENCODING_WMA_PRO:
+#endif
 #endif
             break;
 
@@ -162,6 +278,8 @@ static inline pal_stream_type_t pa_pal_sink_get_type_from_string(const char *str
         type = PAL_STREAM_VOIP_RX;
     } else if (pa_streq(stream_type, "PAL_STREAM_COMPRESSED")) {
         type = PAL_STREAM_COMPRESSED;
+    } else if (pa_streq(stream_type, "PAL_STREAM_ULTRA_LOW_LATENCY")) {
+        type = PAL_STREAM_ULTRA_LOW_LATENCY;
     } else {
         type = PAL_STREAM_GENERIC; //No PAL_STREAM_NONE. Hence using generic one.
         pa_log_error("%s: Unsupported stream_type %s", __func__, stream_type);
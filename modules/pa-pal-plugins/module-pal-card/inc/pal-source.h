@@ -14,7 +14,11 @@
 #include <PalApi.h>
 #include <PalDefs.h>
 
+#include "pal-capture-share.h"
 #include "pal-card.h"
+#include "pal-latency-smoother.h"
+#include "pal-pcm-tap.h"
+#include "pal-stats.h"
 
 typedef size_t pa_pal_source_handle_t;
 
@@ -41,6 +45,10 @@ typedef struct {
     pa_pal_card_usecase_type_t usecase_type;
     uint32_t buffer_size;
     uint32_t buffer_count;
+    uint32_t standby_hysteresis_ms;
+    bool non_blocking;
+    char *share_group; /* sources of a group capture from one PAL stream */
+    pal_audio_effect_t dsp_effect;
 } pa_pal_source_config;
 
 typedef struct {
@@ -50,18 +58,47 @@ typedef struct {
     struct pal_stream_attributes *stream_attributes;
     const char *device_url;
 
-    int write_fd;
-
     pa_mutex *mutex;
-    pa_cond *cond_ctrl_thread;
-    pa_pal_ctrl_event_t source_event_id;
 
     size_t buffer_size;
     size_t buffer_count;
+    uint64_t bytes_read; /* since the session started. IO thread only */
+
+    /* capture blocks recycled once nothing downstream references them. IO thread only */
+    pa_memblock **ring;
+    unsigned ring_size;
+    unsigned ring_idx;
+    size_t ring_block_size;
+    pa_pal_latency_smoother *smoother;
     int index;
     bool dynamic_usecase;
 
     bool standby;
+
+    /* keep-warm standby, a stopped session is only closed at standby_close_time */
+    pa_usec_t standby_hysteresis_us;
+    pa_usec_t standby_close_time;
+
+    pa_pal_stats *stats;
+
+    /* runtime pcm dump, the IO thread copy is swapped by PA_PAL_SOURCE_MESSAGE_SET_PCM_TAP */
+    pa_pal_pcm_tap *pcm_tap;
+    char *pcm_tap_prefix; /* main thread only */
+
+    /* last volume and mute sent to PAL, re-applied when a session starts. IO thread only */
+    struct pal_volume_data *hw_volume;
+    bool hw_mute;
+
+    /* only read periods the DSP already captured, read_fdsem is posted on READ_DONE */
+    bool non_blocking;
+    pa_fdsem *read_fdsem;
+
+    /* echo cancellation and noise suppression done in the DSP graph */
+    pal_audio_effect_t dsp_effect;
+
+    /* member of a share group, captures from the shared stream instead of its own */
+    pa_pal_capture_share *share;
+    pa_pal_capture_consumer *consumer;
 } pal_source_data;
 
 typedef struct {
@@ -70,8 +107,11 @@ typedef struct {
     pa_rtpoll *rtpoll;
     pa_thread_mq thread_mq;
     pa_thread *thread;
+    pa_rtpoll_item *rtpoll_item;
     pa_idxset *formats;
     pa_pal_card_avoid_processing_config_id_t avoid_config_processing;
+    pa_time_event *stats_event;
+    int stats_generation;
 } pa_source_data;
 
 typedef struct {
@@ -80,12 +120,22 @@ typedef struct {
     bool pal_source_opened;
 } pa_pal_source_data;
 
+typedef enum {
+    PA_PAL_SOURCE_MESSAGE_CTRL = PA_SOURCE_MESSAGE_MAX + 1,
+    PA_PAL_SOURCE_MESSAGE_CTRL_DONE,
+    PA_PAL_SOURCE_MESSAGE_SET_PCM_TAP,
+} pa_pal_source_msgs_t;
+
 /*create pal session and pa source */
 int pa_pal_source_create(pa_module *m, pa_card *card, const char *driver, const char *module_name, pa_pal_source_config *source,
                          pa_pal_source_handle_t **handle);
 void pa_pal_source_close(pa_pal_source_handle_t *handle);
 bool pa_pal_source_is_supported_sample_rate(uint32_t sample_rate);
 pa_idxset* pa_pal_source_get_config(pa_pal_source_handle_t *handle);
+/* current pal.stats.* of a pal source as key=value lines, free with pa_xfree */
+char* pa_pal_source_get_stats(pa_source *s);
+/* dump what a pal source reads to <prefix>-<n>.wav files, NULL prefix stops it */
+int pa_pal_source_set_pcm_tap(pa_source *s, const char *prefix);
 int pa_pal_source_get_media_config(pa_pal_source_handle_t *handle, pa_sample_spec *ss, pa_channel_map *map, pa_encoding_t *encoding);
 int pa_pal_source_set_device_connection_params(pa_pal_source_handle_t *handle, const char *prm_value);
 
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2025 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#ifndef foopalstatshfoo
+#define foopalstatshfoo
+
+#include <pulse/proplist.h>
+#include <pulse/sample.h>
+#include <pulsecore/atomic.h>
+
+/* how often the main thread publishes pal.stats.* to the proplist */
+#define PA_PAL_STATS_PUBLISH_INTERVAL_MS 5000
+
+#define PA_PAL_STATS_HIST_BUCKETS 8
+
+/* Statistics of one sink/source IO thread. Only the IO thread updates the
+ * counters, the main thread reads them, so plain atomics are enough. */
+typedef struct {
+    bool capture;
+
+    pa_atomic_t xruns;
+    pa_atomic_t io_count;
+    pa_atomic_t io_errors;
+    pa_atomic_t io_max_us;
+    pa_atomic_t io_hist[PA_PAL_STATS_HIST_BUCKETS];
+    pa_atomic_t wakeup_max_late_us;
+    pa_atomic_t late_wakeups;
+
+    /* IO thread only */
+    pa_usec_t last_io_end;
+} pa_pal_stats;
+
+pa_pal_stats* pa_pal_stats_new(bool capture);
+void pa_pal_stats_free(pa_pal_stats *s);
+
+/* forget the previous pal_stream_write/read, to be called when the session stops */
+void pa_pal_stats_session_reset(pa_pal_stats *s);
+
+/* one pal_stream_write/read, started at start and finished at end. A gap of more
+ * than buffered_us since the previous one means the DSP ran dry (or full) */
+void pa_pal_stats_io(pa_pal_stats *s, pa_usec_t start, pa_usec_t end, pa_usec_t buffered_us);
+void pa_pal_stats_io_error(pa_pal_stats *s);
+void pa_pal_stats_xrun(pa_pal_stats *s);
+
+/* timer wakeup happened late_us after it was due, late if above half a period */
+void pa_pal_stats_wakeup(pa_pal_stats *s, pa_usec_t late_us, pa_usec_t period_us);
+
+void pa_pal_stats_to_proplist(pa_pal_stats *s, pa_proplist *p);
+
+/* newline separated key=value list, free with pa_xfree */
+char* pa_pal_stats_to_string(pa_pal_stats *s);
+
+#endif
@@ -8,6 +8,7 @@
 #define foopalutilsfoo
 
 #include <pulse/sample.h>
+#include <pulse/volume.h>
 
 #include <PalApi.h>
 #include <PalDefs.h>
@@ -15,13 +16,25 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
+#define PA_PAL_VOLUME_DATA_SIZE(pairs) (sizeof(struct pal_volume_data) + (pairs) * sizeof(struct pal_channel_vol_kv))
+
 pal_device_id_t pa_pal_util_device_name_to_enum(const char *device);
+/* sets up one pal_device per device of the port, devices[0] holds the config they share.
+ * Returns the number of devices */
+uint32_t pa_pal_util_fill_port_devices(struct pal_device *devices, const pa_pal_card_port_device_data *port);
+bool pa_pal_util_port_has_device(const pa_pal_card_port_device_data *port, pal_device_id_t device);
 pal_device_id_t pa_pal_util_port_name_to_enum(const char *port_name);
 uint32_t pa_pal_get_channel_count(pa_channel_map *pa_map);
 bool pa_pal_channel_map_to_pal(pa_channel_map *pa_map, struct pal_channel_info *pal_map);
 pal_audio_fmt_t pa_pal_util_get_pal_format_from_pa_encoding(pa_encoding_t pa_format, pal_snd_dec_t *pal_snd_dec);
+/* PAL format and bit width PCM of the given sample format is handed over as */
+pal_audio_fmt_t pa_pal_util_get_pal_pcm_format(pa_sample_format_t format, uint32_t *bit_width);
+/* float to S32 with NEON/SSE2 where available, for formats PAL can't take.
+ * dst may be src for an in place conversion */
+void pa_pal_util_float32_to_s32(int32_t *dst, const float *src, size_t samples);
 #ifndef PAL_DISABLE_COMPRESS_AUDIO_SUPPORT
 int pa_pal_util_set_pal_metadata_from_pa_format(const pa_format_info *format);
+int pa_pal_util_get_gapless_metadata_from_pa_format(const pa_format_info *format, struct pal_compr_gapless_mdata *mdata);
 #endif
 pa_channel_map* pa_pal_util_channel_map_init(pa_channel_map *m, unsigned channels);
 pa_pal_jack_type_t pa_pal_util_get_jack_type_from_port_name(const char *port_name);
@@ -29,6 +42,11 @@ const char* pa_pal_util_get_port_name_from_jack_type(pa_pal_jack_type_t jack_typ
 pa_channel_map pa_pal_map_remove_invalid_channels(pa_channel_map *def_map_with_inval_ch);
 void pa_pal_util_get_jack_sys_path(pa_pal_card_port_config *config_port, pa_pal_jack_in_config *jack_in_config);
 int pa_pal_set_volume(pal_stream_handle_t *handle, uint32_t num_channels, float value);
+/* one volume pair per channel of v (up to 0dB), or a single pair if all are equal */
+void pa_pal_util_fill_volume_data(struct pal_volume_data *data, const pa_cvolume *v, const struct pal_channel_info *ch_info);
 int pa_pal_set_device_connection_state(pal_device_id_t pal_dev_id, bool connection_state);
+pa_pal_ctrl_cmd* pa_pal_ctrl_cmd_new(pa_pal_ctrl_event_t event);
+void pa_pal_ctrl_cmd_free(pa_pal_ctrl_cmd *cmd);
+int pa_pal_ctrl_cmd_apply(pal_stream_handle_t *handle, pa_pal_ctrl_cmd *cmd);
 pa_pal_card_avoid_processing_config_id_t pa_pal_utils_get_config_id_from_string(const char *config_str);
 #endif
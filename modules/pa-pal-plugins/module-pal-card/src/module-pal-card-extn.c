@@ -10,6 +10,7 @@
 #include <pulsecore/core-util.h>
 #include <pulsecore/dbus-util.h>
 #include <pulsecore/modargs.h>
+#include <pulsecore/namereg.h>
 #include <pulsecore/protocol-dbus.h>
 #include <pulsecore/thread.h>
 #include <pulsecore/thread-mq.h>
@@ -68,11 +69,17 @@ static struct pal_module_extn_data *pal_extn_mdata = NULL;
 /* key,value based set params*/
 static void pal_module_set_parameters(DBusConnection *conn, DBusMessage *msg, void *userdata);
 static void pal_module_get_parameters(DBusConnection *conn, DBusMessage *msg, void *userdata);
+/* pal.stats.* of a sink or source of this card */
+static void pal_module_get_stream_stats(DBusConnection *conn, DBusMessage *msg, void *userdata);
+/* start/stop the wav dump of a sink or source of this card */
+static void pal_module_set_pcm_tap(DBusConnection *conn, DBusMessage *msg, void *userdata);
 
 enum module_method_handler_index {
 	METHOD_HANDLER_SET_PARAMETERS,
 	METHOD_HANDLER_GET_PARAMETERS,
-	METHOD_HANDLER_MODULE_LAST = METHOD_HANDLER_GET_PARAMETERS,
+	METHOD_HANDLER_GET_STREAM_STATS,
+	METHOD_HANDLER_SET_PCM_TAP,
+	METHOD_HANDLER_MODULE_LAST = METHOD_HANDLER_SET_PCM_TAP,
 	METHOD_HANDLER_MODULE_MAX = METHOD_HANDLER_MODULE_LAST + 1,
 };
 
@@ -85,6 +92,17 @@ static pa_dbus_arg_info get_parameters_args[] = {
 	{"value", "s", "out"}
 };
 
+static pa_dbus_arg_info get_stream_stats_args[] = {
+	{"name", "s", "in"},
+	{"stats", "s", "out"}
+};
+
+/* empty prefix stops the tap */
+static pa_dbus_arg_info set_pcm_tap_args[] = {
+	{"name", "s", "in"},
+	{"prefix", "s", "in"}
+};
+
 static pa_dbus_method_handler module_method_handlers[METHOD_HANDLER_MODULE_MAX] = {
 	[METHOD_HANDLER_SET_PARAMETERS] = {
 		.method_name = "SetParameters",
@@ -96,6 +114,16 @@ static pa_dbus_method_handler module_method_handlers[METHOD_HANDLER_MODULE_MAX]
 		.arguments = get_parameters_args,
 		.n_arguments = sizeof(get_parameters_args)/sizeof(pa_dbus_arg_info),
 		.receive_cb = pal_module_get_parameters},
+	[METHOD_HANDLER_GET_STREAM_STATS] = {
+		.method_name = "GetStreamStats",
+		.arguments = get_stream_stats_args,
+		.n_arguments = sizeof(get_stream_stats_args)/sizeof(pa_dbus_arg_info),
+		.receive_cb = pal_module_get_stream_stats},
+	[METHOD_HANDLER_SET_PCM_TAP] = {
+		.method_name = "SetPcmTap",
+		.arguments = set_pcm_tap_args,
+		.n_arguments = sizeof(set_pcm_tap_args)/sizeof(pa_dbus_arg_info),
+		.receive_cb = pal_module_set_pcm_tap},
 };
 
 static pa_dbus_interface_info module_interface_info = {
@@ -290,6 +318,78 @@ static void pal_module_get_parameters(DBusConnection *conn, DBusMessage *msg, vo
 	}
 }
 
+static void pal_module_get_stream_stats(DBusConnection *conn, DBusMessage *msg, void *userdata)
+{
+	struct pal_module_extn_data *mdata = userdata;
+	DBusError error;
+	const char *name = NULL;
+	char *stats = NULL;
+	pa_sink *sink;
+	pa_source *source;
+
+	pa_assert(conn);
+	pa_assert(msg);
+	pa_assert(mdata);
+	dbus_error_init(&error);
+
+	if (!dbus_message_get_args(msg, &error, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID)) {
+		pa_dbus_send_error(conn, msg, DBUS_ERROR_INVALID_ARGS, "%s", error.message);
+		dbus_error_free(&error);
+		return;
+	}
+
+	/* only the sinks and sources of our own card are pal ones */
+	if ((sink = pa_namereg_get(mdata->card->core, name, PA_NAMEREG_SINK)) && sink->card == mdata->card)
+		stats = pa_pal_sink_get_stats(sink);
+	else if ((source = pa_namereg_get(mdata->card->core, name, PA_NAMEREG_SOURCE)) && source->card == mdata->card)
+		stats = pa_pal_source_get_stats(source);
+
+	if (!stats) {
+		pa_dbus_send_error(conn, msg, DBUS_ERROR_INVALID_ARGS, "No pal sink or source named %s", name);
+		return;
+	}
+
+	pa_dbus_send_basic_value_reply(conn, msg, DBUS_TYPE_STRING, &stats);
+	pa_xfree(stats);
+}
+
+static void pal_module_set_pcm_tap(DBusConnection *conn, DBusMessage *msg, void *userdata)
+{
+	struct pal_module_extn_data *mdata = userdata;
+	DBusError error;
+	const char *name = NULL;
+	const char *prefix = NULL;
+	pa_sink *sink;
+	pa_source *source;
+	int status = -1;
+
+	pa_assert(conn);
+	pa_assert(msg);
+	pa_assert(mdata);
+	dbus_error_init(&error);
+
+	if (!dbus_message_get_args(msg, &error, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &prefix, DBUS_TYPE_INVALID)) {
+		pa_dbus_send_error(conn, msg, DBUS_ERROR_INVALID_ARGS, "%s", error.message);
+		dbus_error_free(&error);
+		return;
+	}
+
+	if (!*prefix)
+		prefix = NULL;
+
+	if ((sink = pa_namereg_get(mdata->card->core, name, PA_NAMEREG_SINK)) && sink->card == mdata->card)
+		status = pa_pal_sink_set_pcm_tap(sink, prefix);
+	else if ((source = pa_namereg_get(mdata->card->core, name, PA_NAMEREG_SOURCE)) && source->card == mdata->card)
+		status = pa_pal_source_set_pcm_tap(source, prefix);
+
+	if (status) {
+		pa_dbus_send_error(conn, msg, DBUS_ERROR_FAILED, "Could not set pcm tap of %s", name);
+		return;
+	}
+
+	pa_dbus_send_empty_reply(conn, msg);
+}
+
 int pa_pal_module_extn_init(pa_core *core, pa_card *card)
 {
 	pa_assert(core);
@@ -33,6 +33,7 @@
 #include "pal-jack-format.h"
 
 #include "pal-utils.h"
+#include "pal-routing.h"
 
 #ifdef ENABLE_PAL_SERVICE
 void load_pal_service();
@@ -61,12 +62,14 @@ PA_MODULE_USAGE(
         "module=audio.primary"
         "conf_dir_name= direct from pal conf is present"
         "conf_file_name= pal conf name is present in conf_dir_name"
+        "pcm_tap_dir= dump every sink and source to wav files in this directory"
 );
 
 static const char* const valid_modargs[] = {
     "module",
     "conf_dir_name",
     "conf_file_name",
+    "pcm_tap_dir",
     NULL
 };
 
@@ -89,6 +92,9 @@ struct userdata {
     pa_pal_config_data *config_data;
     char *conf_dir_name;
     char *conf_file_name;
+    char *pcm_tap_dir;
+
+    pa_pal_routing *routing;
 };
 
 
@@ -145,10 +151,20 @@ static void pa_pal_card_create_ports(struct userdata *u, pa_hashmap *ports, pa_h
         port_device_data = PA_DEVICE_PORT_DATA(port);
 
         port_device_data->device = config_port->device;
+        port_device_data->devices[0] = config_port->device;
+        port_device_data->n_devices = 1;
+        if (config_port->n_devices > 1 && config_port->direction == PA_DIRECTION_OUTPUT) {
+            memcpy(port_device_data->devices, config_port->devices, config_port->n_devices * sizeof(pal_device_id_t));
+            port_device_data->n_devices = config_port->n_devices;
+        } else if (config_port->n_devices > 1) {
+            pa_log_error("%s: combo ports are only supported for output, using pal device %u only", config_port->name,
+                         config_port->device);
+        }
         port->priority = config_port->priority;
         port_device_data->default_map = config_port->default_map;
         port_device_data->default_spec.channels = config_port->default_map.channels;
         port_device_data->default_spec.rate = config_port->default_spec.rate;
+        port_device_data->bit_width = config_port->bit_width ? config_port->bit_width : PA_PAL_CARD_DEFAULT_DEVICE_BIT_WIDTH;
 
         if (config_port->pal_devicepp_config)
             port_device_data->pal_devicepp_config = pa_xstrdup(config_port->pal_devicepp_config);
@@ -260,6 +276,8 @@ static int pa_pal_card_create(struct userdata *u) {
 
 static int pa_pal_card_add_source(pa_module *module, pa_card *card, const char *driver, char *module_name, pa_pal_source_config *source,
                                   pa_pal_source_handle_t **source_handle) {
+    struct userdata *u = module->userdata;
+    char *prefix;
     uint32_t rc = 0;
 
     pa_assert(module);
@@ -272,6 +290,12 @@ static int pa_pal_card_add_source(pa_module *module, pa_card *card, const char *
     rc = pa_pal_source_create(module, card, driver, module_name, source, source_handle);
     if (rc) {
         pa_log_error("%s: source %s create failed %d ", __func__, source->name, rc);
+    } else if (u->pcm_tap_dir) {
+        pa_source *s = ((pa_pal_source_data *)*source_handle)->pa_sdata->source;
+
+        prefix = pa_sprintf_malloc("%s/%s", u->pcm_tap_dir, s->name);
+        pa_pal_source_set_pcm_tap(s, prefix);
+        pa_xfree(prefix);
     }
 
     return rc;
@@ -325,6 +349,8 @@ static void pa_pal_card_free_sources(struct userdata *u, const char *profile_nam
 
 static int pa_pal_card_add_sink(pa_module *module, pa_card *card, const char *driver, char *module_name,
                                  pa_pal_sink_config *sink, pa_pal_sink_handle_t **sink_handle) {
+    struct userdata *u = module->userdata;
+    char *prefix;
     uint32_t rc = 0;
 
     pa_assert(module);
@@ -337,6 +363,12 @@ static int pa_pal_card_add_sink(pa_module *module, pa_card *card, const char *dr
     rc = pa_pal_sink_create(module, card, driver, module_name, sink, sink_handle);
     if (rc) {
         pa_log_error("%s: sink %s create failed %d ", __func__, sink->name, rc);
+    } else if (u->pcm_tap_dir && !((pa_pal_sink_data *)*sink_handle)->pal_sdata->compressed) {
+        pa_sink *s = ((pa_pal_sink_data *)*sink_handle)->pa_sdata->sink;
+
+        prefix = pa_sprintf_malloc("%s/%s", u->pcm_tap_dir, s->name);
+        pa_pal_sink_set_pcm_tap(s, prefix);
+        pa_xfree(prefix);
     }
 
     return rc;
@@ -757,6 +789,7 @@ static void pa_pal_card_add_dynamic_sink(pa_device_port *port, pa_pal_jack_out_c
 
     pa_format_info *current_format = NULL;
     pa_format_info *config_format = NULL;
+    pa_format_info *passthrough_format = NULL;
 
     pa_idxset *current_formats = NULL;
 
@@ -768,7 +801,7 @@ static void pa_pal_card_add_dynamic_sink(pa_device_port *port, pa_pal_jack_out_c
     char ss_buf[PA_SAMPLE_SPEC_SNPRINT_MAX];
 
     void *state = NULL;
-    uint32_t i;
+    uint32_t i, j;
 
     pa_assert(port);
     pa_assert(config);
@@ -852,6 +885,15 @@ static void pa_pal_card_add_dynamic_sink(pa_device_port *port, pa_pal_jack_out_c
     requested_formats = pa_idxset_new(NULL, NULL);
     pa_idxset_put(requested_formats, requested_format, NULL);
 
+    /* the jack only reports pcm, passthrough formats the sink is configured
+     * for are offered alongside so the receiver can decode them */
+    if (config->encoding == PA_ENCODING_PCM) {
+        PA_IDXSET_FOREACH(passthrough_format, sink->formats, j) {
+            if (pa_pal_sink_is_iec61937_encoding(passthrough_format->encoding))
+                pa_idxset_put(requested_formats, pa_format_info_copy(passthrough_format), NULL);
+        }
+    }
+
     new_sink = *sink;
     new_sink.default_spec = config->ss;
     new_sink.default_map = config->map;
@@ -1101,6 +1143,7 @@ int pa__init(pa_module *m) {
 
     u->conf_dir_name = pa_xstrdup(pa_modargs_get_value(ma, "conf_dir_name", NULL));
     u->conf_file_name = pa_xstrdup(pa_modargs_get_value(ma, "conf_file_name", NULL));
+    u->pcm_tap_dir = pa_xstrdup(pa_modargs_get_value(ma, "pcm_tap_dir", NULL));
 
     u->config_data = pa_pal_config_parse_new(u->conf_dir_name, u->conf_file_name);
     if (!u->config_data) {
@@ -1159,6 +1202,9 @@ int pa__init(pa_module *m) {
 
     pa_pal_card_enable_jack_detection(u);
 
+    if (pa_dynarray_size(u->config_data->routing_rules))
+        u->routing = pa_pal_routing_new(u->core, u->config_data->routing_rules);
+
 #ifdef ENABLE_PAL_SERVICE
     load_pal_service();
 #endif
@@ -1181,6 +1227,9 @@ void pa__done(pa_module *m) {
     if (!(u = m->userdata))
         return;
 
+    if (u->routing)
+        pa_pal_routing_free(u->routing);
+
     pa_pal_module_extn_deinit();
     pa_pal_loopback_deinit();
 
@@ -1222,6 +1271,8 @@ void pa__done(pa_module *m) {
     if (u->conf_file_name)
         pa_xfree(u->conf_file_name);
 
+    pa_xfree(u->pcm_tap_dir);
+
     if (u->modargs)
         pa_modargs_free(u->modargs);
 
@@ -0,0 +1,600 @@
+/*
+ * Copyright (c) 2025 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <pulse/xmalloc.h>
+#include <pulsecore/atomic.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/hashmap.h>
+#include <pulsecore/idxset.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/mutex.h>
+#include <pulsecore/sample-util.h>
+#include <pulsecore/sconv.h>
+#include <pulsecore/thread.h>
+
+#include "pal-capture-share.h"
+#include "pal-utils.h"
+
+/* a consumer can fall this many periods behind before periods are dropped */
+#define PA_PAL_CAPTURE_SHARE_RING_PERIODS 4
+
+struct pa_pal_capture_consumer {
+    pa_pal_capture_share *share;
+    pa_sample_spec ss;
+    pa_channel_map map;
+    size_t frame_size;
+
+    /* under share->mutex */
+    bool attached;
+
+    /* capture thread only, computed for the stream of stream_serial */
+    unsigned stream_serial;
+    bool copy; /* same spec and map as the stream */
+    unsigned sel[PA_CHANNELS_MAX]; /* source channel i is stream channel sel[i] */
+    pa_convert_func_t from_float;
+    float *float_buf;
+    void *out_buf;
+
+    /* single producer (capture thread), single consumer (IO thread) byte ring */
+    uint8_t *ring;
+    size_t ring_size; /* power of 2 */
+    pa_atomic_t read_idx;  /* only advanced by the IO thread */
+    pa_atomic_t write_idx; /* only advanced by the capture thread */
+    pa_atomic_t overruns;
+
+    pa_fdsem *fdsem;
+};
+
+struct pa_pal_capture_share {
+    char *group;
+    unsigned ref; /* main thread only */
+
+    pal_stream_type_t type;
+    struct pal_device device;
+    size_t period_frames;
+    pa_usec_t period_us;
+
+    pa_mutex *mutex;
+    pa_cond *cond;
+    pa_thread *thread;
+
+    /* under mutex */
+    bool exit;
+    pa_idxset *consumers;
+    unsigned n_attached;
+    pa_sample_spec ss; /* grows with the members while the stream is closed */
+    pa_channel_map map;
+    size_t buffer_count;
+
+    /* written by the capture thread under mutex, the stream is only used by it */
+    pal_stream_handle_t *stream_handle;
+    pa_sample_spec stream_ss;
+    pa_channel_map stream_map;
+    unsigned stream_serial;
+
+    /* capture thread only */
+    void *period_buf;
+    size_t period_size;
+    float *float_buf;
+    pa_convert_func_t to_float;
+};
+
+/* main thread only */
+static pa_hashmap *shares = NULL;
+
+/* Called from capture thread context, without the mutex */
+static pal_stream_handle_t* pa_pal_capture_share_open(pa_pal_capture_share *share, pa_sample_spec *ss, pa_channel_map *map,
+                                                      size_t buffer_count) {
+    struct pal_stream_attributes attr;
+    pal_buffer_config_t out_buf_cfg, in_buf_cfg;
+    pal_stream_handle_t *handle = NULL;
+    int rc;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = share->type;
+    attr.info.opt_stream_info.version = 1;
+    attr.info.opt_stream_info.duration_us = -1;
+    attr.direction = PAL_AUDIO_INPUT;
+    attr.in_media_config.sample_rate = ss->rate;
+    attr.in_media_config.aud_fmt_id = pa_pal_util_get_pal_pcm_format(ss->format, &attr.in_media_config.bit_width);
+
+    if (!pa_pal_channel_map_to_pal(map, &attr.in_media_config.ch_info)) {
+        pa_log_error("%s: unsupported channel map for %s", __func__, share->group);
+        return NULL;
+    }
+
+    if ((rc = pal_stream_open(&attr, 1, &share->device, 0, NULL, NULL, 0, &handle))) {
+        pa_log_error("%s: could not open shared stream %s, error %d", __func__, share->group, rc);
+        return NULL;
+    }
+
+    share->period_size = share->period_frames * pa_frame_size(ss);
+
+    out_buf_cfg.buf_size = 0;
+    out_buf_cfg.buf_count = 0;
+    in_buf_cfg.buf_size = share->period_size;
+    in_buf_cfg.buf_count = buffer_count;
+
+    if (pal_stream_set_buffer_size(handle, &in_buf_cfg, &out_buf_cfg))
+        pa_log_error("%s: pal_stream_set_buffer_size failed for %s", __func__, share->group);
+
+    if ((rc = pal_stream_start(handle))) {
+        pa_log_error("%s: could not start shared stream %s, error %d", __func__, share->group, rc);
+        pal_stream_close(handle);
+        return NULL;
+    }
+
+    pa_xfree(share->period_buf);
+    pa_xfree(share->float_buf);
+    share->period_buf = pa_xmalloc(share->period_size);
+    share->float_buf = pa_xnew(float, share->period_frames * ss->channels);
+    share->to_float = pa_get_convert_to_float32ne_function(ss->format);
+
+    pa_log_info("%s: shared stream %s opened %p, %u channels at %uHz", __func__, share->group, handle, ss->channels, ss->rate);
+
+    return handle;
+}
+
+/* Called from capture thread context, without the mutex */
+static void pa_pal_capture_share_close(pa_pal_capture_share *share, pal_stream_handle_t *handle) {
+    int rc;
+
+    if ((rc = pal_stream_stop(handle)))
+        pa_log_error("%s: pal_stream_stop failed for %p error %d", __func__, handle, rc);
+
+    if ((rc = pal_stream_close(handle)))
+        pa_log_error("%s: could not close %p error %d", __func__, handle, rc);
+
+    pa_log_info("%s: shared stream %s closed", __func__, share->group);
+}
+
+/* Called from capture thread context with the mutex held */
+static void pa_pal_capture_consumer_setup(pa_pal_capture_consumer *c, pa_pal_capture_share *share) {
+    unsigned i, j;
+
+    c->stream_serial = share->stream_serial;
+    c->copy = pa_sample_spec_equal(&c->ss, &share->stream_ss) && pa_channel_map_equal(&c->map, &share->stream_map);
+
+    /* same position if the stream has it, else by index */
+    for (i = 0; i < c->ss.channels; i++) {
+        c->sel[i] = i % share->stream_ss.channels;
+
+        for (j = 0; j < share->stream_map.channels; j++) {
+            if (share->stream_map.map[j] == c->map.map[i]) {
+                c->sel[i] = j;
+                break;
+            }
+        }
+    }
+}
+
+/* Called from capture thread context. Whole periods or nothing, so the
+ * stream stays frame aligned for the reader */
+static void pa_pal_capture_consumer_push(pa_pal_capture_consumer *c, const void *data, size_t length) {
+    unsigned w = (unsigned)pa_atomic_load(&c->write_idx);
+    size_t offset, n;
+
+    if (length > c->ring_size - (w - (unsigned)pa_atomic_load(&c->read_idx))) {
+        pa_atomic_inc(&c->overruns);
+        return;
+    }
+
+    offset = w & (c->ring_size - 1);
+    n = PA_MIN(length, c->ring_size - offset);
+    memcpy(c->ring + offset, data, n);
+    memcpy(c->ring, (const uint8_t *)data + n, length - n);
+
+    pa_atomic_store(&c->write_idx, (int)(w + length));
+}
+
+/* Called from capture thread context with the mutex held. Converts the
+ * period once to float for all consumers that don't take it as is, the
+ * converters are the optimized ones of the core */
+static void pa_pal_capture_share_deliver(pa_pal_capture_share *share, size_t frames) {
+    pa_pal_capture_consumer *c;
+    const float *in;
+    float *out;
+    bool have_float = false;
+    uint32_t idx;
+    size_t i;
+    unsigned ch;
+
+    PA_IDXSET_FOREACH(c, share->consumers, idx) {
+        if (!c->attached)
+            continue;
+
+        if (c->stream_serial != share->stream_serial)
+            pa_pal_capture_consumer_setup(c, share);
+
+        if (c->copy) {
+            pa_pal_capture_consumer_push(c, share->period_buf, frames * c->frame_size);
+        } else {
+            if (!have_float) {
+                share->to_float(frames * share->stream_ss.channels, share->period_buf, share->float_buf);
+                have_float = true;
+            }
+
+            in = share->float_buf;
+            out = c->float_buf;
+            for (i = 0; i < frames; i++) {
+                for (ch = 0; ch < c->ss.channels; ch++)
+                    *out++ = in[c->sel[ch]];
+
+                in += share->stream_ss.channels;
+            }
+
+            c->from_float(frames * c->ss.channels, c->float_buf, c->out_buf);
+            pa_pal_capture_consumer_push(c, c->out_buf, frames * c->frame_size);
+        }
+
+        pa_fdsem_post(c->fdsem);
+    }
+}
+
+static void pa_pal_capture_share_thread_func(void *userdata) {
+    pa_pal_capture_share *share = userdata;
+    pal_stream_handle_t *handle;
+    struct pal_buffer in_buf;
+    pa_sample_spec ss;
+    pa_channel_map map;
+    size_t buffer_count;
+    int ret;
+
+    pa_log_debug("Capture share %s thread starting up", share->group);
+
+    pa_mutex_lock(share->mutex);
+
+    while (!share->exit) {
+        if (!share->n_attached) {
+            if ((handle = share->stream_handle)) {
+                share->stream_handle = NULL;
+                pa_mutex_unlock(share->mutex);
+                pa_pal_capture_share_close(share, handle);
+                pa_mutex_lock(share->mutex);
+                continue;
+            }
+
+            pa_cond_wait(share->cond, share->mutex);
+            continue;
+        }
+
+        if (!share->stream_handle) {
+            /* members only change the config while no one is attached */
+            ss = share->ss;
+            map = share->map;
+            buffer_count = share->buffer_count;
+            pa_mutex_unlock(share->mutex);
+
+            handle = pa_pal_capture_share_open(share, &ss, &map, buffer_count);
+
+            pa_mutex_lock(share->mutex);
+            if (!handle) {
+                /* try again a period later, consumers get nothing meanwhile */
+                pa_mutex_unlock(share->mutex);
+                pa_msleep(share->period_us / PA_USEC_PER_MSEC);
+                pa_mutex_lock(share->mutex);
+                continue;
+            }
+
+            share->stream_handle = handle;
+            share->stream_ss = ss;
+            share->stream_map = map;
+            share->stream_serial++;
+        }
+
+        handle = share->stream_handle;
+        pa_mutex_unlock(share->mutex);
+
+        memset(&in_buf, 0, sizeof(in_buf));
+        in_buf.buffer = share->period_buf;
+        in_buf.size = share->period_size;
+
+        if ((ret = pal_stream_read(handle, &in_buf)) <= 0) {
+            pa_log_error("%s: pal_stream_read failed for %s, ret = %d", __func__, share->group, ret);
+            /* keep the timeline of the consumers, the period is silence */
+            pa_silence_memory(share->period_buf, share->period_size, &share->stream_ss);
+            pa_msleep(share->period_us / PA_USEC_PER_MSEC);
+            ret = share->period_size;
+        }
+
+        pa_mutex_lock(share->mutex);
+        pa_pal_capture_share_deliver(share, (size_t)ret / pa_frame_size(&share->stream_ss));
+    }
+
+    handle = share->stream_handle;
+    share->stream_handle = NULL;
+    pa_mutex_unlock(share->mutex);
+
+    if (handle)
+        pa_pal_capture_share_close(share, handle);
+
+    pa_log_debug("Capture share %s thread shutting down", share->group);
+}
+
+static pa_pal_capture_share* pa_pal_capture_share_new(const char *group, pal_stream_type_t type, const struct pal_device *device,
+                                                      const pa_sample_spec *ss, const pa_channel_map *map, size_t buffer_size,
+                                                      size_t buffer_count) {
+    pa_pal_capture_share *share;
+    char *thread_name;
+
+    share = pa_xnew0(pa_pal_capture_share, 1);
+    share->group = pa_xstrdup(group);
+    share->ref = 1;
+    share->type = type;
+    share->device = *device;
+    share->ss = *ss;
+    share->map = *map;
+    share->buffer_count = buffer_count;
+
+    /* the period of the first member, in time */
+    share->period_frames = PA_MAX(buffer_size / pa_frame_size(ss), 1U);
+    share->period_us = pa_bytes_to_usec(share->period_frames * pa_frame_size(ss), ss);
+
+    share->mutex = pa_mutex_new(false /* recursive  */, false /* inherit_priority */);
+    share->cond = pa_cond_new();
+    share->consumers = pa_idxset_new(NULL, NULL);
+
+    thread_name = pa_sprintf_malloc("pal-share-%s", group);
+    share->thread = pa_thread_new(thread_name, pa_pal_capture_share_thread_func, share);
+    pa_xfree(thread_name);
+
+    if (!share->thread) {
+        pa_log_error("%s: could not create capture thread for %s", __func__, group);
+        pa_idxset_free(share->consumers, NULL);
+        pa_cond_free(share->cond);
+        pa_mutex_free(share->mutex);
+        pa_xfree(share->group);
+        pa_xfree(share);
+        return NULL;
+    }
+
+    return share;
+}
+
+pa_pal_capture_share* pa_pal_capture_share_get(const char *group, pal_stream_type_t type, const struct pal_device *device,
+                                               const pa_sample_spec *ss, const pa_channel_map *map, size_t buffer_size,
+                                               size_t buffer_count) {
+    pa_pal_capture_share *share;
+
+    pa_assert(group);
+    pa_assert(device);
+    pa_assert(ss);
+    pa_assert(map);
+
+    if (!shares)
+        shares = pa_hashmap_new(pa_idxset_string_hash_func, pa_idxset_string_compare_func);
+
+    if (!(share = pa_hashmap_get(shares, group))) {
+        if ((share = pa_pal_capture_share_new(group, type, device, ss, map, buffer_size, buffer_count)))
+            pa_hashmap_put(shares, share->group, share);
+
+        return share;
+    }
+
+    if (share->type != type || share->device.id != device->id || share->ss.rate != ss->rate) {
+        pa_log_error("%s: member does not match share group %s (type %d device %d rate %u)", __func__, group,
+                     share->type, share->device.id, share->ss.rate);
+        return NULL;
+    }
+
+    pa_mutex_lock(share->mutex);
+
+    if (!share->stream_handle && !share->n_attached) {
+        if (ss->channels > share->ss.channels) {
+            share->ss.channels = ss->channels;
+            share->map = *map;
+        }
+
+        if (pa_sample_size(ss) > pa_sample_size(&share->ss))
+            share->ss.format = ss->format;
+
+        share->buffer_count = PA_MAX(share->buffer_count, buffer_count);
+    } else if (ss->channels > share->ss.channels) {
+        pa_log_warn("%s: share group %s is capturing, %u channels are selected from %u", __func__, group,
+                    ss->channels, share->ss.channels);
+    }
+
+    pa_mutex_unlock(share->mutex);
+
+    share->ref++;
+
+    return share;
+}
+
+void pa_pal_capture_share_unref(pa_pal_capture_share *share) {
+    pa_assert(share);
+    pa_assert(share->ref > 0);
+
+    if (--share->ref)
+        return;
+
+    pa_assert(pa_idxset_isempty(share->consumers));
+
+    pa_mutex_lock(share->mutex);
+    share->exit = true;
+    pa_cond_signal(share->cond, 1);
+    pa_mutex_unlock(share->mutex);
+
+    pa_thread_free(share->thread);
+
+    pa_hashmap_remove(shares, share->group);
+    if (pa_hashmap_isempty(shares)) {
+        pa_hashmap_free(shares);
+        shares = NULL;
+    }
+
+    pa_idxset_free(share->consumers, NULL);
+    pa_cond_free(share->cond);
+    pa_mutex_free(share->mutex);
+    pa_xfree(share->period_buf);
+    pa_xfree(share->float_buf);
+    pa_xfree(share->group);
+    pa_xfree(share);
+}
+
+pal_device_id_t pa_pal_capture_share_get_device_id(pa_pal_capture_share *share) {
+    pa_assert(share);
+
+    return share->device.id;
+}
+
+pa_pal_capture_consumer* pa_pal_capture_consumer_new(pa_pal_capture_share *share, const pa_sample_spec *ss, const pa_channel_map *map,
+                                                     size_t buffer_size, size_t buffer_count) {
+    pa_pal_capture_consumer *c;
+    size_t wanted;
+
+    pa_assert(share);
+    pa_assert(ss);
+    pa_assert(map);
+
+    c = pa_xnew0(pa_pal_capture_consumer, 1);
+    c->share = share;
+    c->ss = *ss;
+    c->map = *map;
+    c->frame_size = pa_frame_size(ss);
+
+    if (!(c->fdsem = pa_fdsem_new())) {
+        pa_log_error("%s: could not create fdsem", __func__);
+        pa_xfree(c);
+        return NULL;
+    }
+
+    c->from_float = pa_get_convert_from_float32ne_function(ss->format);
+    c->float_buf = pa_xnew(float, share->period_frames * ss->channels);
+    c->out_buf = pa_xmalloc(share->period_frames * c->frame_size);
+
+    wanted = PA_MAX(buffer_size * buffer_count, PA_PAL_CAPTURE_SHARE_RING_PERIODS * share->period_frames * c->frame_size);
+    c->ring_size = 1;
+    while (c->ring_size < wanted)
+        c->ring_size <<= 1;
+    c->ring = pa_xmalloc(c->ring_size);
+
+    pa_atomic_store(&c->read_idx, 0);
+    pa_atomic_store(&c->write_idx, 0);
+    pa_atomic_store(&c->overruns, 0);
+
+    pa_mutex_lock(share->mutex);
+    pa_idxset_put(share->consumers, c, NULL);
+    pa_mutex_unlock(share->mutex);
+
+    return c;
+}
+
+void pa_pal_capture_consumer_free(pa_pal_capture_consumer *c) {
+    pa_pal_capture_share *share;
+
+    pa_assert(c);
+
+    share = c->share;
+
+    pa_mutex_lock(share->mutex);
+    if (c->attached) {
+        c->attached = false;
+        share->n_attached--;
+        pa_cond_signal(share->cond, 1);
+    }
+    pa_idxset_remove_by_data(share->consumers, c, NULL);
+    pa_mutex_unlock(share->mutex);
+
+    pa_fdsem_free(c->fdsem);
+    pa_xfree(c->float_buf);
+    pa_xfree(c->out_buf);
+    pa_xfree(c->ring);
+    pa_xfree(c);
+}
+
+void pa_pal_capture_consumer_attach(pa_pal_capture_consumer *c) {
+    pa_pal_capture_share *share;
+
+    pa_assert(c);
+
+    share = c->share;
+
+    pa_mutex_lock(share->mutex);
+
+    if (!c->attached) {
+        /* nothing is pushed while detached, drop what is left from before */
+        pa_atomic_store(&c->read_idx, pa_atomic_load(&c->write_idx));
+        c->attached = true;
+        share->n_attached++;
+        pa_cond_signal(share->cond, 1);
+    }
+
+    pa_mutex_unlock(share->mutex);
+}
+
+void pa_pal_capture_consumer_detach(pa_pal_capture_consumer *c) {
+    pa_pal_capture_share *share;
+
+    pa_assert(c);
+
+    share = c->share;
+
+    pa_mutex_lock(share->mutex);
+
+    if (c->attached) {
+        c->attached = false;
+        share->n_attached--;
+        pa_cond_signal(share->cond, 1);
+    }
+
+    pa_mutex_unlock(share->mutex);
+}
+
+pa_fdsem* pa_pal_capture_consumer_get_fdsem(pa_pal_capture_consumer *c) {
+    pa_assert(c);
+
+    return c->fdsem;
+}
+
+size_t pa_pal_capture_consumer_get_queued(pa_pal_capture_consumer *c) {
+    pa_assert(c);
+
+    return (unsigned)pa_atomic_load(&c->write_idx) - (unsigned)pa_atomic_load(&c->read_idx);
+}
+
+size_t pa_pal_capture_consumer_read(pa_pal_capture_consumer *c, void *data, size_t length) {
+    unsigned r = (unsigned)pa_atomic_load(&c->read_idx);
+    size_t offset, n;
+
+    pa_assert(c);
+
+    length = pa_frame_align(PA_MIN(length, pa_pal_capture_consumer_get_queued(c)), &c->ss);
+    if (!length)
+        return 0;
+
+    offset = r & (c->ring_size - 1);
+    n = PA_MIN(length, c->ring_size - offset);
+    memcpy(data, c->ring + offset, n);
+    memcpy((uint8_t *)data + n, c->ring, length - n);
+
+    pa_atomic_store(&c->read_idx, (int)(r + length));
+
+    return length;
+}
+
+unsigned pa_pal_capture_consumer_take_overruns(pa_pal_capture_consumer *c) {
+    int n;
+
+    pa_assert(c);
+
+    if ((n = pa_atomic_load(&c->overruns)))
+        pa_atomic_sub(&c->overruns, n);
+
+    return (unsigned)n;
+}
+
+pa_usec_t pa_pal_capture_consumer_get_period_usec(pa_pal_capture_consumer *c) {
+    pa_assert(c);
+
+    return c->share->period_us;
+}
@@ -21,6 +21,7 @@
 #include "pal-source.h"
 #include "pal-utils.h"
 #include "pal-loopback.h"
+#include "pal-routing.h"
 
 #define PAL_CARD_DEFAULT_CONF_NAME "default.conf"
 #define PAL_CARD_DEFAULT_TARGET_NAME_LENGTH 7
@@ -495,6 +496,39 @@ exit:
     return ret;
 }
 
+static int pa_pal_config_parse_standby_hysteresis(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_sink_config *sink = NULL;
+    pa_pal_source_config *source = NULL;
+
+    int ret = -1;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    if ((sink = pa_pal_config_get_sink(config_data->sinks, state->section))) {
+        if (pa_atou(state->rvalue, &sink->standby_hysteresis_ms) < 0) {
+            pa_log_error("%s: invalid standby hysteresis %s for sink %s", __func__, state->rvalue, sink->name);
+            goto exit;
+        }
+        pa_log_debug("%s adding standby hysteresis %ums to sink %s", __func__, sink->standby_hysteresis_ms, sink->name);
+    } else if ((source = pa_pal_config_get_source(config_data->sources, state->section))) {
+        if (pa_atou(state->rvalue, &source->standby_hysteresis_ms) < 0) {
+            pa_log_error("%s: invalid standby hysteresis %s for source %s", __func__, state->rvalue, source->name);
+            goto exit;
+        }
+        pa_log_debug("%s adding standby hysteresis %ums to source %s", __func__, source->standby_hysteresis_ms, source->name);
+    } else {
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    return ret;
+}
+
 static int pa_pal_config_parse_sample_rates(pa_config_parser_state *state) {
     pa_pal_config_data* config_data = state->userdata;
     pa_pal_sink_config *sink = NULL;
@@ -838,6 +872,341 @@ static int pa_pal_config_parse_use_hw_volume(pa_config_parser_state *state) {
     return ret;
 }
 
+static int pa_pal_config_parse_tsched(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_sink_config *sink = NULL;
+    int ret = -1;
+    int b;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    if ((sink = pa_pal_config_get_sink(config_data->sinks, state->section))) {
+        if ((b = pa_parse_boolean(state->rvalue)) < 0) {
+            pa_log_error("%s: invalid tsched value %s for sink %s", __func__, state->rvalue, sink->name);
+            goto exit;
+        }
+
+        sink->tsched = b;
+        pa_log_debug("%s setting tsched %d to sink %s", __func__, sink->tsched, sink->name);
+    } else {
+        pa_log_error("%s: invalid section name %s", __func__, state->section);
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    return ret;
+}
+
+static int pa_pal_config_parse_tsched_watermark(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_sink_config *sink = NULL;
+    int ret = -1;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    if ((sink = pa_pal_config_get_sink(config_data->sinks, state->section))) {
+        if (pa_atou(state->rvalue, &sink->tsched_watermark_ms)) {
+            pa_log_error("%s: invalid tsched watermark %s for sink %s", __func__, state->rvalue, sink->name);
+            goto exit;
+        }
+
+        pa_log_debug("%s adding tsched watermark %dms to sink %s", __func__, sink->tsched_watermark_ms, sink->name);
+    } else {
+        pa_log_error("%s: invalid section name %s", __func__, state->section);
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    return ret;
+}
+
+
+static int pa_pal_config_parse_rewind_buffer_count(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_sink_config *sink = NULL;
+    int ret = -1;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    if ((sink = pa_pal_config_get_sink(config_data->sinks, state->section))) {
+        if (pa_atou(state->rvalue, &sink->rewind_buffer_count)) {
+            pa_log_error("%s: invalid rewind buffer count %s for sink %s", __func__, state->rvalue, sink->name);
+            goto exit;
+        }
+
+        pa_log_debug("%s adding rewind buffer count %d to sink %s", __func__, sink->rewind_buffer_count, sink->name);
+    } else {
+        pa_log_error("%s: invalid section name %s", __func__, state->section);
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    return ret;
+}
+
+static int pa_pal_config_parse_dynamic_latency(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_sink_config *sink = NULL;
+    int ret = -1;
+    int b;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    if ((sink = pa_pal_config_get_sink(config_data->sinks, state->section))) {
+        if ((b = pa_parse_boolean(state->rvalue)) < 0) {
+            pa_log_error("%s: invalid dynamic latency value %s for sink %s", __func__, state->rvalue, sink->name);
+            goto exit;
+        }
+
+        sink->dynamic_latency = b;
+        pa_log_debug("%s setting dynamic latency %d to sink %s", __func__, sink->dynamic_latency, sink->name);
+    } else {
+        pa_log_error("%s: invalid section name %s", __func__, state->section);
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    return ret;
+}
+
+static int pa_pal_config_parse_latency_range(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_sink_config *sink = NULL;
+    uint32_t *latency_ms;
+    int ret = -1;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->lvalue);
+    pa_assert(state->rvalue);
+
+    if ((sink = pa_pal_config_get_sink(config_data->sinks, state->section))) {
+        latency_ms = pa_streq(state->lvalue, "min-latency-ms") ? &sink->min_latency_ms : &sink->max_latency_ms;
+        if (pa_atou(state->rvalue, latency_ms)) {
+            pa_log_error("%s: invalid %s %s for sink %s", __func__, state->lvalue, state->rvalue, sink->name);
+            goto exit;
+        }
+
+        pa_log_debug("%s adding %s %d to sink %s", __func__, state->lvalue, *latency_ms, sink->name);
+    } else {
+        pa_log_error("%s: invalid section name %s", __func__, state->section);
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    return ret;
+}
+
+static int pa_pal_config_parse_mmap(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_sink_config *sink = NULL;
+    int ret = -1;
+    int b;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    if ((sink = pa_pal_config_get_sink(config_data->sinks, state->section))) {
+        if ((b = pa_parse_boolean(state->rvalue)) < 0) {
+            pa_log_error("%s: invalid mmap value %s for sink %s", __func__, state->rvalue, sink->name);
+            goto exit;
+        }
+
+        sink->mmap = b;
+        pa_log_debug("%s setting mmap %d to sink %s", __func__, sink->mmap, sink->name);
+    } else {
+        pa_log_error("%s: invalid section name %s", __func__, state->section);
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    return ret;
+}
+
+static int pa_pal_config_parse_gapless(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_sink_config *sink = NULL;
+    int ret = -1;
+    int b;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    if ((sink = pa_pal_config_get_sink(config_data->sinks, state->section))) {
+        if ((b = pa_parse_boolean(state->rvalue)) < 0) {
+            pa_log_error("%s: invalid gapless value %s for sink %s", __func__, state->rvalue, sink->name);
+            goto exit;
+        }
+
+        sink->gapless = b;
+        pa_log_debug("%s setting gapless %d to sink %s", __func__, sink->gapless, sink->name);
+    } else {
+        pa_log_error("%s: invalid section name %s", __func__, state->section);
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    return ret;
+}
+
+static int pa_pal_config_parse_prewarm(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_sink_config *sink = NULL;
+    int ret = -1;
+    int b;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    if ((sink = pa_pal_config_get_sink(config_data->sinks, state->section))) {
+        if ((b = pa_parse_boolean(state->rvalue)) < 0) {
+            pa_log_error("%s: invalid prewarm value %s for sink %s", __func__, state->rvalue, sink->name);
+            goto exit;
+        }
+
+        sink->prewarm = b;
+        pa_log_debug("%s setting prewarm %d to sink %s", __func__, sink->prewarm, sink->name);
+    } else {
+        pa_log_error("%s: invalid section name %s", __func__, state->section);
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    return ret;
+}
+
+static int pa_pal_config_parse_non_blocking(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_source_config *source = NULL;
+    int ret = -1;
+    int b;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    if ((source = pa_pal_config_get_source(config_data->sources, state->section))) {
+        if ((b = pa_parse_boolean(state->rvalue)) < 0) {
+            pa_log_error("%s: invalid non-blocking value %s for source %s", __func__, state->rvalue, source->name);
+            goto exit;
+        }
+
+        source->non_blocking = b;
+        pa_log_debug("%s setting non-blocking %d to source %s", __func__, source->non_blocking, source->name);
+    } else {
+        pa_log_error("%s: invalid section name %s", __func__, state->section);
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    return ret;
+}
+
+static int pa_pal_config_parse_share_group(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_source_config *source = NULL;
+    int ret = 0;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    if ((source = pa_pal_config_get_source(config_data->sources, state->section)) && *state->rvalue) {
+        pa_xfree(source->share_group);
+        source->share_group = pa_xstrdup(state->rvalue);
+        pa_log_debug("%s: source %s is in share group %s", __func__, source->name, source->share_group);
+    } else {
+        pa_log_error("%s: invalid section name %s", __func__, state->section);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int pa_pal_config_parse_dsp_effect(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_source_config *source = NULL;
+    int ret = -1;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    if (!(source = pa_pal_config_get_source(config_data->sources, state->section))) {
+        pa_log_error("%s: invalid section name %s", __func__, state->section);
+        goto exit;
+    }
+
+    if (pa_streq(state->rvalue, "none")) {
+        source->dsp_effect = PAL_AUDIO_EFFECT_NONE;
+    } else if (pa_streq(state->rvalue, "ec")) {
+        source->dsp_effect = PAL_AUDIO_EFFECT_EC;
+    } else if (pa_streq(state->rvalue, "ns")) {
+        source->dsp_effect = PAL_AUDIO_EFFECT_NS;
+    } else if (pa_streq(state->rvalue, "ecns")) {
+        source->dsp_effect = PAL_AUDIO_EFFECT_ECNS;
+    } else {
+        pa_log_error("%s: invalid dsp effect %s for source %s", __func__, state->rvalue, source->name);
+        goto exit;
+    }
+
+    pa_log_debug("%s: dsp effect %s for source %s", __func__, state->rvalue, source->name);
+    ret = 0;
+
+exit:
+    return ret;
+}
+
+/* a shared stream captures at the highest rate of its members, they all run at it */
+static void pa_pal_config_resolve_share_groups(pa_pal_config_data *config_data) {
+    pa_pal_source_config *source, *member;
+    uint32_t rate;
+    void *state, *state2;
+
+    PA_HASHMAP_FOREACH(source, config_data->sources, state) {
+        if (!source->share_group)
+            continue;
+
+        rate = source->default_spec.rate;
+        PA_HASHMAP_FOREACH(member, config_data->sources, state2)
+            if (pa_safe_streq(member->share_group, source->share_group))
+                rate = PA_MAX(rate, member->default_spec.rate);
+
+        if (rate != source->default_spec.rate) {
+            pa_log_info("%s: source %s runs at %uHz of share group %s", __func__, source->name, rate, source->share_group);
+            source->default_spec.rate = rate;
+        }
+    }
+}
 
 static void pa_pal_config_free_sink(pa_pal_sink_config *sink) {
     pa_assert(sink);
@@ -884,6 +1253,8 @@ static void pa_pal_config_free_source(pa_pal_source_config *source) {
     if (source->pal_devicepp_config)
         pa_xfree(source->pal_devicepp_config);
 
+    pa_xfree(source->share_group);
+
     pa_xfree(source);
 } /* end source parsing related functions */
 
@@ -1237,6 +1608,9 @@ exit:
 static int pa_pal_config_parse_port_device(pa_config_parser_state *state) {
     pa_pal_config_data* config_data = state->userdata;
     pa_pal_card_port_config *port;
+    const char *split_state = NULL;
+    pal_device_id_t device;
+    char *name;
     int ret = 0;
 
     pa_assert(config_data);
@@ -1249,14 +1623,30 @@ static int pa_pal_config_parse_port_device(pa_config_parser_state *state) {
         goto exit;
     }
 
-    port->device = pa_pal_util_device_name_to_enum((const char *)state->rvalue);
-    if (port->device != PAL_DEVICE_NONE) {
-        goto exit;
-    } else {
+    /* DEV_A+DEV_B declares a combo port, one stream routed to all of them */
+    port->n_devices = 0;
+    while ((name = pa_split(state->rvalue, "+", &split_state))) {
+        device = pa_pal_util_device_name_to_enum(name);
+        pa_xfree(name);
+
+        if (device == PAL_DEVICE_NONE || port->n_devices == PA_PAL_CARD_MAX_PORT_DEVICES) {
+            pa_log_error("%s: invalid port device %s ", __func__, state->rvalue);
+            port->n_devices = 0;
+            ret = -1;
+            goto exit;
+        }
+
+        port->devices[port->n_devices++] = device;
+    }
+
+    if (!port->n_devices) {
         pa_log_error("%s: invalid port device %s ", __func__, state->rvalue);
         ret = -1;
+        goto exit;
     }
 
+    port->device = port->devices[0];
+
 exit:
     return ret;
 }
@@ -1543,6 +1933,52 @@ exit:
     return ret;
 }
 
+static int pa_pal_config_parse_port_bit_width(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_card_port_config *port;
+    uint32_t bit_width;
+    int ret = 0;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    port = pa_pal_config_get_port(config_data->ports, state->section);
+    if (!port) {
+        ret = -1;
+        goto exit;
+    }
+
+    if (pa_atou(state->rvalue, &bit_width) < 0 || (bit_width != 16 && bit_width != 24 && bit_width != 32)) {
+        pa_log_error("%s: invalid port bit width %s(it should be 16, 24 or 32)", __func__, state->rvalue);
+        ret = -1;
+        goto exit;
+    }
+
+    port->bit_width = bit_width;
+
+exit:
+    return ret;
+}
+
+static int pa_pal_config_parse_routing_rule(pa_config_parser_state *state) {
+    pa_pal_config_data* config_data = state->userdata;
+    pa_pal_routing_rule *rule;
+
+    pa_assert(config_data);
+    pa_assert(state);
+    pa_assert(state->rvalue);
+
+    if (!(rule = pa_pal_routing_rule_parse(state->rvalue))) {
+        pa_log_error("%s: invalid routing rule %s", __func__, state->rvalue);
+        return -1;
+    }
+
+    pa_dynarray_append(config_data->routing_rules, rule);
+
+    return 0;
+}
+
 /* function to parser conf file to get card related info */
 pa_pal_config_data* pa_pal_config_parse_new(char *dir, char *conf_file_name) {
     pa_pal_config_data *config_data;
@@ -1559,6 +1995,10 @@ pa_pal_config_data* pa_pal_config_parse_new(char *dir, char *conf_file_name) {
         { "device",                      pa_pal_config_parse_port_device,                         NULL, NULL },
         { "hdmi-tx-state",               pa_pal_config_parse_port_sys_path,                       NULL, NULL },
         { "format-detection",            pa_pal_config_parse_port_format_detection,               NULL, NULL },
+        { "bit-width",                   pa_pal_config_parse_port_bit_width,                      NULL, NULL },
+
+        /* [Routing] */
+        { "rule",                        pa_pal_config_parse_routing_rule,                        NULL, "Routing" },
 
         /* [Profile... ] */
         { "max-sink-channels",           pa_pal_config_parse_profile_max_sink_channels,           NULL, NULL },
@@ -1566,10 +2006,27 @@ pa_pal_config_data* pa_pal_config_parse_new(char *dir, char *conf_file_name) {
 
         { "use-hw-volume",               pa_pal_config_parse_use_hw_volume,                       NULL, NULL },
 
+        /* [Sink... ] */
+        { "tsched",                      pa_pal_config_parse_tsched,                              NULL, NULL },
+        { "tsched-watermark-ms",         pa_pal_config_parse_tsched_watermark,                    NULL, NULL },
+        { "rewind-buffer-count",         pa_pal_config_parse_rewind_buffer_count,                 NULL, NULL },
+        { "dynamic-latency",             pa_pal_config_parse_dynamic_latency,                     NULL, NULL },
+        { "min-latency-ms",              pa_pal_config_parse_latency_range,                       NULL, NULL },
+        { "max-latency-ms",              pa_pal_config_parse_latency_range,                       NULL, NULL },
+        { "mmap",                        pa_pal_config_parse_mmap,                                NULL, NULL },
+        { "gapless",                     pa_pal_config_parse_gapless,                             NULL, NULL },
+        { "prewarm",                     pa_pal_config_parse_prewarm,                             NULL, NULL },
+
+        /* [Source... ] */
+        { "non-blocking",                pa_pal_config_parse_non_blocking,                        NULL, NULL },
+        { "share-group",                 pa_pal_config_parse_share_group,                         NULL, NULL },
+        { "dsp-effect",                  pa_pal_config_parse_dsp_effect,                          NULL, NULL },
+
         /* common between sink and source*/
         { "type",                        pa_pal_config_parse_type,                                NULL, NULL },
         { "avoid-processing",            pa_pal_config_parse_avoid_processing,                    NULL, NULL },
         { "alternate-sample-rate",       pa_pal_config_parse_alternative_sample_rate,             NULL, NULL },
+        { "standby-hysteresis-ms",       pa_pal_config_parse_standby_hysteresis,                  NULL, NULL },
 
         /* common between profile, sink and source */
         { "port-names",                  pa_pal_config_parse_port_names,                          NULL, NULL },
@@ -1618,6 +2075,8 @@ pa_pal_config_data* pa_pal_config_parse_new(char *dir, char *conf_file_name) {
 
     config_data->loopbacks = pa_hashmap_new_full(pa_idxset_string_hash_func, pa_idxset_string_compare_func, NULL, (pa_free_cb_t) pa_pal_config_free_loopback);
 
+    config_data->routing_rules = pa_dynarray_new((pa_free_cb_t) pa_pal_routing_rule_free);
+
     conf_full_path = pa_pal_config_parser_get_conf_file_name(dir, conf_file_name);
     if (!conf_full_path) {
         pa_log_error("%s:: Could not find valid conf, exiting ", __func__);
@@ -1630,6 +2089,7 @@ pa_pal_config_data* pa_pal_config_parse_new(char *dir, char *conf_file_name) {
         pa_log_error("%s:: Parsing of conf %s failed, error %d exiting ", __func__, conf_full_path, ret);
         goto fail;
     } else {
+        pa_pal_config_resolve_share_groups(config_data);
         goto exit;
     }
 
@@ -1664,6 +2124,11 @@ void pa_pal_config_parse_free(pa_pal_config_data *config_data) {
         config_data->loopbacks = NULL;
     }
 
+    if (config_data->routing_rules) {
+        pa_dynarray_free(config_data->routing_rules);
+        config_data->routing_rules = NULL;
+    }
+
     if (config_data->default_profile) {
         pa_xfree(config_data->default_profile);
         config_data->default_profile = NULL;
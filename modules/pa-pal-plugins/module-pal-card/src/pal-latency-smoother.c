@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2025 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+
+#include <pulse/rtclock.h>
+#include <pulse/xmalloc.h>
+#include <pulsecore/core-rtclock.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+
+#include "pal-latency-smoother.h"
+
+/* #define SMOOTHER_DEBUG */
+
+/* qtimer runs at 19.2MHz on all supported targets, used if cntfrq reads 0 */
+#define PA_PAL_QTIMER_DEFAULT_FREQ 19200000ULL
+
+/* loop gains for position and rate error */
+#define PA_PAL_SMOOTHER_DLL_B 0.25
+#define PA_PAL_SMOOTHER_DLL_C 0.02
+#define PA_PAL_SMOOTHER_MAX_RATE_DEVIATION 0.05
+
+/* errors above this are a discontinuity (underrun, restart), not drift */
+#define PA_PAL_SMOOTHER_RESYNC_US (20 * PA_USEC_PER_MSEC)
+
+/* stop interpolating if PAL has not delivered a timestamp for this long */
+#define PA_PAL_SMOOTHER_STALE_US PA_USEC_PER_SEC
+
+struct pa_pal_latency_smoother {
+    pa_usec_t fetch_interval_us;
+    uint64_t last_fetch_us;
+    uint64_t last_sample_us;
+    bool valid;
+
+    /* estimated position is base_position + rate * (now - base_time) */
+    double base_time_us;
+    double base_position_us;
+    double rate;
+
+    uint64_t last_position_us;
+    uint64_t raw_session_time_us;
+};
+
+static uint64_t pa_pal_qtimer_get_frequency(void) {
+    static uint64_t freq = 0;
+
+    if (PA_LIKELY(freq))
+        return freq;
+
+#if defined __aarch64__
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+#elif defined __arm__
+    {
+        uint32_t f;
+        asm volatile("mrc p15, 0, %0, c14, c0, 0" : "=r"(f));
+        freq = f;
+    }
+#endif
+
+    if (!freq)
+        freq = PA_PAL_QTIMER_DEFAULT_FREQ;
+
+    pa_log_debug("%s: counter frequency %" PRIu64 " Hz", __func__, freq);
+
+    return freq;
+}
+
+uint64_t pa_pal_qtimer_now_us(void) {
+    uint64_t ticks = 0;
+    uint64_t freq = pa_pal_qtimer_get_frequency();
+
+#if defined __aarch64__
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+#elif defined __arm__
+    asm volatile("mrrc p15, 1, %Q0, %R0, c14" : "=r"(ticks));
+#else
+    return pa_rtclock_now();
+#endif
+
+    /* split to avoid overflowing ticks * PA_USEC_PER_SEC */
+    return (ticks / freq) * PA_USEC_PER_SEC + ((ticks % freq) * PA_USEC_PER_SEC) / freq;
+}
+
+pa_pal_latency_smoother* pa_pal_latency_smoother_new(pa_usec_t fetch_interval_us) {
+    pa_pal_latency_smoother *s;
+
+    s = pa_xnew0(pa_pal_latency_smoother, 1);
+    s->fetch_interval_us = fetch_interval_us;
+    pa_pal_latency_smoother_reset(s);
+
+    return s;
+}
+
+void pa_pal_latency_smoother_free(pa_pal_latency_smoother *s) {
+    pa_assert(s);
+
+    pa_xfree(s);
+}
+
+void pa_pal_latency_smoother_reset(pa_pal_latency_smoother *s) {
+    pa_assert(s);
+
+    s->valid = false;
+    s->last_fetch_us = 0;
+    s->last_sample_us = 0;
+    s->base_time_us = 0;
+    s->base_position_us = 0;
+    s->rate = 1.0;
+    s->last_position_us = 0;
+    s->raw_session_time_us = 0;
+}
+
+static void pa_pal_latency_smoother_resync(pa_pal_latency_smoother *s, double abs_time_us, double session_time_us) {
+    s->base_time_us = abs_time_us;
+    s->base_position_us = session_time_us;
+    s->rate = 1.0;
+    s->last_position_us = 0;
+    s->valid = true;
+}
+
+static void pa_pal_latency_smoother_put(pa_pal_latency_smoother *s, uint64_t abs_time_us, uint64_t session_time_us) {
+    double dt, predicted, error;
+
+    s->raw_session_time_us = session_time_us;
+
+    if (!s->valid) {
+        pa_pal_latency_smoother_resync(s, abs_time_us, session_time_us);
+        return;
+    }
+
+    dt = (double)abs_time_us - s->base_time_us;
+    if (dt <= 0)
+        return; /* same or older sample */
+
+    predicted = s->base_position_us + s->rate * dt;
+    error = (double)session_time_us - predicted;
+
+    if (fabs(error) > PA_PAL_SMOOTHER_RESYNC_US) {
+#ifdef SMOOTHER_DEBUG
+        pa_log_debug("%s: resync, error %f us", __func__, error);
+#endif
+        pa_pal_latency_smoother_resync(s, abs_time_us, session_time_us);
+        return;
+    }
+
+    s->base_time_us = abs_time_us;
+    s->base_position_us = predicted + PA_PAL_SMOOTHER_DLL_B * error;
+    s->rate += PA_PAL_SMOOTHER_DLL_C * error / dt;
+    s->rate = PA_CLAMP(s->rate, 1.0 - PA_PAL_SMOOTHER_MAX_RATE_DEVIATION, 1.0 + PA_PAL_SMOOTHER_MAX_RATE_DEVIATION);
+
+#ifdef SMOOTHER_DEBUG
+    pa_log_debug("%s: error %f us, rate %f", __func__, error, s->rate);
+#endif
+}
+
+int pa_pal_latency_smoother_get(pa_pal_latency_smoother *s, pal_stream_handle_t *stream_handle, uint64_t *session_time_us) {
+    struct pal_session_time stime = {0};
+    uint64_t now, abs_time_us, position_us;
+    double position;
+
+    pa_assert(s);
+    pa_assert(session_time_us);
+
+    now = pa_pal_qtimer_now_us();
+
+    /* failed queries are rate limited too, last_fetch_us is the last attempt */
+    if (stream_handle && (!s->last_fetch_us || now - s->last_fetch_us >= s->fetch_interval_us)) {
+        s->last_fetch_us = now;
+
+        if (!pal_get_timestamp(stream_handle, &stime)) {
+            abs_time_us = ((uint64_t)stime.absolute_time.value_msw << 32) | (uint64_t)stime.absolute_time.value_lsw;
+            position_us = ((uint64_t)stime.session_time.value_msw << 32) | (uint64_t)stime.session_time.value_lsw;
+
+            pa_pal_latency_smoother_put(s, abs_time_us, position_us);
+            s->last_sample_us = now;
+        }
+    }
+
+    if (!s->valid || now - s->last_sample_us > PA_PAL_SMOOTHER_STALE_US)
+        return -1;
+
+    /* the DSP may stamp the session time slightly in the future */
+    position = s->base_position_us + s->rate * ((double)now - s->base_time_us);
+    position_us = position > 0 ? (uint64_t)position : 0;
+
+    /* never report the DSP going backwards */
+    if (position_us < s->last_position_us)
+        position_us = s->last_position_us;
+
+    s->last_position_us = position_us;
+    *session_time_us = position_us;
+
+    return 0;
+}
+
+uint64_t pa_pal_latency_smoother_get_raw(pa_pal_latency_smoother *s) {
+    pa_assert(s);
+
+    return s->raw_session_time_us;
+}
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2025 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pulse/xmalloc.h>
+#include <pulsecore/atomic.h>
+#include <pulsecore/core-error.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/endianmacros.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/thread.h>
+
+#include "pal-pcm-tap.h"
+
+#define PA_PAL_PCM_TAP_RING_MS 1000
+#define PA_PAL_PCM_TAP_MIN_RING_SIZE (64 * 1024)
+#define PA_PAL_PCM_TAP_POLL_MS 50
+#define PA_PAL_PCM_TAP_WAV_HEADER_SIZE 44
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_ALAW 0x0006
+#define WAVE_FORMAT_MULAW 0x0007
+
+struct pa_pal_pcm_tap {
+    char *prefix;
+    pa_sample_spec ss;
+    size_t max_file_size;
+
+    /* single producer (IO thread), single consumer (writer thread) byte ring */
+    uint8_t *ring;
+    size_t ring_size; /* power of 2 */
+    pa_atomic_t read_idx;  /* only advanced by the writer thread */
+    pa_atomic_t write_idx; /* only advanced by the IO thread */
+    pa_atomic_t dropped;
+
+    pa_thread *thread;
+    pa_atomic_t exit;
+
+    /* writer thread only, once started */
+    int fd;
+    char *file_name;
+    size_t file_size;
+    bool failed; /* stop trying after an io error, queued data is discarded */
+};
+
+/* files of all taps share one counter, so a re-created tap never overwrites */
+static pa_atomic_t file_counter = PA_ATOMIC_INIT(0);
+
+static void pa_pal_pcm_tap_put_u16(uint8_t *p, uint16_t v) {
+    v = PA_UINT16_TO_LE(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void pa_pal_pcm_tap_put_u32(uint8_t *p, uint32_t v) {
+    v = PA_UINT32_TO_LE(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint16_t pa_pal_pcm_tap_get_wav_format(const pa_sample_spec *ss) {
+    switch (ss->format) {
+        case PA_SAMPLE_FLOAT32LE:
+        case PA_SAMPLE_FLOAT32BE:
+            return WAVE_FORMAT_IEEE_FLOAT;
+        case PA_SAMPLE_ALAW:
+            return WAVE_FORMAT_ALAW;
+        case PA_SAMPLE_ULAW:
+            return WAVE_FORMAT_MULAW;
+        default:
+            return WAVE_FORMAT_PCM;
+    }
+}
+
+/* canonical 44 byte RIFF header, data_size is patched in when the file is done */
+static void pa_pal_pcm_tap_fill_wav_header(pa_pal_pcm_tap *t, uint8_t *h, uint32_t data_size) {
+    size_t frame_size = pa_frame_size(&t->ss);
+
+    memcpy(h, "RIFF", 4);
+    pa_pal_pcm_tap_put_u32(h + 4, PA_PAL_PCM_TAP_WAV_HEADER_SIZE - 8 + data_size);
+    memcpy(h + 8, "WAVE", 4);
+    memcpy(h + 12, "fmt ", 4);
+    pa_pal_pcm_tap_put_u32(h + 16, 16);
+    pa_pal_pcm_tap_put_u16(h + 20, pa_pal_pcm_tap_get_wav_format(&t->ss));
+    pa_pal_pcm_tap_put_u16(h + 22, t->ss.channels);
+    pa_pal_pcm_tap_put_u32(h + 24, t->ss.rate);
+    pa_pal_pcm_tap_put_u32(h + 28, t->ss.rate * frame_size);
+    pa_pal_pcm_tap_put_u16(h + 32, frame_size);
+    pa_pal_pcm_tap_put_u16(h + 34, pa_sample_size(&t->ss) * 8);
+    memcpy(h + 36, "data", 4);
+    pa_pal_pcm_tap_put_u32(h + 40, data_size);
+}
+
+static void pa_pal_pcm_tap_close_file(pa_pal_pcm_tap *t) {
+    uint8_t header[PA_PAL_PCM_TAP_WAV_HEADER_SIZE];
+
+    if (t->fd < 0)
+        return;
+
+    pa_pal_pcm_tap_fill_wav_header(t, header, t->file_size - PA_PAL_PCM_TAP_WAV_HEADER_SIZE);
+    if (pwrite(t->fd, header, sizeof(header), 0) != sizeof(header))
+        pa_log_error("%s: could not finalize %s: %s", __func__, t->file_name, pa_cstrerror(errno));
+
+    pa_close(t->fd);
+    t->fd = -1;
+
+    pa_log_info("pcm tap %s done, %zu bytes", t->file_name, t->file_size);
+    pa_xfree(t->file_name);
+    t->file_name = NULL;
+}
+
+static int pa_pal_pcm_tap_open_file(pa_pal_pcm_tap *t) {
+    uint8_t header[PA_PAL_PCM_TAP_WAV_HEADER_SIZE];
+
+    t->file_name = pa_sprintf_malloc("%s-%d.wav", t->prefix, pa_atomic_inc(&file_counter));
+    t->fd = pa_open_cloexec(t->file_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (t->fd < 0) {
+        pa_log_error("%s: could not open %s: %s", __func__, t->file_name, pa_cstrerror(errno));
+        pa_xfree(t->file_name);
+        t->file_name = NULL;
+        return -1;
+    }
+
+    pa_pal_pcm_tap_fill_wav_header(t, header, 0);
+    if (pa_loop_write(t->fd, header, sizeof(header), NULL) != sizeof(header)) {
+        pa_log_error("%s: could not write %s: %s", __func__, t->file_name, pa_cstrerror(errno));
+        pa_close(t->fd);
+        t->fd = -1;
+        pa_xfree(t->file_name);
+        t->file_name = NULL;
+        return -1;
+    }
+
+    t->file_size = sizeof(header);
+    pa_log_info("pcm tap writing to %s", t->file_name);
+
+    return 0;
+}
+
+/* Called from writer thread context, moves everything queued to the file */
+static void pa_pal_pcm_tap_flush(pa_pal_pcm_tap *t) {
+    unsigned r = (unsigned)pa_atomic_load(&t->read_idx);
+    unsigned w = (unsigned)pa_atomic_load(&t->write_idx);
+    size_t offset, n;
+
+    while (r != w) {
+        if (t->fd >= 0 && t->file_size >= t->max_file_size)
+            pa_pal_pcm_tap_close_file(t);
+
+        if (t->fd < 0 && !t->failed && pa_pal_pcm_tap_open_file(t) < 0)
+            t->failed = true;
+
+        /* keep consuming, so the IO thread never sees a full ring */
+        if (t->failed) {
+            pa_atomic_store(&t->read_idx, (int)w);
+            return;
+        }
+
+        offset = r & (t->ring_size - 1);
+        n = PA_MIN(w - r, t->ring_size - offset);
+        n = PA_MIN(n, t->max_file_size - t->file_size);
+
+        if (pa_loop_write(t->fd, t->ring + offset, n, NULL) != (ssize_t)n) {
+            pa_log_error("%s: write to %s failed: %s", __func__, t->file_name, pa_cstrerror(errno));
+            pa_pal_pcm_tap_close_file(t);
+            t->failed = true;
+        } else {
+            t->file_size += n;
+        }
+
+        r += n;
+        pa_atomic_store(&t->read_idx, (int)r);
+    }
+}
+
+static void pa_pal_pcm_tap_thread_func(void *userdata) {
+    pa_pal_pcm_tap *t = userdata;
+
+    pa_log_debug("pcm tap writer thread starting up");
+
+    while (!pa_atomic_load(&t->exit)) {
+        pa_pal_pcm_tap_flush(t);
+        pa_msleep(PA_PAL_PCM_TAP_POLL_MS);
+    }
+
+    pa_pal_pcm_tap_flush(t);
+    pa_pal_pcm_tap_close_file(t);
+
+    pa_log_debug("pcm tap writer thread shutting down");
+}
+
+pa_pal_pcm_tap* pa_pal_pcm_tap_new(const char *prefix, const pa_sample_spec *ss, size_t max_file_size) {
+    pa_pal_pcm_tap *t;
+    size_t wanted;
+
+    pa_assert(prefix);
+    pa_assert(ss);
+    pa_assert(pa_sample_spec_valid(ss));
+
+    t = pa_xnew0(pa_pal_pcm_tap, 1);
+    t->prefix = pa_xstrdup(prefix);
+    t->ss = *ss;
+    t->fd = -1;
+    /* whole frames per file, so every rotated file starts on a frame */
+    t->max_file_size = PA_CLAMP(max_file_size, PA_PAL_PCM_TAP_WAV_HEADER_SIZE + pa_bytes_per_second(ss),
+                                (size_t)UINT32_MAX) - PA_PAL_PCM_TAP_WAV_HEADER_SIZE;
+    t->max_file_size = PA_PAL_PCM_TAP_WAV_HEADER_SIZE + pa_frame_align(t->max_file_size, ss);
+
+    wanted = PA_MAX(pa_usec_to_bytes(PA_PAL_PCM_TAP_RING_MS * PA_USEC_PER_MSEC, ss), (size_t)PA_PAL_PCM_TAP_MIN_RING_SIZE);
+    t->ring_size = 1;
+    while (t->ring_size < wanted)
+        t->ring_size <<= 1;
+    t->ring = pa_xmalloc(t->ring_size);
+
+    pa_atomic_store(&t->read_idx, 0);
+    pa_atomic_store(&t->write_idx, 0);
+    pa_atomic_store(&t->dropped, 0);
+    pa_atomic_store(&t->exit, 0);
+
+    /* fail here rather than in the writer thread on a bad path */
+    if (pa_pal_pcm_tap_open_file(t) < 0)
+        goto fail;
+
+    if (!(t->thread = pa_thread_new("pal-pcm-tap", pa_pal_pcm_tap_thread_func, t))) {
+        pa_log_error("%s: could not create writer thread", __func__);
+        pa_pal_pcm_tap_close_file(t);
+        goto fail;
+    }
+
+    return t;
+
+fail:
+    pa_xfree(t->ring);
+    pa_xfree(t->prefix);
+    pa_xfree(t);
+
+    return NULL;
+}
+
+void pa_pal_pcm_tap_free(pa_pal_pcm_tap *t) {
+    pa_assert(t);
+
+    pa_atomic_store(&t->exit, 1);
+    pa_thread_free(t->thread);
+
+    if (pa_atomic_load(&t->dropped))
+        pa_log_warn("pcm tap %s dropped %d bytes, writer too slow", t->prefix, pa_atomic_load(&t->dropped));
+
+    pa_xfree(t->ring);
+    pa_xfree(t->prefix);
+    pa_xfree(t);
+}
+
+void pa_pal_pcm_tap_write(pa_pal_pcm_tap *t, const void *data, size_t length) {
+    unsigned w = (unsigned)pa_atomic_load(&t->write_idx);
+    size_t offset, n;
+
+    pa_assert(t);
+
+    /* whole writes or nothing, to keep the file frame aligned */
+    if (length > t->ring_size - (w - (unsigned)pa_atomic_load(&t->read_idx))) {
+        pa_atomic_add(&t->dropped, (int)length);
+        return;
+    }
+
+    offset = w & (t->ring_size - 1);
+    n = PA_MIN(length, t->ring_size - offset);
+    memcpy(t->ring + offset, data, n);
+    memcpy(t->ring, (const uint8_t *)data + n, length - n);
+
+    pa_atomic_store(&t->write_idx, (int)(w + length));
+}
+
+const pa_sample_spec* pa_pal_pcm_tap_get_sample_spec(pa_pal_pcm_tap *t) {
+    pa_assert(t);
+
+    return &t->ss;
+}
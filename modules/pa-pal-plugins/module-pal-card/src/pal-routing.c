@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2025 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <pulse/xmalloc.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/namereg.h>
+#include <pulsecore/sink-input.h>
+
+#include "pal-routing.h"
+
+/* set to "auto" on sink inputs the policy placed, only those are moved once
+ * their requested latency is known */
+#define PA_PAL_ROUTING_PROP "pal.routing"
+
+struct pa_pal_routing {
+    pa_core *core;
+    pa_dynarray *rules; /* owned by the card config */
+
+    pa_hook_slot *sink_input_new_slot;
+    pa_hook_slot *sink_input_put_slot;
+};
+
+static int pa_pal_routing_rule_parse_encodings(pa_pal_routing_rule *rule, const char *value) {
+    const char *state = NULL;
+    char *name;
+    uint32_t n = 0;
+
+    while ((name = pa_split(value, ",", &state))) {
+        pa_xfree(name);
+        n++;
+    }
+
+    if (!n)
+        return -1;
+
+    rule->encodings = pa_xnew(pa_encoding_t, n);
+    state = NULL;
+    while ((name = pa_split(value, ",", &state))) {
+        rule->encodings[rule->n_encodings] = pa_encoding_from_string(name);
+        if (rule->encodings[rule->n_encodings] == PA_ENCODING_INVALID) {
+            pa_log_error("%s: unknown encoding %s", __func__, name);
+            pa_xfree(name);
+            return -1;
+        }
+
+        pa_xfree(name);
+        rule->n_encodings++;
+    }
+
+    return 0;
+}
+
+pa_pal_routing_rule* pa_pal_routing_rule_parse(const char *str) {
+    pa_pal_routing_rule *rule;
+    const char *state = NULL;
+    char *token, *value;
+    uint32_t ms;
+
+    pa_assert(str);
+
+    rule = pa_xnew0(pa_pal_routing_rule, 1);
+
+    while ((token = pa_split_spaces(str, &state))) {
+        if (!(value = strchr(token, ':')) || !*(value + 1)) {
+            pa_log_error("%s: invalid routing condition %s", __func__, token);
+            goto fail;
+        }
+
+        *value++ = '\0';
+
+        if (pa_streq(token, "role") && !rule->roles) {
+            rule->roles = pa_xstrdup(value);
+        } else if (pa_streq(token, "encoding") && !rule->encodings) {
+            if (pa_pal_routing_rule_parse_encodings(rule, value) < 0)
+                goto fail;
+        } else if (pa_streq(token, "max-latency-ms") && pa_atou(value, &ms) >= 0 && ms) {
+            rule->max_latency_us = ms * PA_USEC_PER_MSEC;
+        } else if (pa_streq(token, "min-latency-ms") && pa_atou(value, &ms) >= 0 && ms) {
+            rule->min_latency_us = ms * PA_USEC_PER_MSEC;
+        } else if (pa_streq(token, "sink") && !rule->sink_name) {
+            rule->sink_name = pa_xstrdup(value);
+        } else {
+            pa_log_error("%s: invalid routing condition %s:%s", __func__, token, value);
+            goto fail;
+        }
+
+        pa_xfree(token);
+    }
+
+    if (!rule->sink_name) {
+        pa_log_error("%s: routing rule without sink: %s", __func__, str);
+        pa_pal_routing_rule_free(rule);
+        return NULL;
+    }
+
+    return rule;
+
+fail:
+    pa_xfree(token);
+    pa_pal_routing_rule_free(rule);
+
+    return NULL;
+}
+
+void pa_pal_routing_rule_free(pa_pal_routing_rule *rule) {
+    pa_assert(rule);
+
+    pa_xfree(rule->roles);
+    pa_xfree(rule->encodings);
+    pa_xfree(rule->sink_name);
+    pa_xfree(rule);
+}
+
+/* Latency conditions only match on the sink the stream was put on, sink is
+ * NULL before. Core clamps the requested latency to the range of that sink
+ * and replaces it by the fixed latency of other sinks, so a threshold can
+ * only be judged on a dynamic latency sink whose range covers it */
+static bool pa_pal_routing_rule_match(const pa_pal_routing_rule *rule, const char *role, pa_encoding_t encoding,
+                                      pa_sink *sink, pa_usec_t latency) {
+    pa_usec_t min_latency, max_latency;
+    uint32_t i;
+
+    if (rule->roles) {
+        if (!role || !pa_str_in_list(rule->roles, ",", role))
+            return false;
+    }
+
+    if (rule->encodings) {
+        for (i = 0; i < rule->n_encodings; i++)
+            if (rule->encodings[i] == encoding)
+                break;
+
+        if (i == rule->n_encodings)
+            return false;
+    }
+
+    if (rule->max_latency_us || rule->min_latency_us) {
+        if (!sink || !(sink->flags & PA_SINK_DYNAMIC_LATENCY) || latency == (pa_usec_t) -1)
+            return false;
+
+        pa_sink_get_latency_range(sink, &min_latency, &max_latency);
+        if ((rule->max_latency_us && (rule->max_latency_us < min_latency || rule->max_latency_us >= max_latency)) ||
+                (rule->min_latency_us && (rule->min_latency_us <= min_latency || rule->min_latency_us > max_latency))) {
+            pa_log_debug("%s: latency range of %s does not cover the rule for %s", __func__, sink->name, rule->sink_name);
+            return false;
+        }
+
+        if (rule->max_latency_us && latency > rule->max_latency_us)
+            return false;
+
+        if (rule->min_latency_us && latency < rule->min_latency_us)
+            return false;
+    }
+
+    return true;
+}
+
+static pa_encoding_t pa_pal_routing_get_new_data_encoding(pa_sink_input_new_data *data) {
+    pa_format_info *f;
+
+    if (data->format)
+        return data->format->encoding;
+
+    /* streams without requested formats are pcm */
+    if (!data->req_formats || !(f = pa_idxset_first(data->req_formats, NULL)))
+        return PA_ENCODING_PCM;
+
+    return f->encoding;
+}
+
+static pa_hook_result_t pa_pal_routing_sink_input_new_cb(pa_core *c, pa_sink_input_new_data *data, pa_pal_routing *r) {
+    pa_pal_routing_rule *rule;
+    pa_sink *sink;
+    const char *role;
+    pa_encoding_t encoding;
+    unsigned idx;
+
+    pa_assert(c);
+    pa_assert(data);
+    pa_assert(r);
+
+    /* picked by the client or by another policy module */
+    if (data->sink)
+        return PA_HOOK_OK;
+
+    pa_proplist_sets(data->proplist, PA_PAL_ROUTING_PROP, "auto");
+
+    role = pa_proplist_gets(data->proplist, PA_PROP_MEDIA_ROLE);
+    encoding = pa_pal_routing_get_new_data_encoding(data);
+
+    PA_DYNARRAY_FOREACH(rule, r->rules, idx) {
+        if (!pa_pal_routing_rule_match(rule, role, encoding, NULL, 0))
+            continue;
+
+        /* dynamic sinks may not exist yet, and a sink may reject the format */
+        if (!(sink = pa_namereg_get(c, rule->sink_name, PA_NAMEREG_SINK)))
+            continue;
+
+        if (pa_sink_input_new_data_set_sink(data, sink, false, false)) {
+            pa_log_info("%s: routing new stream (role %s, %s) to %s", __func__, pa_strnull(role),
+                        pa_encoding_to_string(encoding), sink->name);
+            break;
+        }
+    }
+
+    return PA_HOOK_OK;
+}
+
+/* the requested latency is only set between SINK_INPUT_NEW and SINK_INPUT_PUT,
+ * rules depending on it are applied here */
+static pa_hook_result_t pa_pal_routing_sink_input_put_cb(pa_core *c, pa_sink_input *i, pa_pal_routing *r) {
+    pa_pal_routing_rule *rule;
+    pa_sink *sink;
+    pa_usec_t latency;
+    const char *role;
+    unsigned idx;
+
+    pa_assert(c);
+    pa_assert(i);
+    pa_assert(r);
+
+    if (!pa_safe_streq(pa_proplist_gets(i->proplist, PA_PAL_ROUTING_PROP), "auto"))
+        return PA_HOOK_OK;
+
+    role = pa_proplist_gets(i->proplist, PA_PROP_MEDIA_ROLE);
+    latency = pa_sink_input_get_requested_latency(i);
+
+    PA_DYNARRAY_FOREACH(rule, r->rules, idx) {
+        if (!pa_pal_routing_rule_match(rule, role, i->format->encoding, i->sink, latency))
+            continue;
+
+        if (!(sink = pa_namereg_get(c, rule->sink_name, PA_NAMEREG_SINK)))
+            continue;
+
+        if (sink == i->sink)
+            break;
+
+        if (!pa_sink_input_may_move_to(i, sink))
+            continue;
+
+        if (pa_sink_input_move_to(i, sink, false) >= 0) {
+            pa_log_info("%s: moved stream %u (role %s, latency %lluus) to %s", __func__, i->index, pa_strnull(role),
+                        (unsigned long long) latency, sink->name);
+            break;
+        }
+    }
+
+    return PA_HOOK_OK;
+}
+
+pa_pal_routing* pa_pal_routing_new(pa_core *core, pa_dynarray *rules) {
+    pa_pal_routing *r;
+
+    pa_assert(core);
+    pa_assert(rules);
+
+    r = pa_xnew0(pa_pal_routing, 1);
+    r->core = core;
+    r->rules = rules;
+
+    r->sink_input_new_slot = pa_hook_connect(&core->hooks[PA_CORE_HOOK_SINK_INPUT_NEW], PA_HOOK_NORMAL,
+                                             (pa_hook_cb_t) pa_pal_routing_sink_input_new_cb, r);
+    r->sink_input_put_slot = pa_hook_connect(&core->hooks[PA_CORE_HOOK_SINK_INPUT_PUT], PA_HOOK_NORMAL,
+                                             (pa_hook_cb_t) pa_pal_routing_sink_input_put_cb, r);
+
+    pa_log_info("%s: %u routing rules", __func__, pa_dynarray_size(rules));
+
+    return r;
+}
+
+void pa_pal_routing_free(pa_pal_routing *r) {
+    pa_assert(r);
+
+    if (r->sink_input_new_slot)
+        pa_hook_slot_free(r->sink_input_new_slot);
+
+    if (r->sink_input_put_slot)
+        pa_hook_slot_free(r->sink_input_put_slot);
+
+    pa_xfree(r);
+}
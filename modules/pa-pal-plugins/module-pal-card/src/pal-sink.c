@@ -23,6 +23,7 @@
 #include <pulsecore/rtpoll.h>
 #include <pulsecore/sink.h>
 #include <pulsecore/memchunk.h>
+#include <pulsecore/memblockq.h>
 #include <pulsecore/mutex.h>
 #include <pulsecore/core-util.h>
 
@@ -31,11 +32,12 @@
 
 #include "pal-sink.h"
 #include "pal-utils.h"
+#include "pal-latency-smoother.h"
+#include "pal-pcm-tap.h"
+#include "pal-stats.h"
 
 /* #define SINK_DEBUG */
 
-/* #define SINK_DUMP_ENABLED */
-
 #define PAL_MAX_GAIN 1
 
 #define PA_ALTERNATE_SINK_RATE 44100
@@ -48,10 +50,24 @@
 #define PA_DEFAULT_BUFFER_DURATION_MS 25
 #define PA_LOW_LATENCY_BUFFER_DURATION_MS 5
 #define PA_DEEP_BUFFER_BUFFER_DURATION_MS 20
+#define PA_DEFAULT_TSCHED_WATERMARK_MS 10
+#define PA_DEFAULT_MIN_LATENCY_MS 5
+#define PA_DEFAULT_MAX_LATENCY_MS 200
+#define PA_DEFAULT_MMAP_BURST_COUNT 2
+#define PA_TIMESTAMP_FETCH_INTERVAL_MS 20
+#define PA_OFFLOAD_RETRY_INTERVAL_MS 10000
 
 
 typedef struct {
     struct pa_idxset *sinks;
+
+    /* prewarm worker, opens the idle pal session of prewarm sinks ahead of use */
+    pa_thread *prewarm_thread;
+    pa_mutex *prewarm_mutex;
+    pa_cond *prewarm_cond;
+    pa_idxset *prewarm_pending;
+    pa_pal_sink_data *prewarm_current;
+    bool prewarm_exit;
 } pa_pal_sink_module_data;
 
 static pa_pal_sink_module_data *mdata = NULL;
@@ -64,7 +80,13 @@ static int close_pal_sink(pa_pal_sink_data *sdata);
 static int free_pa_sink(pa_pal_sink_data *sdata);
 static int open_pal_sink(pa_pal_sink_data *sdata);
 static int pa_pal_set_param(pal_sink_data *pal_sdata, uint32_t param_id);
+static pal_param_payload* pa_pal_sink_new_param_payload(pal_sink_data *pal_sdata, uint32_t param_id);
 static void free_pal_sink_thread_resources(pal_sink_data *pal_sdata);
+static void pa_pal_sink_prewarm_request(pa_pal_sink_data *sdata);
+static void pa_pal_sink_prewarm_wait(pa_pal_sink_data *sdata);
+static void pa_pal_sink_attach_pcm_tap(pa_pal_sink_data *sdata, const pa_sample_spec *ss, const char *prefix);
+static void pa_pal_sink_offload_failed(pa_pal_sink_data *sdata);
+static void pa_pal_sink_resize_period(pa_pal_sink_data *sdata);
 
 static const uint32_t supported_sink_rates[] =
                           {8000, 11025, 16000, 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000, 352800, 384000};
@@ -100,15 +122,21 @@ static pa_sample_format_t pa_pal_sink_find_nearest_supported_pa_format(pa_sample
             break;
         case PA_SAMPLE_S24LE:
         case PA_SAMPLE_S24BE:
+            format1 = PA_SAMPLE_S24LE;
+            break;
         case PA_SAMPLE_S24_32LE:
         case PA_SAMPLE_S24_32BE:
-            format1 = PA_SAMPLE_S24LE;
+            format1 = PA_SAMPLE_S24_32LE;
             break;
         case PA_SAMPLE_S32LE:
-        case PA_SAMPLE_FLOAT32LE:
         case PA_SAMPLE_S32BE:
             format1 = PA_SAMPLE_S32LE;
             break;
+        case PA_SAMPLE_FLOAT32LE:
+        case PA_SAMPLE_FLOAT32BE:
+            /* mixed in float, converted to S32 by us */
+            format1 = PA_SAMPLE_FLOAT32LE;
+            break;
         default:
             format1 = PA_SAMPLE_S16LE;
             pa_log_error(" unsupport format %d hence defaulting to %d",format, format1);
@@ -142,6 +170,8 @@ static const char *pa_pal_sink_get_name_from_type(pal_stream_type_t type) {
         name = "deep_buffer";
     else if (type == PAL_STREAM_COMPRESSED)
         name = "offload";
+    else if (type == PAL_STREAM_ULTRA_LOW_LATENCY)
+        name = "ultra_low_latency";
     else if (type == PAL_STREAM_VOIP_TX)
         name = "voip_tx";
     else if (type == PAL_STREAM_VOIP_RX)
@@ -152,67 +182,83 @@ static const char *pa_pal_sink_get_name_from_type(pal_stream_type_t type) {
     return name;
 }
 
+/* Hand a control command to the IO thread, it is applied between two
+ * periods and comes back as PA_PAL_SINK_MESSAGE_CTRL_DONE. Never blocks. */
+static void pa_pal_sink_post_ctrl(pa_pal_sink_data *sdata, pa_pal_ctrl_cmd *cmd) {
+    pa_asyncmsgq_post(sdata->pa_sdata->thread_mq.inq, PA_MSGOBJECT(sdata->pa_sdata->sink),
+                      PA_PAL_SINK_MESSAGE_CTRL, cmd, 0, NULL, NULL);
+}
+
+/* Called from main context */
 static void pa_pal_sink_set_volume_cb(pa_sink *s) {
     pa_pal_sink_data *sdata = NULL;
-    float gain;
-    int rc;
-    pa_volume_t volume;
+    pa_pal_ctrl_cmd *cmd;
     pal_sink_data *pal_sdata = NULL;
-    struct pal_volume_data *volume_data = NULL;
-    uint32_t i,no_vol_pair;
-    uint32_t channel_mask = 1;
+    pa_cvolume hw_volume;
+    uint32_t i;
 
     pa_assert(s);
     sdata = (pa_pal_sink_data *)s->userdata;
 
-    if (!PA_SINK_IS_RUNNING(s->state)) {
-        pa_log_error("set volume is supported only when sink is in RUNNING state\n");
-        return;
-    }
     pa_assert(sdata);
     pa_assert(sdata->pal_sdata);
-    pa_assert(sdata->pal_sdata->stream_handle);
 
     pal_sdata = sdata->pal_sdata;
-    no_vol_pair = pal_sdata->stream_attributes->out_media_config.ch_info.channels;
 
-    gain = ((float) pa_cvolume_max(&s->real_volume) * (float)PAL_MAX_GAIN) / (float)PA_VOLUME_NORM;
-    volume = (pa_volume_t) roundf((float) gain * PA_VOLUME_NORM / PAL_MAX_GAIN);
+    /* PAL gain stops at 0dB, anything above is left to software volume */
+    hw_volume = s->real_volume;
+    for (i = 0; i < hw_volume.channels; i++)
+        hw_volume.values[i] = PA_MIN(hw_volume.values[i], PA_VOLUME_NORM);
 
-    volume_data = (struct pal_volume_data *)malloc(sizeof(uint32_t) +
-                                                 (sizeof(struct pal_channel_vol_kv) * (no_vol_pair)));
-    if (!volume_data) {
-        pa_log_error("malloc failed for size %zu", sizeof(uint32_t) +
-                 (sizeof(struct pal_channel_vol_kv) * (no_vol_pair)));
-        return;
-    }
+    pa_sw_cvolume_divide(&s->soft_volume, &s->real_volume, &hw_volume);
 
-    volume_data->no_of_volpair = no_vol_pair;
+    /* also posted in standby, the IO thread applies it once the session starts */
+    cmd = pa_pal_ctrl_cmd_new(PA_PAL_VOLUME_APPLY);
+    pa_pal_util_fill_volume_data(cmd->volume_data, &hw_volume, &pal_sdata->stream_attributes->out_media_config.ch_info);
+    pa_pal_sink_post_ctrl(sdata, cmd);
 
-    for (i = 0; i < no_vol_pair; i++) {
-        channel_mask = (channel_mask | pal_sdata->stream_attributes->out_media_config.ch_info.ch_map[i]);
-    }
+    return;
+}
+
+/* Called from main context */
+static void pa_pal_sink_set_mute_cb(pa_sink *s) {
+    pa_pal_sink_data *sdata = NULL;
+    pa_pal_ctrl_cmd *cmd;
 
-    channel_mask = (channel_mask << 1);
+    pa_assert(s);
+    sdata = (pa_pal_sink_data *)s->userdata;
+    pa_assert(sdata);
+
+    /* also posted in standby, the IO thread applies it once the session starts */
+    cmd = pa_pal_ctrl_cmd_new(PA_PAL_MUTE_APPLY);
+    cmd->mute = s->muted;
+    pa_pal_sink_post_ctrl(sdata, cmd);
+}
+
+static size_t pa_pal_sink_get_max_rewind(pal_sink_data *pal_sdata) {
+    if (!pal_sdata->staging)
+        return 0;
+
+    return pal_sdata->buffer_size * pal_sdata->rewind_buffer_count;
+}
 
-    for (i = 0; i < no_vol_pair; i++) {
-        volume_data->volume_pair[i].channel_mask = channel_mask;
-        volume_data->volume_pair[i].vol = gain;
+/* (Re)create the staging ring for the current period size and sample spec */
+static void pa_pal_sink_staging_reset(pal_sink_data *pal_sdata, pa_sample_spec *ss) {
+    size_t staging_size;
+
+    if (pal_sdata->staging) {
+        pa_memblockq_free(pal_sdata->staging);
+        pal_sdata->staging = NULL;
     }
 
-    pal_sdata->sink_event_id = PA_PAL_VOLUME_APPLY;
-    pa_mutex_lock(pal_sdata->mutex);
-    rc = pal_stream_set_volume(pal_sdata->stream_handle, volume_data);
-    pal_sdata->sink_event_id = PA_PAL_NO_EVENT;
-    pa_mutex_unlock(pal_sdata->mutex);
-    pa_cond_signal(pal_sdata->cond_ctrl_thread, 0);
-    if (rc)
-        pa_log_error("pal stream : unable to set volume error %d\n", rc);
-    else
-        pa_cvolume_set(&s->real_volume, s->real_volume.channels, volume); /* TODO: Is this correct?  */
+    if (!pal_sdata->rewind_buffer_count || pal_sdata->compressed)
+        return;
 
-    pa_xfree(volume_data);
-    return;
+    /* one period on its way to PAL plus the rewindable ones */
+    staging_size = pal_sdata->buffer_size * (pal_sdata->rewind_buffer_count + 1);
+    pal_sdata->staging = pa_memblockq_new("pal-sink staging", 0, staging_size, staging_size, ss, 0, 0, 0, NULL);
+
+    pa_log_debug("staging ring of %zu bytes, max rewind %zu bytes", staging_size, pa_pal_sink_get_max_rewind(pal_sdata));
 }
 
 static int pa_pal_sink_fill_info(pa_pal_sink_config *sink, pal_sink_data *pal_sdata, pa_pal_card_port_device_data *port_device_data, pal_audio_fmt_t encoding) {
@@ -228,19 +274,8 @@ static int pa_pal_sink_fill_info(pa_pal_sink_config *sink, pal_sink_data *pal_sd
     pal_sdata->stream_attributes->flags = 0;
     pal_sdata->stream_attributes->direction = PAL_AUDIO_OUTPUT;
     pal_sdata->stream_attributes->out_media_config.sample_rate = sink->default_spec.rate;
-    pal_sdata->stream_attributes->out_media_config.bit_width = pa_sample_size_of_format(sink->default_spec.format) * PA_BITS_PER_BYTE;
-
-    switch (pal_sdata->stream_attributes->out_media_config.bit_width) {
-        case 32:
-            pal_sdata->stream_attributes->out_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S32_LE;
-            break;
-        case 24:
-            pal_sdata->stream_attributes->out_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S24_3LE;
-            break;
-        default:
-            pal_sdata->stream_attributes->out_media_config.aud_fmt_id = PAL_AUDIO_FMT_DEFAULT_PCM;
-            break;
-    }
+    pal_sdata->stream_attributes->out_media_config.aud_fmt_id =
+        pa_pal_util_get_pal_pcm_format(sink->default_spec.format, &pal_sdata->stream_attributes->out_media_config.bit_width);
 
     pal_sdata->compressed = (encoding != PAL_AUDIO_FMT_PCM_S16_LE ? true : false);
     if (pal_sdata->stream_attributes->type == PAL_STREAM_COMPRESSED) {
@@ -249,6 +284,32 @@ static int pa_pal_sink_fill_info(pa_pal_sink_config *sink, pal_sink_data *pal_sd
         pal_sdata->compressed = true;
     }
 
+    pal_sdata->gapless = sink->gapless && pal_sdata->stream_attributes->type == PAL_STREAM_COMPRESSED;
+    if (sink->gapless && !pal_sdata->gapless)
+        pa_log_error("%s: gapless needs a sink of type PAL_STREAM_COMPRESSED, disabling it", sink->name);
+
+    pal_sdata->mmap = sink->mmap;
+    if (pal_sdata->mmap && (pal_sdata->compressed || pal_sdata->stream_attributes->type != PAL_STREAM_ULTRA_LOW_LATENCY)) {
+        pa_log_error("%s: mmap needs a pcm sink of type PAL_STREAM_ULTRA_LOW_LATENCY, disabling it", sink->name);
+        pal_sdata->mmap = false;
+    }
+
+    if (pal_sdata->mmap)
+        pal_sdata->stream_attributes->flags = PAL_STREAM_FLAG_MMAP_NO_IRQ_MASK;
+
+    /* offload and mmap positions do not survive a stop/start of the same session */
+    pal_sdata->standby_hysteresis_us = sink->standby_hysteresis_ms * PA_USEC_PER_MSEC;
+    if (pal_sdata->standby_hysteresis_us && (pal_sdata->mmap || pal_sdata->stream_attributes->type == PAL_STREAM_COMPRESSED)) {
+        pa_log_error("%s: standby hysteresis is not supported for offload or mmap sinks, disabling it", sink->name);
+        pal_sdata->standby_hysteresis_us = 0;
+    }
+    pal_sdata->standby_close_time = 0;
+
+    /* a compressed session can only be opened once the format is known */
+    pal_sdata->prewarm = sink->prewarm && pal_sdata->stream_attributes->type != PAL_STREAM_COMPRESSED;
+    if (sink->prewarm && !pal_sdata->prewarm)
+        pa_log_error("%s: prewarm is not supported for offload sinks, disabling it", sink->name);
+
     pal_sdata->pal_snd_dec = pa_xnew0(pal_snd_dec_t, 1);
     memset(pal_sdata->pal_snd_dec, 0, sizeof(pal_snd_dec_t));
 
@@ -258,12 +319,12 @@ static int pa_pal_sink_fill_info(pa_pal_sink_config *sink, pal_sink_data *pal_sd
         return -1;
     }
 
-    pal_sdata->pal_device = pa_xnew0(struct pal_device, 1);
-    memset(pal_sdata->pal_device, 0, sizeof(struct pal_device));
+    pal_sdata->pal_device = pa_xnew0(struct pal_device, PA_PAL_CARD_MAX_PORT_DEVICES);
     pal_sdata->pal_device->id = port_device_data->device;
     pal_sdata->dynamic_usecase = (sink->usecase_type == PA_PAL_CARD_USECASE_TYPE_DYNAMIC) ? true : false;
     pal_sdata->pal_device->config.sample_rate = port_device_data->default_spec.rate;
-    pal_sdata->pal_device->config.bit_width = 16;
+    pal_sdata->pal_device->config.bit_width = port_device_data->bit_width;
+    pal_sdata->convert_float = !pal_sdata->compressed && sink->default_spec.format == PA_SAMPLE_FLOAT32LE;
     if (sink->pal_devicepp_config) {
         pa_strlcpy(pal_sdata->pal_device->custom_config.custom_key, sink->pal_devicepp_config, sizeof(pal_sdata->pal_device->custom_config.custom_key));
     }
@@ -273,6 +334,8 @@ static int pa_pal_sink_fill_info(pa_pal_sink_config *sink, pal_sink_data *pal_sd
         return -1;
     }
 
+    pal_sdata->n_pal_devices = pa_pal_util_fill_port_devices(pal_sdata->pal_device, port_device_data);
+
     pal_sdata->device_url = NULL; /* TODO: useful for BT devices */
     pal_sdata->bytes_written = 0;
     pal_sdata->index = sink->id;
@@ -280,96 +343,165 @@ static int pa_pal_sink_fill_info(pa_pal_sink_config *sink, pal_sink_data *pal_sd
     pal_sdata->buffer_count = (size_t)(sink->buffer_count);
     /* FIXME: Add DSP latency */
     pal_sdata->sink_latency_us = pa_bytes_to_usec(pal_sdata->buffer_size, &sink->default_spec);
-    pal_sdata->sink_event_id = PA_PAL_NO_EVENT;
-    pal_sdata->cond_ctrl_thread = pa_cond_new();
     pa_log_debug("sink latency %dus", pal_sdata->sink_latency_us);
 
+    if (pal_sdata->mmap && (sink->tsched || sink->rewind_buffer_count || sink->dynamic_latency))
+        pa_log_info("%s: mmap sinks schedule on the hw pointer, ignoring tsched, rewind and dynamic latency", sink->name);
+
+    pal_sdata->tsched = sink->tsched && !pal_sdata->mmap;
+    if (pal_sdata->tsched && (pal_sdata->compressed || pal_sdata->buffer_count < 2)) {
+        pa_log_info("%s: timer based scheduling needs a pcm sink with at least 2 buffers, disabling it", sink->name);
+        pal_sdata->tsched = false;
+    }
+
+    if (pal_sdata->tsched) {
+        pal_sdata->tsched_watermark_us = (sink->tsched_watermark_ms ? sink->tsched_watermark_ms : PA_DEFAULT_TSCHED_WATERMARK_MS) * PA_USEC_PER_MSEC;
+        pa_log_debug("%s: timer based scheduling, watermark %" PRIu64 "us", sink->name, pal_sdata->tsched_watermark_us);
+    }
+
+    pal_sdata->dynamic_latency = sink->dynamic_latency && !pal_sdata->mmap;
+    if (pal_sdata->dynamic_latency && pal_sdata->compressed) {
+        pa_log_info("%s: dynamic latency is not supported for compressed sinks, disabling it", sink->name);
+        pal_sdata->dynamic_latency = false;
+    }
+
+    if (pal_sdata->dynamic_latency) {
+        pal_sdata->min_latency_us = (sink->min_latency_ms ? sink->min_latency_ms : PA_DEFAULT_MIN_LATENCY_MS) * PA_USEC_PER_MSEC;
+        pal_sdata->max_latency_us = (sink->max_latency_ms ? sink->max_latency_ms : PA_DEFAULT_MAX_LATENCY_MS) * PA_USEC_PER_MSEC;
+        if (pal_sdata->max_latency_us < pal_sdata->min_latency_us)
+            pal_sdata->max_latency_us = pal_sdata->min_latency_us;
+
+        pa_log_debug("%s: dynamic latency range %" PRIu64 "us - %" PRIu64 "us", sink->name,
+                     pal_sdata->min_latency_us, pal_sdata->max_latency_us);
+    }
+
+    pal_sdata->rewind_buffer_count = pal_sdata->mmap ? 0 : sink->rewind_buffer_count;
+    pa_pal_sink_staging_reset(pal_sdata, &sink->default_spec);
+
+    pal_sdata->smoother = pa_pal_latency_smoother_new(PA_TIMESTAMP_FETCH_INTERVAL_MS * PA_USEC_PER_MSEC);
+    pal_sdata->stats = pa_pal_stats_new(false);
+
     pal_sdata->standby = true;
 
     return 0;
 }
 
-static uint64_t pa_pal_sink_get_latency(pa_pal_sink_data *sdata) {
+static int pa_pal_sink_get_rendered_bytes(pa_pal_sink_data *sdata, uint64_t *bytes_rendered) {
     int rc;
-    uint64_t bytes_rendered;
-    int64_t delta, latency = 0, ticks = 0;
-    uint64_t cur_qtimer, abs_qtimer_time_stamp, session_time_stamp;
-    uint64_t cur_session_time = 0, time_in_future = 0, time_elapsed = 0;
+    uint64_t session_time_us = 0;
     pal_sink_data *pal_sdata;
     pa_sink_data *pa_sdata;
-    struct pal_session_time stime = {0};
-
-#ifdef SINK_DEBUG
-    pa_log_debug("%s", __func__);
-#endif
 
     pa_assert(sdata);
     pa_assert(sdata->pa_sdata);
     pa_assert(sdata->pal_sdata);
+    pa_assert(bytes_rendered);
 
     pal_sdata = sdata->pal_sdata;
     pa_sdata = sdata->pa_sdata;
 
     pa_assert(pa_sdata->sink);
-    pa_assert(sdata->pal_sdata->stream_handle);
 
-    rc = pal_get_timestamp(sdata->pal_sdata->stream_handle, &stime);
-    if (!rc) {
-        abs_qtimer_time_stamp = (uint64_t)(((uint64_t)stime.absolute_time.value_msw << 32) | (uint64_t)stime.absolute_time.value_lsw);
-        session_time_stamp = (uint64_t)(((uint64_t)stime.session_time.value_msw << 32) | (uint64_t)stime.session_time.value_lsw);
+    if (!pal_sdata->stream_handle)
+        return -1;
+
+    rc = pa_pal_latency_smoother_get(pal_sdata->smoother, pal_sdata->stream_handle, &session_time_us);
+    if (rc)
+        return rc;
+
 #ifndef PAL_DISABLE_COMPRESS_AUDIO_SUPPORT
-        pa_sdata->sink->sess_time = session_time_stamp;
+    pa_sdata->sink->sess_time = session_time_us;
 #endif
 
+    *bytes_rendered = pa_usec_to_bytes(session_time_us, &pa_sdata->sink->sample_spec);
+
 #ifdef SINK_DEBUG
-        pa_log_debug("%s: abs_qtimer_time_stamp %" PRId64 " us, session_time_stamp %" PRId64 " us", __func__,
-                     abs_qtimer_time_stamp, session_time_stamp);
+    pa_log_debug("%s:: session time %" PRIu64 "us, raw %" PRIu64 "us, bytes_rendered %" PRIu64, __func__,
+                 session_time_us, pa_pal_latency_smoother_get_raw(pal_sdata->smoother), *bytes_rendered);
 #endif
 
-#if defined __aarch64__
-        asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
-#else
-        asm volatile("mrrc p15, 1, %Q0, %R0, c14" : "=r"(ticks));
-#endif
+    return 0;
+}
 
-        cur_qtimer = (uint64_t)(ticks * 10/192);
+/* Track the hw read pointer of the mmap ring, PAL reports it as a wrapping 32 bit frame counter */
+static int pa_pal_sink_mmap_update_position(pal_sink_data *pal_sdata) {
+    struct pal_mmap_position position;
+    int rc;
 
-#ifdef SINK_DEBUG
-        pa_log_debug("%s:: ticks %" PRId64 " us, qtimer %" PRId64 " us", __func__, ticks, (int64_t)cur_qtimer);
-#endif
+    if (!pal_sdata->stream_handle)
+        return -1;
 
-        if (abs_qtimer_time_stamp > cur_qtimer) {
-            time_in_future = abs_qtimer_time_stamp - cur_qtimer;
-            if (time_in_future < session_time_stamp) {
-                cur_session_time = session_time_stamp - time_in_future;
-                bytes_rendered = pa_usec_to_bytes(cur_session_time, &pa_sdata->sink->sample_spec);
-            } else {
-                bytes_rendered = 0;
-            }
-        } else {
-            time_elapsed = cur_qtimer - abs_qtimer_time_stamp;
-            cur_session_time = session_time_stamp + time_elapsed;
-            bytes_rendered = pa_usec_to_bytes(cur_session_time, &pa_sdata->sink->sample_spec);
-        }
+    rc = pal_stream_get_mmap_position(pal_sdata->stream_handle, &position);
+    if (rc)
+        return rc;
 
-        delta = pal_sdata->bytes_written - bytes_rendered;
-        /* bytes written should never be less than bytes rendered */
-        if (delta <= 0) {
-#ifdef SINK_DEBUG
-            pa_log_debug("latency is 0");
-#endif
-            return 0;
-        }
+    pal_sdata->mmap_hw_frames += (uint32_t)position.position_frames - pal_sdata->mmap_last_position;
+    pal_sdata->mmap_last_position = (uint32_t)position.position_frames;
+
+    return 0;
+}
+
+/* Bytes handed to PAL which the DSP has not rendered yet */
+static int pa_pal_sink_get_queued_bytes(pa_pal_sink_data *sdata, uint64_t *queued) {
+    uint64_t bytes_rendered = 0;
+    int rc;
+
+    if (sdata->pal_sdata->mmap) {
+        pal_sink_data *pal_sdata = sdata->pal_sdata;
+
+        if ((rc = pa_pal_sink_mmap_update_position(pal_sdata)))
+            return rc;
+
+        if (pal_sdata->mmap_frames_written > pal_sdata->mmap_hw_frames)
+            *queued = (pal_sdata->mmap_frames_written - pal_sdata->mmap_hw_frames) * pa_frame_size(&sdata->pa_sdata->sink->sample_spec);
+        else
+            *queued = 0;
+
+        return 0;
+    }
+
+    rc = pa_pal_sink_get_rendered_bytes(sdata, &bytes_rendered);
+    if (rc)
+        return rc;
+
+    /* bytes written should never be less than bytes rendered */
+    if (sdata->pal_sdata->bytes_written > bytes_rendered)
+        *queued = sdata->pal_sdata->bytes_written - bytes_rendered;
+    else
+        *queued = 0;
+
+    return 0;
+}
+
+static uint64_t pa_pal_sink_get_latency(pa_pal_sink_data *sdata) {
+    uint64_t queued = 0;
+    int64_t latency = 0;
+    pal_sink_data *pal_sdata;
+    pa_sink_data *pa_sdata;
+
+    pa_assert(sdata);
+    pa_assert(sdata->pa_sdata);
+    pa_assert(sdata->pal_sdata);
+
+    pal_sdata = sdata->pal_sdata;
+    pa_sdata = sdata->pa_sdata;
+
+    pa_assert(pa_sdata->sink);
+    pa_assert(pal_sdata->stream_handle);
 
-        latency = pa_bytes_to_usec(delta, &pa_sdata->sink->sample_spec);
+    if (!pa_pal_sink_get_queued_bytes(sdata, &queued)) {
+        if (pal_sdata->staging)
+            queued += pa_memblockq_get_length(pal_sdata->staging);
+        latency = pa_bytes_to_usec(queued, &pa_sdata->sink->sample_spec);
 #ifdef SINK_DEBUG
-        pa_log_debug("%s:: time_in_future %" PRId64 ", cur_session_time %" PRId64 " bytes_rendered %d, latency %" PRId64 "", __func__,
-                     time_in_future, cur_session_time, bytes_rendered, (int64_t)latency);
+        pa_log_debug("%s:: queued %" PRIu64 ", latency %" PRId64 "", __func__, queued, latency);
 #endif
     } else  {
-        latency = (int64_t)(pa_bytes_to_usec(pal_sdata->bytes_written, &pa_sdata->sink->sample_spec));
+        /* no timestamp, at most the PAL queue can be pending */
+        queued = PA_MIN(pal_sdata->bytes_written, (uint64_t)pal_sdata->buffer_size * PA_MAX(pal_sdata->buffer_count, 1));
+        latency = (int64_t)(pa_bytes_to_usec(queued, &pa_sdata->sink->sample_spec));
 #ifdef SINK_DEBUG
-        pa_log_debug("pal_get_timestamp failed, using latency based on written bytes latency = %" PRId64 "", latency);
+        pa_log_debug("pal_get_timestamp failed, using latency based on pal queue size latency = %" PRId64 "", latency);
 #endif
     }
 
@@ -388,13 +520,21 @@ static int pa_pal_sink_start(pa_pal_sink_data *sdata) {
     pal_sink_data *pal_sdata = sdata->pal_sdata;
     pa_log_debug("%s %d", __func__, pal_sdata->standby);
 
+    pal_sdata->standby_close_time = 0;
+
+    if (pal_sdata->standby && pal_sdata->pending_buffer_size)
+        pa_pal_sink_resize_period(sdata);
+
     if (pal_sdata->standby) {
-        if (!sdata->pal_sink_opened) {
+        /* the prewarm worker may be opening the session right now */
+        pa_mutex_lock(pal_sdata->mutex);
+        if (!sdata->pal_sink_opened)
             rc = open_pal_sink(sdata);
-            if (rc) {
-                pa_log_error("pal sink open failed, error %d", rc);
-                goto cleanup;
-            }
+        pa_mutex_unlock(pal_sdata->mutex);
+
+        if (rc) {
+            pa_log_error("pal sink open failed, error %d", rc);
+            goto cleanup;
         }
 
         if (pal_sdata->compressed) {
@@ -403,6 +543,9 @@ static int pa_pal_sink_start(pa_pal_sink_data *sdata) {
                 pa_log_error("pa_pal_set_param failed, error %d\n", rc);
                 goto cleanup;
             }
+
+            if (pal_sdata->gapless && (rc = pa_pal_set_param(pal_sdata, PAL_PARAM_ID_GAPLESS_MDATA)))
+                pa_log_error("could not set gapless metadata, error %d", rc);
         }
 
         rc = pal_stream_start(pal_sdata->stream_handle);
@@ -410,6 +553,18 @@ static int pa_pal_sink_start(pa_pal_sink_data *sdata) {
             pa_log_error("pal_stream_start failed, error %d\n", rc);
             goto cleanup;
         }
+
+        /* a new session starts at unity gain */
+        if (pal_sdata->hw_volume->no_of_volpair && (rc = pal_stream_set_volume(pal_sdata->stream_handle, pal_sdata->hw_volume))) {
+            pa_log_error("could not restore volume, error %d", rc);
+            rc = 0;
+        }
+
+        if (pal_sdata->hw_mute && (rc = pal_stream_set_mute(pal_sdata->stream_handle, true))) {
+            pa_log_error("could not restore mute, error %d", rc);
+            rc = 0;
+        }
+
         pa_atomic_store(&sdata->pal_sdata->restart_in_progress, 0);
     } else {
         pa_log_debug("pal_stream already started");
@@ -425,14 +580,61 @@ cleanup:
     return rc;
 }
 
-static int pa_pal_sink_standby(pa_pal_sink_data *sdata) {
+/* Stop the session but keep it open, it is closed by the IO thread once
+ * standby_close_time passes without a new start */
+static void pa_pal_sink_stop(pa_pal_sink_data *sdata) {
+    pal_sink_data *pal_sdata = sdata->pal_sdata;
+    int rc;
+
+    pa_mutex_lock(pal_sdata->mutex);
+
+    if ((rc = pal_stream_stop(pal_sdata->stream_handle)))
+        pa_log_error("pal_stream_stop failed for %p error %d", pal_sdata->stream_handle, rc);
+
+    pal_sdata->bytes_written = 0;
+    pa_pal_latency_smoother_reset(pal_sdata->smoother);
+    pa_pal_stats_session_reset(pal_sdata->stats);
+    pal_sdata->standby = true;
+    pal_sdata->standby_close_time = pa_rtclock_now() + pal_sdata->standby_hysteresis_us;
+
+    pa_mutex_unlock(pal_sdata->mutex);
+
+    pa_log_debug("pal sink %p stopped, closing in %" PRIu64 "us", pal_sdata->stream_handle, pal_sdata->standby_hysteresis_us);
+}
+
+/* Called from IO thread context */
+static void pa_pal_sink_standby_timeout(pa_pal_sink_data *sdata) {
+    pal_sink_data *pal_sdata = sdata->pal_sdata;
+
+    if (!pal_sdata->standby_close_time || !pal_sdata->standby)
+        return;
+
+    if (pa_rtclock_now() < pal_sdata->standby_close_time) {
+        pa_rtpoll_set_timer_absolute(sdata->pa_sdata->rtpoll, pal_sdata->standby_close_time);
+        return;
+    }
+
+    pal_sdata->standby_close_time = 0;
+
+    if (sdata->pal_sink_opened && close_pal_sink(sdata))
+        pa_log_error("could not close sink handle %p after standby hysteresis", pal_sdata->stream_handle);
+}
+
+/* keep_warm only stops the session if a standby hysteresis is configured */
+static int pa_pal_sink_standby(pa_pal_sink_data *sdata, bool keep_warm) {
     int rc = 0;
 
     pa_assert(sdata);
 
     pa_log_debug("%s",__func__);
 
-    if (sdata->pal_sink_opened) {
+    if (sdata->pal_sdata->staging)
+        pa_memblockq_flush_read(sdata->pal_sdata->staging);
+
+    if (sdata->pal_sink_opened && keep_warm && sdata->pal_sdata->standby_hysteresis_us) {
+        if (!sdata->pal_sdata->standby)
+            pa_pal_sink_stop(sdata);
+    } else if (sdata->pal_sink_opened) {
         pa_assert(sdata->pal_sdata);
         rc = close_pal_sink(sdata);
         if (PA_UNLIKELY(rc))
@@ -444,34 +646,18 @@ static int pa_pal_sink_standby(pa_pal_sink_data *sdata) {
     return 0;
 }
 
-static int pa_pal_set_device(pal_stream_handle_t *stream_handle,
-                          pa_pal_card_port_device_data *param_device_connection) {
-    struct pal_device device_connect;
-    int no_of_devices = 1;
-    int ret = 0;
-
-    device_connect.id = param_device_connection->device;
-
-    ret = pal_stream_set_device(stream_handle, no_of_devices, &device_connect);
-    if(ret)
-        pa_log_error("pal sink switch device %d failed %d", device_connect.id, ret);
-    return ret;
-}
-
 static int pa_pal_sink_set_port_cb(pa_sink *s, pa_device_port *p) {
     pa_pal_card_port_device_data *port_device_data;
     pa_pal_card_port_device_data *active_port_device_data;
     pa_pal_sink_data *sdata = (pa_pal_sink_data *)s->userdata;
     pal_param_device_connection_t param_device_connection;
-    int no_of_devices = 1;
+    pa_pal_ctrl_cmd *cmd;
     int ret = 0;
     bool port_changed = false;
 
     pa_assert(sdata);
     pa_assert(sdata->pal_sdata);
     pa_assert(sdata->pal_sdata->pal_device);
-    if (PA_SINK_IS_OPENED(s->state))
-        pa_assert(sdata->pal_sdata->stream_handle);
 
     port_device_data = PA_DEVICE_PORT_DATA(p);
     pa_assert(port_device_data);
@@ -480,19 +666,19 @@ static int pa_pal_sink_set_port_cb(pa_sink *s, pa_device_port *p) {
     pa_assert(active_port_device_data);
 
     /* For HDMI-out device, need set connect state */
-    if (port_device_data->device == PAL_DEVICE_OUT_AUX_DIGITAL |
-          active_port_device_data->device == PAL_DEVICE_OUT_AUX_DIGITAL) {
+    if (pa_pal_util_port_has_device(port_device_data, PAL_DEVICE_OUT_AUX_DIGITAL) |
+          pa_pal_util_port_has_device(active_port_device_data, PAL_DEVICE_OUT_AUX_DIGITAL)) {
         param_device_connection.device_config.dp_config.controller = 0;
         param_device_connection.device_config.dp_config.stream = 0;
         param_device_connection.id = PAL_DEVICE_OUT_AUX_DIGITAL;
 
-        if (port_device_data->device == PAL_DEVICE_OUT_AUX_DIGITAL) {
+        if (pa_pal_util_port_has_device(port_device_data, PAL_DEVICE_OUT_AUX_DIGITAL)) {
             param_device_connection.connection_state = true;
             if(port_device_data->is_connected != param_device_connection.connection_state)
                 port_changed = true;
             port_device_data->is_connected = param_device_connection.connection_state;
         }
-        else if (active_port_device_data->device == PAL_DEVICE_OUT_AUX_DIGITAL) {
+        else if (pa_pal_util_port_has_device(active_port_device_data, PAL_DEVICE_OUT_AUX_DIGITAL)) {
             param_device_connection.connection_state = false;
             if(active_port_device_data->is_connected != param_device_connection.connection_state)
                 port_changed = true;
@@ -510,7 +696,11 @@ static int pa_pal_sink_set_port_cb(pa_sink *s, pa_device_port *p) {
     }
 
     param_device_connection.id = port_device_data->device;
+
+    /* the prewarm worker opens sessions on these devices */
+    pa_mutex_lock(sdata->pal_sdata->device_mutex);
     sdata->pal_sdata->pal_device->id = port_device_data->device;
+    sdata->pal_sdata->pal_device->config.bit_width = port_device_data->bit_width;
     if (port_device_data->pal_devicepp_config){
         pa_strlcpy(sdata->pal_sdata->pal_device->custom_config.custom_key, port_device_data->pal_devicepp_config,
                         sizeof(sdata->pal_sdata->pal_device->custom_config.custom_key));
@@ -519,18 +709,14 @@ static int pa_pal_sink_set_port_cb(pa_sink *s, pa_device_port *p) {
         pa_strlcpy(sdata->pal_sdata->pal_device->custom_config.custom_key, "",
                         sizeof(sdata->pal_sdata->pal_device->custom_config.custom_key));
     }
+    sdata->pal_sdata->n_pal_devices = pa_pal_util_fill_port_devices(sdata->pal_sdata->pal_device, port_device_data);
+    pa_mutex_unlock(sdata->pal_sdata->device_mutex);
 
-    if (PA_SINK_IS_OPENED(s->state)) {
-        sdata->pal_sdata->sink_event_id = PA_PAL_DEVICE_SWITCH;
-        pa_mutex_lock(sdata->pal_sdata->mutex);
-        ret = pa_pal_set_device(sdata->pal_sdata->stream_handle, (pa_pal_card_port_device_data *)&param_device_connection);
-        sdata->pal_sdata->sink_event_id = PA_PAL_NO_EVENT;
-        pa_mutex_unlock(sdata->pal_sdata->mutex);
-        pa_cond_signal(sdata->pal_sdata->cond_ctrl_thread, 0);
-
-        if (ret != 0)
-            pa_log_error("pal sink switch device failed %d", ret);
-    }
+    /* also posted while suspended, a stopped keep-warm session is still open */
+    cmd = pa_pal_ctrl_cmd_new(PA_PAL_DEVICE_SWITCH);
+    memcpy(cmd->devices, sdata->pal_sdata->pal_device, sdata->pal_sdata->n_pal_devices * sizeof(struct pal_device));
+    cmd->n_devices = sdata->pal_sdata->n_pal_devices;
+    pa_pal_sink_post_ctrl(sdata, cmd);
 
     return ret;
 }
@@ -553,10 +739,14 @@ static int pa_pal_sink_set_state_in_io_thread_cb(pa_sink *s, pa_sink_state_t new
         /* do nothing */
         r = 0;
     }
-    else if (PA_SINK_IS_OPENED(new_state))
+    else if (PA_SINK_IS_OPENED(new_state)) {
+        /* the last stream left, take a deferred period while only silence plays */
+        if (new_state == PA_SINK_IDLE && sdata->pal_sdata->pending_buffer_size)
+            pa_pal_sink_resize_period(sdata);
         r = pa_pal_sink_start(sdata);
+    }
     else if (new_state == PA_SINK_SUSPENDED || (new_state == PA_SINK_UNLINKED && sdata->pal_sink_opened))
-        r = pa_pal_sink_standby(sdata);
+        r = pa_pal_sink_standby(sdata, new_state == PA_SINK_SUSPENDED);
 
     return r;
 }
@@ -578,6 +768,56 @@ static int pa_pal_sink_io_process_msg(pa_msgobject *o, int code, void *data, int
         case PA_SINK_MESSAGE_GET_LATENCY:
             *((int64_t*) data) = pa_pal_sink_get_latency(sdata);
             return 0;
+        case PA_PAL_SINK_MESSAGE_CTRL: {
+            /* IO thread, between two periods. The mutex only guards against
+             * the offload write thread and session close */
+            pa_pal_ctrl_cmd *cmd = (pa_pal_ctrl_cmd *)data;
+            pal_sink_data *pal_sdata = sdata->pal_sdata;
+
+            cmd->rc = 0;
+            if (cmd->event == PA_PAL_VOLUME_APPLY)
+                memcpy(pal_sdata->hw_volume, cmd->volume_data, PA_PAL_VOLUME_DATA_SIZE(cmd->volume_data->no_of_volpair));
+            else if (cmd->event == PA_PAL_MUTE_APPLY)
+                pal_sdata->hw_mute = cmd->mute;
+
+            if (cmd->event == PA_PAL_DEVICE_SWITCH && sdata->pal_sink_opened && pal_sdata->standby) {
+                /* stopped session, the next start opens it on the new devices.
+                 * Closing a prewarmed one queues it for the worker again */
+                cmd->rc = close_pal_sink(sdata);
+            } else {
+                pa_mutex_lock(pal_sdata->mutex);
+                if (pal_sdata->stream_handle && sdata->pal_sink_opened)
+                    pa_pal_ctrl_cmd_apply(pal_sdata->stream_handle, cmd);
+                pa_mutex_unlock(pal_sdata->mutex);
+            }
+
+            pa_asyncmsgq_post(sdata->pa_sdata->thread_mq.outq, o, PA_PAL_SINK_MESSAGE_CTRL_DONE, cmd, 0, NULL, NULL);
+            return 0;
+        }
+        case PA_PAL_SINK_MESSAGE_CTRL_DONE: {
+            /* main thread */
+            pa_pal_ctrl_cmd *cmd = (pa_pal_ctrl_cmd *)data;
+            pa_sink *s = sdata->pa_sdata->sink;
+
+            if (cmd->rc)
+                pa_log_error("%s: control event %d failed, error %d", s->name, cmd->event, cmd->rc);
+
+            pa_pal_ctrl_cmd_free(cmd);
+            return 0;
+        }
+        case PA_PAL_SINK_MESSAGE_OFFLOAD_FAILED:
+            /* main thread */
+            pa_pal_sink_offload_failed(sdata);
+            return 0;
+        case PA_PAL_SINK_MESSAGE_SET_PCM_TAP: {
+            /* IO thread, hands the replaced tap back to the caller to free */
+            pa_pal_pcm_tap **tap = (pa_pal_pcm_tap **)data;
+            pa_pal_pcm_tap *old = sdata->pal_sdata->pcm_tap;
+
+            sdata->pal_sdata->pcm_tap = *tap;
+            *tap = old;
+            return 0;
+        }
 #ifndef PAL_DISABLE_COMPRESS_AUDIO_SUPPORT
         case PA_PAL_SINK_MESSAGE_DRAIN_READY:
             pa_sink_drain_complete(sdata->pa_sdata->sink);
@@ -590,6 +830,143 @@ static int pa_pal_sink_io_process_msg(pa_msgobject *o, int code, void *data, int
     return pa_sink_process_msg(o, code, data, offset, chunk);
 }
 
+/* Called from IO thread context, with the session stopped or idle. PAL sizes
+ * its buffers at open time, an opened session is closed so the next start
+ * reopens it with the new period */
+static void pa_pal_sink_resize_period(pa_pal_sink_data *sdata) {
+    pa_sink *s = sdata->pa_sdata->sink;
+    pal_sink_data *pal_sdata = sdata->pal_sdata;
+    size_t buffer_size = pal_sdata->pending_buffer_size;
+
+    pal_sdata->pending_buffer_size = 0;
+    pal_sdata->fill_limit_us = 0;
+
+    if (!buffer_size)
+        return;
+
+    /* the spec may have changed since the request */
+    buffer_size = PA_MAX(pa_frame_align(buffer_size, &s->sample_spec), pa_frame_size(&s->sample_spec));
+    if (buffer_size == pal_sdata->buffer_size)
+        return;
+
+    pa_log_info("%s: buffer size %zu -> %zu", s->name, pal_sdata->buffer_size, buffer_size);
+
+    /* the prewarm worker reads the size when it opens the session, closing
+     * queues a prewarm right away */
+    pa_mutex_lock(pal_sdata->mutex);
+    pal_sdata->buffer_size = buffer_size;
+    pa_mutex_unlock(pal_sdata->mutex);
+
+    if (sdata->pal_sink_opened && close_pal_sink(sdata))
+        pa_log_error("%s: could not close pal sink to resize its buffers", s->name);
+
+    pal_sdata->sink_latency_us = pa_bytes_to_usec(buffer_size, &s->sample_spec);
+    pa_pal_sink_staging_reset(pal_sdata, &s->sample_spec);
+
+    pa_sink_set_max_request_within_thread(s, pal_sdata->buffer_size);
+    pa_sink_set_max_rewind_within_thread(s, pa_pal_sink_get_max_rewind(pal_sdata));
+}
+
+/* Called from IO thread context */
+static void pa_pal_sink_update_requested_latency_cb(pa_sink *s) {
+    pa_pal_sink_data *sdata = (pa_pal_sink_data *) s->userdata;
+    pal_sink_data *pal_sdata;
+    pa_usec_t latency;
+    size_t buffer_size;
+    int rc;
+
+    pa_assert(sdata);
+    pa_assert(sdata->pal_sdata);
+
+    pal_sdata = sdata->pal_sdata;
+
+    latency = pa_sink_get_requested_latency_within_thread(s);
+    if (latency == (pa_usec_t) -1)
+        latency = pal_sdata->max_latency_us; /* nobody cares, save power */
+
+    /* the requested latency covers the whole PAL queue, not a single period */
+    latency = PA_CLAMP(latency, pal_sdata->min_latency_us, pal_sdata->max_latency_us);
+    buffer_size = pa_frame_align(pa_usec_to_bytes(latency, &s->sample_spec) / PA_MAX(pal_sdata->buffer_count, 1), &s->sample_spec);
+    buffer_size = PA_MAX(buffer_size, pa_frame_size(&s->sample_spec));
+
+    if (buffer_size == pal_sdata->buffer_size) {
+        pal_sdata->pending_buffer_size = 0;
+        pal_sdata->fill_limit_us = 0;
+        return;
+    }
+
+    pa_log_info("%s: requested latency %" PRIu64 "us, buffer size %zu", s->name, latency, buffer_size);
+
+    pal_sdata->pending_buffer_size = buffer_size;
+
+    if (!sdata->pal_sink_opened || pal_sdata->standby) {
+        pa_pal_sink_resize_period(sdata);
+        return;
+    }
+
+    /* reopening a running session would drop what is queued in the DSP, the
+     * new period is taken once the sink is idle again. Timer scheduled sinks
+     * meanwhile keep no more than the requested latency queued */
+    if (s->thread_info.state != PA_SINK_IDLE) {
+        pal_sdata->fill_limit_us = latency;
+        return;
+    }
+
+    /* idle, only silence is queued */
+    pa_pal_sink_resize_period(sdata);
+    if ((rc = pa_pal_sink_start(sdata)))
+        pa_log_error("%s: could not restart pal sink with buffer size %zu, error %d", s->name, buffer_size, rc);
+}
+
+/* Called from main context, with the sink not opened. IEC61937 bursts have to
+ * reach the receiver bit exact, so PAL is opened with exactly the S16LE rate
+ * and channel count of the burst framing, whatever the avoid-processing
+ * config is. PA core keeps the volume at 0 dB while the stream plays. */
+static int pa_pal_sink_enter_passthrough(pa_sink *s, pa_pal_sink_data *sdata, const pa_sample_spec *spec) {
+    pal_sink_data *pal_sdata = sdata->pal_sdata;
+    pa_pal_card_port_device_data *port_device_data;
+    pa_sample_spec ss;
+    pa_channel_map map;
+    int rc;
+
+    if (pal_sdata->compressed) {
+        pa_log_error("%s: passthrough needs a pcm sink", s->name);
+        return -1;
+    }
+
+    ss = *spec;
+    ss.format = PA_SAMPLE_S16LE;
+    pa_pal_util_channel_map_init(&map, ss.channels);
+
+    if (!pal_sdata->passthrough) {
+        pal_sdata->pcm_spec = s->sample_spec;
+        pal_sdata->pcm_map = s->channel_map;
+    }
+
+    port_device_data = PA_DEVICE_PORT_DATA(s->active_port);
+    rc = restart_pal_sink(s, PA_ENCODING_PCM, &ss, &map, port_device_data,
+            pal_sdata->stream_attributes->type, pal_sdata->index, sdata,
+            (uint32_t)pa_usec_to_bytes(pal_sdata->sink_latency_us, &ss), pal_sdata->buffer_count);
+    if (PA_UNLIKELY(rc)) {
+        pa_log_error("%s: could not open pal sink for passthrough, error %d", s->name, rc);
+        return rc;
+    }
+
+    pal_sdata->passthrough = true;
+
+    s->reference_volume.channels = ss.channels;
+    pa_cvolume_set(&s->reference_volume, ss.channels, PA_VOLUME_NORM);
+    s->sample_spec = ss;
+    s->channel_map = map;
+    pa_pal_sink_staging_reset(pal_sdata, &ss);
+    pa_sink_set_max_request(s, pal_sdata->buffer_size);
+    pa_sink_set_max_rewind(s, pa_pal_sink_get_max_rewind(pal_sdata));
+
+    pa_log_info("%s: passthrough at %u Hz, %u channels", s->name, ss.rate, ss.channels);
+
+    return 0;
+}
+
 static void pa_pal_sink_reconfigure_cb(pa_sink *s, pa_sample_spec *spec, bool passthrough) {
     pa_pal_sink_data *sdata = NULL;
     pa_sink_data *pa_sdata = NULL;
@@ -604,6 +981,7 @@ static void pa_pal_sink_reconfigure_cb(pa_sink *s, pa_sample_spec *spec, bool pa
     uint32_t i;
     int rc = 0;
     uint32_t old_rate;
+    size_t buffer_size;
 
     pa_assert(s);
     pa_assert(spec);
@@ -635,7 +1013,25 @@ static void pa_pal_sink_reconfigure_cb(pa_sink *s, pa_sample_spec *spec, bool pa
         return;
     }
 
+    /* PA core refuses to reconfigure a running sink and suspends any other
+     * one before calling here, so an opened sink is never switched in place.
+     * PAL has no parameter to change the media config of a started pcm
+     * session either, the suspended path reopens it */
     if (!PA_SINK_IS_OPENED(s->state)) {
+        if (passthrough) {
+            pa_pal_sink_enter_passthrough(s, sdata, spec);
+            return;
+        }
+
+        /* back to the pcm config the passthrough stream replaced */
+        if (pal_sdata->passthrough) {
+            pa_sdata->sink->sample_spec = pal_sdata->pcm_spec;
+            pa_sdata->sink->channel_map = pal_sdata->pcm_map;
+            s->reference_volume.channels = pal_sdata->pcm_spec.channels;
+            pal_sdata->buffer_size = pa_usec_to_bytes(pal_sdata->sink_latency_us, &pal_sdata->pcm_spec);
+            pal_sdata->passthrough = false;
+        }
+
         pa_channel_map_init_auto(&new_map, spec->channels, PA_CHANNEL_MAP_DEFAULT);
 
         old_rate = pa_sdata->sink->sample_spec.rate; /* take backup */
@@ -661,14 +1057,17 @@ static void pa_pal_sink_reconfigure_cb(pa_sink *s, pa_sample_spec *spec, bool pa
         else
             tmp_spec.rate = pa_sdata->sink->sample_spec.rate;
 
-        if (pa_sdata->avoid_config_processing & PA_PAL_CARD_AVOID_PROCESSING_FOR_ALL)
-            pal_sdata->buffer_size = sink_get_buffer_size(tmp_spec, stream_type);
+        buffer_size = pal_sdata->buffer_size;
+        if (pal_sdata->dynamic_latency)
+            buffer_size = pa_usec_to_bytes(pal_sdata->sink_latency_us, &tmp_spec);
+        else if (pa_sdata->avoid_config_processing & PA_PAL_CARD_AVOID_PROCESSING_FOR_ALL)
+            buffer_size = sink_get_buffer_size(tmp_spec, stream_type);
 
         port_device_data = PA_DEVICE_PORT_DATA(pa_sdata->sink->active_port);
         pa_cvolume_set(&s->reference_volume, s->reference_volume.channels, volume);
         rc = restart_pal_sink(s, PA_ENCODING_PCM, &tmp_spec, &new_map, port_device_data,
                 pal_sdata->stream_attributes->type, pal_sdata->index, sdata,
-                (uint32_t)pal_sdata->buffer_size, pal_sdata->buffer_count);
+                (uint32_t)buffer_size, pal_sdata->buffer_count);
         if (PA_UNLIKELY(rc)) {
             pa_sdata->sink->sample_spec.rate = old_rate; /* restore old rate if failed */
             pa_log_error("Could create reopen pal sink, error %d", rc);
@@ -677,14 +1076,48 @@ static void pa_pal_sink_reconfigure_cb(pa_sink *s, pa_sample_spec *spec, bool pa
 
         pa_sdata->sink->sample_spec = tmp_spec;
         pa_sdata->sink->channel_map = new_map;
+        pa_pal_sink_staging_reset(pal_sdata, &tmp_spec);
         pa_sink_set_max_request(pa_sdata->sink, pal_sdata->buffer_size);
-        pa_sink_set_max_rewind(pa_sdata->sink, 0);
-        pa_sink_set_fixed_latency(pa_sdata->sink, pal_sdata->sink_latency_us);
+        pa_sink_set_max_rewind(pa_sdata->sink, pa_pal_sink_get_max_rewind(pal_sdata));
+        if (!pal_sdata->dynamic_latency)
+            pa_sink_set_fixed_latency(pa_sdata->sink, pal_sdata->sink_latency_us);
     }
 
     return;
 }
 
+/* Called from main context */
+static bool pa_pal_sink_offload_blocked(pa_pal_sink_data *sdata) {
+    return sdata->pal_sdata->offload_retry_time && pa_rtclock_now() < sdata->pal_sdata->offload_retry_time;
+}
+
+/* Called from main context. The offload session could not be opened or died
+ * with the DSP. Compressed data can't be decoded here, so the compressed
+ * streams are failed back to their clients and compressed formats are refused
+ * for a while, which lets clients reconnect with pcm. */
+static void pa_pal_sink_offload_failed(pa_pal_sink_data *sdata) {
+    pa_sink *s = sdata->pa_sdata->sink;
+    pa_sink_input *i;
+    uint32_t idx;
+    bool killed;
+
+    sdata->pal_sdata->offload_retry_time = pa_rtclock_now() + PA_OFFLOAD_RETRY_INTERVAL_MS * PA_USEC_PER_MSEC;
+    pa_log_warn("%s: offload unavailable, refusing compressed streams for %u ms", s->name, PA_OFFLOAD_RETRY_INTERVAL_MS);
+
+    /* killing unlinks the input, so restart the walk after each one */
+    do {
+        killed = false;
+        PA_IDXSET_FOREACH(i, s->inputs, idx) {
+            if (!pa_format_info_is_pcm(i->format)) {
+                pa_log_info("%s: failing compressed stream %u", s->name, i->index);
+                pa_sink_input_kill(i);
+                killed = true;
+                break;
+            }
+        }
+    } while (killed);
+}
+
 static pa_idxset* pa_pal_sink_get_formats(pa_sink *s) {
     pa_pal_sink_data *sdata = NULL;
 
@@ -695,10 +1128,60 @@ static pa_idxset* pa_pal_sink_get_formats(pa_sink *s) {
     pa_assert(sdata);
     pa_assert(sdata->pa_sdata);
 
+    /* while offload is backing off only pcm is offered, clients negotiating
+     * formats then decode themselves and routing picks a pcm sink */
+    if (pa_pal_sink_offload_blocked(sdata)) {
+        pa_idxset *formats = pa_idxset_new(NULL, NULL);
+        pa_format_info *f;
+        uint32_t i;
+
+        PA_IDXSET_FOREACH(f, sdata->pa_sdata->formats, i)
+            if (pa_format_info_is_pcm(f) || pa_pal_sink_is_iec61937_encoding(f->encoding))
+                pa_idxset_put(formats, pa_format_info_copy(f), NULL);
+
+        return formats;
+    }
+
     return pa_idxset_copy(sdata->pa_sdata->formats, (pa_copy_func_t) pa_format_info_copy);
 }
 
 #ifndef PAL_DISABLE_COMPRESS_AUDIO_SUPPORT
+/* Feed the next track into the running session. Only possible when the
+ * decoder does not change, PAL then gets the new codec parameters and
+ * gapless metadata and keeps playing across the track boundary. */
+static bool pa_pal_sink_gapless_next_track(pa_pal_sink_data *sdata, pa_encoding_t encoding) {
+    pal_sink_data *pal_sdata = sdata->pal_sdata;
+    pal_audio_fmt_t pal_format;
+    pa_pal_ctrl_cmd *cmd;
+
+    if (!sdata->pal_sink_opened || pal_sdata->standby || pal_sdata->encoding != encoding)
+        return false;
+
+    pal_format = pa_pal_util_get_pal_format_from_pa_encoding(encoding, pal_sdata->pal_snd_dec);
+    if (!pal_format || pal_format != pal_sdata->stream_attributes->out_media_config.aud_fmt_id)
+        return false;
+
+    /* applied by the IO thread, before the first chunk of the next track */
+    cmd = pa_pal_ctrl_cmd_new(PA_PAL_SET_PARAM);
+    cmd->param_id = PAL_PARAM_ID_CODEC_CONFIGURATION;
+    if (!(cmd->param_payload = pa_pal_sink_new_param_payload(pal_sdata, cmd->param_id))) {
+        pa_pal_ctrl_cmd_free(cmd);
+        return false;
+    }
+    pa_pal_sink_post_ctrl(sdata, cmd);
+
+    cmd = pa_pal_ctrl_cmd_new(PA_PAL_SET_PARAM);
+    cmd->param_id = PAL_PARAM_ID_GAPLESS_MDATA;
+    if ((cmd->param_payload = pa_pal_sink_new_param_payload(pal_sdata, cmd->param_id)))
+        pa_pal_sink_post_ctrl(sdata, cmd);
+    else
+        pa_pal_ctrl_cmd_free(cmd);
+
+    pa_atomic_store(&pal_sdata->track_drained, 0);
+
+    return true;
+}
+
 static bool pa_pal_sink_set_format_cb(pa_sink *s, const pa_format_info *format) {
     pal_sink_data *pal_sdata;
     pa_sink_data *pa_sdata;
@@ -723,11 +1206,22 @@ static bool pa_pal_sink_set_format_cb(pa_sink *s, const pa_format_info *format)
     if (format != NULL) {
         pa_log_debug("Negotiated format: %s", pa_format_info_snprint(fmt, sizeof(fmt), format));
 
+        /* passthrough is set up by reconfigure, nothing to decode here */
+        if (pa_pal_sink_is_iec61937_encoding(format->encoding)) {
+            ret = true;
+            goto exit;
+        }
+
         if (pa_format_info_is_compressed(format) == 0) {
             pa_log_error("%s: Format info structure is not compressed", __func__);
             goto exit;
         }
 
+        if (pa_pal_sink_offload_blocked(sdata)) {
+            pa_log_info("%s: offload backing off after a failure, refusing %s", __func__, pa_encoding_to_string(format->encoding));
+            goto exit;
+        }
+
         if (pa_pal_util_set_pal_metadata_from_pa_format(format) < 0) {
             pa_log_error("%s: Failed to set metadata from format", __func__);
             goto exit;
@@ -759,18 +1253,45 @@ static bool pa_pal_sink_set_format_cb(pa_sink *s, const pa_format_info *format)
               pa_sample_spec_snprint(ss_buf, sizeof(ss_buf), &ss),
               pa_channel_map_snprint(ch_map_buf, sizeof(ch_map_buf), &map));
 
+       if (pal_sdata->gapless) {
+           pa_pal_util_get_gapless_metadata_from_pa_format(format, &pal_sdata->gapless_mdata);
+
+           if (pa_pal_sink_gapless_next_track(sdata, encoding)) {
+               pa_log_info("%s: switched to next track without closing pal_sink", __func__);
+               ret = true;
+               goto exit;
+           }
+       }
+
        port_device_data = PA_DEVICE_PORT_DATA(pa_sdata->sink->active_port);
 
        if (restart_pal_sink(s, encoding, &pa_sdata->sink->sample_spec, &map, port_device_data,
                                 pal_sdata->stream_attributes->type, pal_sdata->index, sdata,
                                 (uint32_t)pal_sdata->buffer_size, pal_sdata->buffer_count)) {
            pa_log_error("%s: Failed to restart pal_sink with %s encoding", __func__, format == NULL ? "default" : "requested");
+           /* e.g. all DSP offload sessions busy */
+           pa_pal_sink_offload_failed(sdata);
            goto exit;
        } else {
            pa_log_info("%s: Started pal_sink with %s encoding", __func__, format == NULL ? "default" : "requested");
+           pa_atomic_store(&pal_sdata->offload_failed, 0);
+           pal_sdata->offload_retry_time = 0;
            ret = true;
        }
    } else {
+       /* the pcm config is restored by reconfigure once the sink is idle */
+       if (pal_sdata->passthrough) {
+           ret = true;
+           goto exit;
+       }
+
+       if (pal_sdata->gapless && sdata->pal_sink_opened && pa_atomic_load(&pal_sdata->track_drained)) {
+           /* track played out through a partial drain, keep the session for the next one */
+           pa_log_debug("%s: track finished, waiting for next track", __func__);
+           ret = true;
+           goto exit;
+       }
+
        if (sdata->pal_sdata->stream_handle != NULL) {
            pa_atomic_store(&sdata->pal_sdata->close_output, 1);
            /* stream should be in paused state during flush */
@@ -803,7 +1324,16 @@ static int pa_pal_sink_drain_cb(pa_sink *s) {
 
     pa_log_info("Func:%s", __func__);
 
-    return pal_stream_drain(sdata->pal_sdata->stream_handle, PAL_DRAIN_PARTIAL);
+    pa_atomic_store(&sdata->pal_sdata->track_drained, 1);
+
+    if (!sdata->pal_sdata->offload_queue)
+        return pal_stream_drain(sdata->pal_sdata->stream_handle, PAL_DRAIN_PARTIAL);
+
+    /* drain once the write thread has handed all queued chunks to PAL */
+    pa_atomic_store(&sdata->pal_sdata->drain_requested, 1);
+    pa_fdsem_post(sdata->pal_sdata->pal_fdsem);
+
+    return rc;
 }
 
 static int pa_pal_sink_flush_cb(pa_sink *s) {
@@ -819,6 +1349,9 @@ static int pa_pal_sink_flush_cb(pa_sink *s) {
 
     pa_log_info("Func:%s", __func__);
 
+    /* a flushed track never reaches its early EOS */
+    pa_atomic_store(&sdata->pal_sdata->track_drained, 0);
+
     /* stream should be in paused state during flush */
     pal_stream_pause(sdata->pal_sdata->stream_handle);
 
@@ -826,13 +1359,109 @@ static int pa_pal_sink_flush_cb(pa_sink *s) {
 }
 #endif
 
-static void write_chunk(pa_pal_sink_data *sdata, pa_memchunk *chunk) {
+struct pa_pal_chunk_queue {
+    pa_memchunk *chunks;
+    int *sessions; /* session_id each chunk was rendered for */
+    unsigned size; /* power of 2, >= depth */
+    unsigned depth;
+    pa_atomic_t read_idx;  /* only advanced by the consumer */
+    pa_atomic_t write_idx; /* only advanced by the producer */
+};
+
+static pa_pal_chunk_queue* pa_pal_chunk_queue_new(unsigned depth) {
+    pa_pal_chunk_queue *q = pa_xnew0(pa_pal_chunk_queue, 1);
+
+    q->depth = depth;
+    q->size = 1;
+    while (q->size < depth)
+        q->size <<= 1;
+
+    q->chunks = pa_xnew0(pa_memchunk, q->size);
+    q->sessions = pa_xnew0(int, q->size);
+    pa_atomic_store(&q->read_idx, 0);
+    pa_atomic_store(&q->write_idx, 0);
+
+    return q;
+}
+
+static unsigned pa_pal_chunk_queue_length(pa_pal_chunk_queue *q) {
+    return (unsigned)pa_atomic_load(&q->write_idx) - (unsigned)pa_atomic_load(&q->read_idx);
+}
+
+/* producer side, the queue takes over the chunk reference */
+static bool pa_pal_chunk_queue_push(pa_pal_chunk_queue *q, pa_memchunk *chunk, int session) {
+    unsigned w = (unsigned)pa_atomic_load(&q->write_idx);
+
+    if (w - (unsigned)pa_atomic_load(&q->read_idx) >= q->depth)
+        return false;
+
+    q->chunks[w & (q->size - 1)] = *chunk;
+    q->sessions[w & (q->size - 1)] = session;
+    pa_atomic_store(&q->write_idx, (int)(w + 1));
+
+    return true;
+}
+
+/* consumer side, session may be NULL */
+static pa_memchunk* pa_pal_chunk_queue_peek(pa_pal_chunk_queue *q, int *session) {
+    unsigned r = (unsigned)pa_atomic_load(&q->read_idx);
+
+    if (r == (unsigned)pa_atomic_load(&q->write_idx))
+        return NULL;
+
+    if (session)
+        *session = q->sessions[r & (q->size - 1)];
+
+    return &q->chunks[r & (q->size - 1)];
+}
+
+static void pa_pal_chunk_queue_drop(pa_pal_chunk_queue *q) {
+    pa_atomic_store(&q->read_idx, (int)((unsigned)pa_atomic_load(&q->read_idx) + 1));
+}
+
+/* only safe once producer and consumer are stopped */
+static void pa_pal_chunk_queue_free(pa_pal_chunk_queue *q) {
+    pa_memchunk *chunk;
+
+    while ((chunk = pa_pal_chunk_queue_peek(q, NULL))) {
+        pa_memblock_unref(chunk->memblock);
+        pa_pal_chunk_queue_drop(q);
+    }
+
+    pa_xfree(q->chunks);
+    pa_xfree(q->sessions);
+    pa_xfree(q);
+}
+
+/* Called from IO thread context. The chunk may be shared with a sink input,
+ * so convert into a buffer of our own */
+static void* pa_pal_sink_convert_float(pal_sink_data *pal_sdata, const void *src, size_t length) {
+    if (pal_sdata->convert_buf_size < length) {
+        pa_xfree(pal_sdata->convert_buf);
+        pal_sdata->convert_buf = pa_xmalloc(length);
+        pal_sdata->convert_buf_size = length;
+    }
+
+    pa_pal_util_float32_to_s32(pal_sdata->convert_buf, src, length / sizeof(float));
+
+    return pal_sdata->convert_buf;
+}
+
+/* session is the session_id the chunk was rendered for, it is dropped once
+ * that session got closed */
+static void write_chunk(pa_pal_sink_data *sdata, pa_memchunk *chunk, int session) {
     int rc = 0;
     void *data = NULL;
+    void *pcm = NULL;
     struct pal_buffer out_buf;
     pa_sink_data *pa_sdata =  sdata->pa_sdata;
     pal_sink_data *pal_sdata = sdata->pal_sdata;
     size_t sink_buffer_size = pal_sdata->buffer_size;
+    pa_usec_t start, buffered_us = 0;
+
+    /* compressed writes are paced by WRITE_READY, a gap is no underrun there */
+    if (!pal_sdata->compressed)
+        buffered_us = pa_bytes_to_usec(pal_sdata->buffer_size * pal_sdata->buffer_count, &pa_sdata->sink->sample_spec);
 
     memset(&out_buf, 0, sizeof(struct pal_buffer));
     data = pa_memblock_acquire(chunk->memblock);
@@ -840,17 +1469,31 @@ static void write_chunk(pa_pal_sink_data *sdata, pa_memchunk *chunk) {
     out_buf.size = chunk->length;
     sink_buffer_size = chunk->length;
 
+    pcm = out_buf.buffer;
+    if (pal_sdata->convert_float && !pal_sdata->compressed)
+        out_buf.buffer = pa_pal_sink_convert_float(pal_sdata, pcm, out_buf.size);
+
     while(out_buf.buffer && !pa_atomic_load(&sdata->pal_sdata->close_output)) {
         pa_mutex_lock(pal_sdata->mutex);
-        if (pal_sdata->sink_event_id != PA_PAL_NO_EVENT) {
-            /* wait for response from ctrl thread */
-            pa_cond_wait(pal_sdata->cond_ctrl_thread, pal_sdata->mutex);
+        if (session != pa_atomic_load(&pal_sdata->session_id)) {
+            /* queued before a close, e.g. mp3 data ahead of a set_format to aac */
+            pa_mutex_unlock(pal_sdata->mutex);
+            break;
         }
         if (pal_sdata->stream_handle) {
+            start = pa_rtclock_now();
             if ((rc = pal_stream_write(pal_sdata->stream_handle, &out_buf)) < 0) {
                 pa_log_error("Could not write data: %d %d", rc, __LINE__);
+                pa_pal_stats_io_error(pal_sdata->stats);
+                pa_mutex_unlock(pal_sdata->mutex);
+
+                /* offload session is gone (DSP restart), once per session */
+                if (pal_sdata->compressed && pa_atomic_cmpxchg(&pal_sdata->offload_failed, 0, 1))
+                    pa_asyncmsgq_post(pa_sdata->thread_mq.outq, PA_MSGOBJECT(pa_sdata->sink),
+                                      PA_PAL_SINK_MESSAGE_OFFLOAD_FAILED, NULL, 0, NULL, NULL);
                 break;
             }
+            pa_pal_stats_io(pal_sdata->stats, start, pa_rtclock_now(), buffered_us);
         }
         else
             rc = -1;
@@ -876,10 +1519,8 @@ static void write_chunk(pa_pal_sink_data *sdata, pa_memchunk *chunk) {
             pa_log_debug("[%d]Func:%s Write data: size %d total %d", __LINE__, __func__,
                     rc, pal_sdata->bytes_written);
 #endif
-#ifdef SINK_DUMP_ENABLED
-            if ((rc = write(pal_sdata->write_fd, out_buf.buffer, out_buf.size)) < 0)
-                pa_log_error("write to fd failed %d", rc);
-#endif
+            if (pal_sdata->pcm_tap && !pal_sdata->compressed && rc > 0)
+                pa_pal_pcm_tap_write(pal_sdata->pcm_tap, pcm, rc);
             /* Mark buffer as NULL, to indicate buffer has been consumed */
             out_buf.size = out_buf.size - rc;
             out_buf.buffer = NULL;
@@ -890,33 +1531,15 @@ static void write_chunk(pa_pal_sink_data *sdata, pa_memchunk *chunk) {
     pa_memblock_unref(chunk->memblock);
 }
 
-static int pal_sink_process_msg(pa_msgobject *o, int code, void *data, int64_t offset, pa_memchunk *chunk) {
-    int rc = -1;
-    pa_pal_sink_data *sdata = (pa_pal_sink_data *)(PAL_MSG_OBJ(o)->userdata);
-
-    pa_assert(sdata);
-    pa_assert(chunk);
-
-    switch (code) {
-        case PAL_SINK_MESSAGE_WRITE_READY:
-            write_chunk(sdata, chunk);
-            pa_atomic_store(&sdata->pal_sdata->write_done, 1);
-            rc = 0;
-            /* Wake up sink thread */
-            pa_fdsem_post(sdata->fdsem);
-            break;
-        default:
-            pa_log_info("%s: Unknown code", __func__);
-            break;
-    }
-
-    return rc;
-}
-
+/* Writes queued compressed chunks to PAL. Partial writes wait for the
+ * WRITE_READY callback, new chunks from the I/O thread wake us up the same way. */
 static void pal_sink_thread_func(void *userdata) {
     pa_pal_sink_data *sink_data = (pa_pal_sink_data *) userdata;
     pa_sink_data *pa_sdata = sink_data->pa_sdata;
     pal_sink_data *pal_sdata = sink_data->pal_sdata;
+    pa_memchunk *chunk;
+    int session;
+    int rc;
 
     if ((pa_sdata->sink->core->realtime_scheduling)) {
         pa_log_info("%s:: Making io thread for %s as realtime with prio %d", __func__,
@@ -927,29 +1550,27 @@ static void pal_sink_thread_func(void *userdata) {
 
     pa_log_debug("Sink Write Thread starting up");
 
-    pa_thread_mq_install(&pal_sdata->pal_thread_mq);
+    while (!pa_atomic_load(&pal_sdata->pal_thread_exit)) {
+        if (!(chunk = pa_pal_chunk_queue_peek(pal_sdata->offload_queue, &session))) {
+            /* everything is with PAL now, a pending drain can go ahead */
+            if (pa_atomic_cmpxchg(&pal_sdata->drain_requested, 1, 0) && pal_sdata->stream_handle) {
+                if ((rc = pal_stream_drain(pal_sdata->stream_handle, PAL_DRAIN_PARTIAL)))
+                    pa_log_error("pal_stream_drain failed, error %d", rc);
+            }
 
-    for (;;) {
-        int ret = 0;
+            /* nothing to do. Let's sleep */
+            pa_fdsem_wait(pal_sdata->pal_fdsem);
+            continue;
+        }
 
-        /* nothing to do. Let's sleep */
-        pa_rtpoll_set_timer_disabled(pal_sdata->pal_thread_rtpoll);
-        if ((ret = pa_rtpoll_run(pal_sdata->pal_thread_rtpoll)) < 0)
-            goto fail;
+        /* drops the data as well if the session is being closed */
+        write_chunk(sink_data, chunk, session);
+        pa_pal_chunk_queue_drop(pal_sdata->offload_queue);
 
-        if (ret == 0)
-            goto finish;
+        /* Wake up sink thread to render the next chunk */
+        pa_fdsem_post(sink_data->fdsem);
     }
 
-fail:
-    /* If this was no regular exit from the loop we have to continue
-     * processing messages until we received PA_MESSAGE_SHUTDOWN
-     */
-    pa_asyncmsgq_post(pal_sdata->pal_thread_mq.outq, PA_MSGOBJECT(pa_sdata->sink->core),
-            PA_CORE_MESSAGE_UNLOAD_MODULE, pa_sdata->sink->module, 0, NULL, NULL);
-    pa_asyncmsgq_wait_for(pal_sdata->pal_thread_mq.inq, PA_MESSAGE_SHUTDOWN);
-
-finish:
     pa_log_debug("Sink Write Thread shutting down");
 }
 
@@ -963,15 +1584,12 @@ static int create_pal_sink_thread(pa_pal_sink_data *sdata) {
     pa_assert(pa_sdata);
     pa_assert(pal_sdata);
 
-    pa_atomic_store(&pal_sdata->write_done, 1);
+    pa_atomic_store(&pal_sdata->pal_thread_exit, 0);
+    pa_atomic_store(&pal_sdata->drain_requested, 0);
 
-    pal_sdata->pal_thread_rtpoll = pa_rtpoll_new();
-    pa_thread_mq_init(&pal_sdata->pal_thread_mq, pa_sdata->sink->core->mainloop,
-            pal_sdata->pal_thread_rtpoll);
+    /* keep buffer_count compressed buffers queued up for PAL */
+    pal_sdata->offload_queue = pa_pal_chunk_queue_new(PA_MAX(pal_sdata->buffer_count, 2));
 
-    pal_sdata->pal_msg = pa_msgobject_new(pal_msg_obj);
-    pal_sdata->pal_msg->parent.process_msg = pal_sink_process_msg;
-    pal_sdata->pal_msg->userdata = (void *)sdata;
     pal_sdata->pal_fdsem = pa_fdsem_new();
     if (!pal_sdata->pal_fdsem) {
         pa_log_error("Could not create pal fdsem");
@@ -979,14 +1597,6 @@ static int create_pal_sink_thread(pa_pal_sink_data *sdata) {
         goto fail;
     }
 
-    pal_sdata->pal_rtpoll_item = pa_rtpoll_item_new_fdsem(pal_sdata->pal_thread_rtpoll,
-            PA_RTPOLL_NORMAL, pal_sdata->pal_fdsem);
-    if (!pal_sdata->pal_rtpoll_item) {
-        pa_log_error("Could not create rpoll item");
-        ret = -1;
-        goto fail;
-    }
-
     thread_name = pa_sprintf_malloc("%s_pal_thread", pa_sdata->sink->name);
 
     if (!(pal_sdata->pal_thread = pa_thread_new(thread_name, pal_sink_thread_func, sdata))) {
@@ -996,6 +1606,7 @@ static int create_pal_sink_thread(pa_pal_sink_data *sdata) {
         goto fail;
     }
     pa_log_debug("%s %s created", __func__, thread_name);
+    pa_xfree(thread_name);
 
 fail:
     if (ret)
@@ -1004,6 +1615,165 @@ fail:
     return ret;
 }
 
+/* Render one period for PAL. With a staging ring the mix is rendered ahead
+ * into the ring and only its oldest period is handed out, the rest can still
+ * be rewritten by a rewind. */
+static void pa_pal_sink_render_period(pa_pal_sink_data *sdata, pa_memchunk *chunk) {
+    pa_sink *s = sdata->pa_sdata->sink;
+    pal_sink_data *pal_sdata = sdata->pal_sdata;
+    pa_memchunk rendered;
+    size_t staging_size;
+
+    if (!pal_sdata->staging) {
+        pa_sink_render_full(s, pal_sdata->buffer_size, chunk);
+        return;
+    }
+
+    staging_size = pal_sdata->buffer_size * (pal_sdata->rewind_buffer_count + 1);
+    while (pa_memblockq_get_length(pal_sdata->staging) < staging_size) {
+        pa_sink_render_full(s, pal_sdata->buffer_size, &rendered);
+        pa_memblockq_push_align(pal_sdata->staging, &rendered);
+        pa_memblock_unref(rendered.memblock);
+    }
+
+    pa_assert_se(pa_memblockq_peek_fixed_size(pal_sdata->staging, pal_sdata->buffer_size, chunk) >= 0);
+    pa_memblockq_drop(pal_sdata->staging, chunk->length);
+}
+
+static void pa_pal_sink_process_rewind(pa_pal_sink_data *sdata) {
+    pa_sink *s = sdata->pa_sdata->sink;
+    pal_sink_data *pal_sdata = sdata->pal_sdata;
+    size_t rewind_nbytes = 0;
+
+    if (pal_sdata->staging && PA_SINK_IS_OPENED(s->thread_info.state)) {
+        rewind_nbytes = PA_MIN(s->thread_info.rewind_nbytes, pa_memblockq_get_length(pal_sdata->staging));
+        /* drop the newest audio so it gets rendered again */
+        if (rewind_nbytes > 0)
+            pa_memblockq_seek(pal_sdata->staging, -(int64_t)rewind_nbytes, PA_SEEK_RELATIVE, true);
+    }
+
+#ifdef SINK_DEBUG
+    pa_log_debug("%s: requested %zu, rewound %zu", __func__, s->thread_info.rewind_nbytes, rewind_nbytes);
+#endif
+
+    pa_sink_process_rewind(s, rewind_nbytes);
+}
+
+/* Render the mix straight into the PAL mmap ring. The DSP consumes the ring
+ * without interrupts, so keep PA_DEFAULT_MMAP_BURST_COUNT bursts ahead of the
+ * hw read pointer and wake up once a burst has been played. */
+static void pa_pal_sink_mmap_render(pa_pal_sink_data *sdata) {
+    pa_sink_data *pa_sdata = sdata->pa_sdata;
+    pal_sink_data *pal_sdata = sdata->pal_sdata;
+    size_t frame_size = pa_frame_size(&pa_sdata->sink->sample_spec);
+    uint64_t ring_frames = pal_sdata->mmap_buffer.buffer_size_frames;
+    uint64_t burst_frames = pal_sdata->mmap_buffer.burst_size_frames;
+    uint64_t target_frames, queued_frames, offset, n;
+    pa_usec_t sleep_us;
+    pa_memchunk chunk;
+    uint8_t *dst;
+
+    if (!burst_frames)
+        burst_frames = pal_sdata->buffer_size / frame_size;
+    target_frames = PA_MIN(ring_frames, burst_frames * PA_DEFAULT_MMAP_BURST_COUNT);
+
+    if (pa_pal_sink_mmap_update_position(pal_sdata)) {
+        pa_log_error("%s: could not read mmap position", __func__);
+        pa_rtpoll_set_timer_relative(pa_sdata->rtpoll, pa_bytes_to_usec(burst_frames * frame_size, &pa_sdata->sink->sample_spec));
+        return;
+    }
+
+    if (pal_sdata->mmap_frames_written < pal_sdata->mmap_hw_frames) {
+        /* DSP ran past us, continue right behind the read pointer */
+        pa_log_debug("%s: underrun by %" PRIu64 " frames", __func__, pal_sdata->mmap_hw_frames - pal_sdata->mmap_frames_written);
+        pa_pal_stats_xrun(pal_sdata->stats);
+        pal_sdata->mmap_frames_written = pal_sdata->mmap_hw_frames;
+    }
+
+    queued_frames = pal_sdata->mmap_frames_written - pal_sdata->mmap_hw_frames;
+
+    while (queued_frames < target_frames) {
+        offset = pal_sdata->mmap_frames_written % ring_frames;
+        n = PA_MIN(target_frames - queued_frames, ring_frames - offset);
+
+        chunk.memblock = pa_memblock_new_fixed(pa_sdata->sink->core->mempool,
+                                               (uint8_t *)pal_sdata->mmap_buffer.buffer + offset * frame_size,
+                                               n * frame_size, false);
+        chunk.index = 0;
+        chunk.length = n * frame_size;
+
+        pa_sink_render_into_full(pa_sdata->sink, &chunk);
+        pa_memblock_unref_fixed(chunk.memblock);
+
+        dst = (uint8_t *)pal_sdata->mmap_buffer.buffer + offset * frame_size;
+        if (pal_sdata->pcm_tap)
+            pa_pal_pcm_tap_write(pal_sdata->pcm_tap, dst, n * frame_size);
+
+        /* the ring is ours, convert in place */
+        if (pal_sdata->convert_float)
+            pa_pal_util_float32_to_s32((int32_t *)dst, (const float *)dst, n * frame_size / sizeof(float));
+
+        pal_sdata->mmap_frames_written += n;
+        queued_frames += n;
+    }
+
+    pal_sdata->bytes_written = pal_sdata->mmap_frames_written * frame_size;
+
+    sleep_us = pa_bytes_to_usec((queued_frames - PA_MIN(queued_frames, burst_frames)) * frame_size, &pa_sdata->sink->sample_spec);
+    pal_sdata->wakeup_deadline = pa_rtclock_now() + sleep_us;
+    pa_rtpoll_set_timer_relative(pa_sdata->rtpoll, sleep_us);
+}
+
+/* Keep the PAL queue topped up to buffer_count periods without blocking in
+ * pal_stream_write and sleep until the DSP has drained it to the watermark. */
+static void pa_pal_sink_tsched_render(pa_pal_sink_data *sdata) {
+    pa_sink_data *pa_sdata = sdata->pa_sdata;
+    pal_sink_data *pal_sdata = sdata->pal_sdata;
+    size_t periods = pal_sdata->buffer_count;
+    uint64_t queue_size;
+    uint64_t queued = 0;
+    pa_usec_t queued_us, sleep_us = 0;
+    pa_usec_t period_us, watermark_us;
+    pa_memchunk chunk;
+
+    period_us = pa_bytes_to_usec(pal_sdata->buffer_size, &pa_sdata->sink->sample_spec);
+
+    /* a client asked for less latency than the session was opened with */
+    if (pal_sdata->fill_limit_us)
+        periods = PA_CLAMP(pal_sdata->fill_limit_us / PA_MAX(period_us, 1), 1, pal_sdata->buffer_count);
+
+    queue_size = (uint64_t)pal_sdata->buffer_size * periods;
+
+    if (pa_pal_sink_get_queued_bytes(sdata, &queued)) {
+        /* no timestamp from DSP yet, let pal_stream_write pace us for this period */
+        pa_pal_sink_render_period(sdata, &chunk);
+        write_chunk(sdata, &chunk, pa_atomic_load(&pal_sdata->session_id));
+        pa_rtpoll_set_timer_absolute(pa_sdata->rtpoll, pa_rtclock_now());
+        return;
+    }
+
+    while (queued + pal_sdata->buffer_size <= queue_size && !pa_atomic_load(&pal_sdata->close_output)) {
+        pa_pal_sink_render_period(sdata, &chunk);
+        pa_assert(chunk.length == pal_sdata->buffer_size);
+        write_chunk(sdata, &chunk, pa_atomic_load(&pal_sdata->session_id));
+        queued += pal_sdata->buffer_size;
+    }
+
+    /* leave room for at least one period above the watermark */
+    watermark_us = PA_MIN(pal_sdata->tsched_watermark_us, period_us * (periods - 1));
+
+    queued_us = pa_bytes_to_usec(queued, &pa_sdata->sink->sample_spec);
+    if (queued_us > watermark_us)
+        sleep_us = queued_us - watermark_us;
+
+#ifdef SINK_DEBUG
+    pa_log_debug("%s: queued %" PRIu64 "us, sleeping %" PRIu64 "us", __func__, queued_us, sleep_us);
+#endif
+
+    pal_sdata->wakeup_deadline = pa_rtclock_now() + sleep_us;
+    pa_rtpoll_set_timer_relative(pa_sdata->rtpoll, sleep_us);
+}
+
 static void pa_pal_sink_thread_func(void *userdata) {
     pa_pal_sink_data *sdata;
     pa_sink_data *pa_sdata;
@@ -1039,8 +1809,18 @@ static void pa_pal_sink_thread_func(void *userdata) {
     while (true) {
         pa_rtpoll_set_timer_disabled(pa_sdata->rtpoll);
 
+        if (pal_sdata->wakeup_deadline) {
+            pa_usec_t now = pa_rtclock_now();
+
+            /* woken up early by a message otherwise */
+            if (now >= pal_sdata->wakeup_deadline)
+                pa_pal_stats_wakeup(pal_sdata->stats, now - pal_sdata->wakeup_deadline,
+                                    pa_bytes_to_usec(pal_sdata->buffer_size, &pa_sdata->sink->sample_spec));
+            pal_sdata->wakeup_deadline = 0;
+        }
+
         if (pa_sdata->sink->thread_info.rewind_requested)
-            pa_sink_process_rewind(pa_sdata->sink, 0);
+            pa_pal_sink_process_rewind(sdata);
 
         /* A compressed sink only renders in RUNNING, not in IDLE */
         render = (!pal_sdata->compressed && !pal_sdata->dynamic_usecase &&
@@ -1048,25 +1828,39 @@ static void pa_pal_sink_thread_func(void *userdata) {
                    PA_SINK_IS_RUNNING(pa_sdata->sink->thread_info.state);
 
         if (render && !pa_atomic_load(&pal_sdata->restart_in_progress)) {
-            if (!pal_sdata->compressed) {
-                pa_sink_render_full(pa_sdata->sink, pal_sdata->buffer_size, &chunk);
+            if (pal_sdata->mmap) {
+                pa_pal_sink_mmap_render(sdata);
+            } else if (!pal_sdata->compressed && pal_sdata->tsched) {
+                pa_pal_sink_tsched_render(sdata);
+            } else if (!pal_sdata->compressed) {
+                pa_pal_sink_render_period(sdata, &chunk);
                 pa_assert(chunk.length == pal_sdata->buffer_size);
-                write_chunk(sdata, &chunk);
+                write_chunk(sdata, &chunk, pa_atomic_load(&pal_sdata->session_id));
                 pa_rtpoll_set_timer_absolute(pa_sdata->rtpoll, pa_rtclock_now());
-            } else if (pa_atomic_load(&pal_sdata->write_done)) {
-                pa_sink_render(pa_sdata->sink, pal_sdata->buffer_size, &chunk);
-                pa_assert(chunk.length > 0);
-                pa_atomic_store(&pal_sdata->write_done, 0);
-                pa_asyncmsgq_post(pal_sdata->pal_thread_mq.inq, PA_MSGOBJECT(pal_sdata->pal_msg),
-                        PAL_SINK_MESSAGE_WRITE_READY, NULL, 0, &chunk, NULL);
+            } else {
+                /* refill the offload queue, the write thread tells us when there is room again */
+                while (pa_pal_chunk_queue_length(pal_sdata->offload_queue) < pal_sdata->offload_queue->depth) {
+                    pa_sink_render(pa_sdata->sink, pal_sdata->buffer_size, &chunk);
+                    pa_assert(chunk.length > 0);
+                    pa_assert_se(pa_pal_chunk_queue_push(pal_sdata->offload_queue, &chunk,
+                                                          pa_atomic_load(&pal_sdata->session_id)));
+                    pa_fdsem_post(pal_sdata->pal_fdsem);
+                }
             }
         } else if (pa_sdata->sink->thread_info.state == PA_SINK_SUSPENDED) {
+
             /* if sink is suspended state then reset buffer otherwise
              * it might end up sending incorrect buffer to pal_write */
             pa_log_debug("%d sink in suspended state. sending empty buffer \n", __LINE__);
             memset(&out_buf, 0, sizeof(struct pal_buffer));
         }
 
+        /* the gap until rendering resumes is no underrun */
+        if (!render)
+            pa_pal_stats_session_reset(pal_sdata->stats);
+
+        pa_pal_sink_standby_timeout(sdata);
+
         rc = pa_rtpoll_run(pa_sdata->rtpoll);
 
         if (rc < 0) {
@@ -1135,15 +1929,40 @@ static int32_t pa_pal_out_cb(pal_stream_handle_t *stream_handle,
     return 0;
 }
 
+/* payload for param_id built from the current session data, free() it */
+static pal_param_payload* pa_pal_sink_new_param_payload(pal_sink_data *pal_sdata, uint32_t param_id) {
+    pal_param_payload *param_payload;
+    void *payload;
+    size_t payload_size;
+
+    switch (param_id) {
+        case PAL_PARAM_ID_GAPLESS_MDATA:
+            payload = &pal_sdata->gapless_mdata;
+            payload_size = sizeof(pal_sdata->gapless_mdata);
+            break;
+        case PAL_PARAM_ID_CODEC_CONFIGURATION:
+        default:
+            payload = pal_sdata->pal_snd_dec;
+            payload_size = sizeof(pal_snd_dec_t);
+            break;
+    }
+
+    param_payload = (pal_param_payload *) calloc (1, sizeof(pal_param_payload) + payload_size);
+    if (!param_payload)
+        return NULL;
+    param_payload->payload_size = payload_size;
+    memcpy(param_payload->payload, payload, param_payload->payload_size);
+
+    return param_payload;
+}
+
 static int pa_pal_set_param(pal_sink_data *pal_sdata, uint32_t param_id) {
     int rc = -1;
     pal_param_payload *param_payload;
 
-    param_payload = (pal_param_payload *) calloc (1, sizeof(pal_param_payload) + sizeof(pal_snd_dec_t));
-    if (!param_payload)
+    if (!(param_payload = pa_pal_sink_new_param_payload(pal_sdata, param_id)))
         return rc;
-    param_payload->payload_size = sizeof(pal_snd_dec_t);
-    memcpy(param_payload->payload, pal_sdata->pal_snd_dec, param_payload->payload_size);
+
     rc = pal_stream_set_param(pal_sdata->stream_handle,
                                param_id, param_payload);
     free(param_payload);
@@ -1209,16 +2028,14 @@ static int open_pal_sink(pa_pal_sink_data *sdata) {
     int rc = 0;
     pal_buffer_config_t out_buf_cfg, in_buf_cfg;
     pal_sink_data *pal_sdata;
+    struct pal_device devices[PA_PAL_CARD_MAX_PORT_DEVICES];
+    uint32_t n_devices;
 
     pa_assert(sdata);
     pa_assert(sdata->pal_sdata);
 
     pal_sdata = sdata->pal_sdata;
 
-#ifdef SINK_DUMP_ENABLED
-    char *file_name;
-#endif
-
     pa_assert(pal_sdata);
 
     pa_log_debug("opening sink with configuration type = 0x%x, format %d, sample_rate %d, channels: %d",
@@ -1226,7 +2043,13 @@ static int open_pal_sink(pa_pal_sink_data *sdata) {
                  pal_sdata->stream_attributes->out_media_config.sample_rate,
                  pal_sdata->stream_attributes->out_media_config.ch_info.channels);
 
-    rc = pal_stream_open(pal_sdata->stream_attributes, 1, pal_sdata->pal_device, 0, NULL, pa_pal_out_cb, (uint64_t)sdata,
+    /* the main thread may switch ports meanwhile, open on a snapshot */
+    pa_mutex_lock(pal_sdata->device_mutex);
+    n_devices = pal_sdata->n_pal_devices;
+    memcpy(devices, pal_sdata->pal_device, n_devices * sizeof(struct pal_device));
+    pa_mutex_unlock(pal_sdata->device_mutex);
+
+    rc = pal_stream_open(pal_sdata->stream_attributes, n_devices, devices, 0, NULL, pa_pal_out_cb, (uint64_t)sdata,
                              &pal_sdata->stream_handle);
 
     if (rc) {
@@ -1248,18 +2071,29 @@ static int open_pal_sink(pa_pal_sink_data *sdata) {
         goto exit;
     }
 
-    sdata->pal_sink_opened = true;
-    pa_atomic_store(&pal_sdata->close_output, 0);
-
-#ifdef SINK_DUMP_ENABLED
-    file_name = pa_sprintf_malloc("/data/pcmdump_sink_%d", pal_sdata->index);
+    if (pal_sdata->mmap) {
+        memset(&pal_sdata->mmap_buffer, 0, sizeof(pal_sdata->mmap_buffer));
+        rc = pal_stream_create_mmap_buffer(pal_sdata->stream_handle,
+                pal_sdata->buffer_size / pa_frame_size(&sdata->pa_sdata->sink->sample_spec), &pal_sdata->mmap_buffer);
+        if (rc || !pal_sdata->mmap_buffer.buffer || !pal_sdata->mmap_buffer.buffer_size_frames) {
+            pa_log_error("pal_stream_create_mmap_buffer failed, error %d", rc);
+            rc = rc ? rc : -1;
+            pal_stream_close(pal_sdata->stream_handle);
+            pal_sdata->stream_handle = NULL;
+            goto exit;
+        }
 
-    pal_sdata->write_fd = open(file_name, O_RDWR | O_TRUNC | O_CREAT, S_IRWXU);
-    if(pal_sdata->write_fd < 0)
-        pa_log_error("Could not open write fd %d for sink index %d", pal_sdata->write_fd, pal_sdata->index);
+        pal_sdata->mmap_frames_written = 0;
+        pal_sdata->mmap_hw_frames = 0;
+        pal_sdata->mmap_last_position = 0;
+        pa_log_debug("mmap buffer %p, %u frames, burst %u frames", pal_sdata->mmap_buffer.buffer,
+                     pal_sdata->mmap_buffer.buffer_size_frames, pal_sdata->mmap_buffer.burst_size_frames);
+    }
 
-    pa_xfree(file_name);
-#endif
+    sdata->pal_sink_opened = true;
+    pa_atomic_inc(&pal_sdata->session_id);
+    pa_atomic_store(&pal_sdata->close_output, 0);
+    pa_pal_latency_smoother_reset(pal_sdata->smoother);
 
 exit:
     return rc;
@@ -1277,14 +2111,20 @@ static int close_pal_sink(pa_pal_sink_data *sdata) {
     pal_sdata = sdata->pal_sdata;
     pa_sdata = sdata->pa_sdata;
 
-    pa_assert(pal_sdata->stream_handle);
     pa_atomic_store(&sdata->pal_sdata->close_output, 1);
+    /* release a write thread waiting for WRITE_READY */
+    if (pal_sdata->pal_fdsem)
+        pa_fdsem_post(pal_sdata->pal_fdsem);
     pa_mutex_lock(pal_sdata->mutex);
 
     pa_log_debug("closing pal sink %p", pal_sdata->stream_handle);
 
+    pal_sdata->standby_close_time = 0;
+
     if (PA_UNLIKELY(pal_sdata->stream_handle == NULL)) {
-        pa_log_error("Invalid sink handle %p", pal_sdata->stream_handle);
+        /* main and IO thread may race to close a keep-warm session */
+        pa_log_debug("pal sink already closed");
+        rc = 0;
     } else {
         rc = pal_stream_stop(pal_sdata->stream_handle);
 
@@ -1297,6 +2137,8 @@ static int close_pal_sink(pa_pal_sink_data *sdata) {
 
         pal_sdata->stream_handle = NULL;
         pal_sdata->bytes_written = 0;
+        pa_pal_latency_smoother_reset(pal_sdata->smoother);
+        pa_pal_stats_session_reset(pal_sdata->stats);
         pal_sdata->standby = true;
 #ifndef PAL_DISABLE_COMPRESS_AUDIO_SUPPORT
         pa_sdata->sink->sess_time = 0;
@@ -1305,9 +2147,8 @@ static int close_pal_sink(pa_pal_sink_data *sdata) {
     }
 
     pa_mutex_unlock(pal_sdata->mutex);
-#ifdef SINK_DUMP_ENABLED
-    close(pal_sdata->write_fd);
-#endif
+
+    pa_pal_sink_prewarm_request(sdata);
 
     return rc;
 }
@@ -1321,8 +2162,15 @@ static int restart_pal_sink(pa_sink *s, pa_encoding_t encoding, pa_sample_spec *
     pa_assert(sdata->pal_sdata);
     pa_assert(sdata->pa_sdata);
 
+    /* the prewarm worker skips the sink from now on, wait out an open it
+     * already started before the session config is rewritten */
     pa_atomic_store(&sdata->pal_sdata->restart_in_progress, 1);
-    if (sdata->pal_sink_opened && PA_SINK_IS_OPENED(s->thread_info.state)) {
+    pa_pal_sink_prewarm_wait(sdata);
+
+    sdata->pal_sdata->buffer_size = buffer_size;
+    sdata->pal_sdata->buffer_count = buffer_count;
+
+    if (sdata->pal_sink_opened) {
         rc = close_pal_sink(sdata);
         if (rc) {
             pa_log_error("close_pal_sink failed, error %d", rc);
@@ -1336,43 +2184,45 @@ static int restart_pal_sink(pa_sink *s, pa_encoding_t encoding, pa_sample_spec *
         return -1;
     }
 
-    if (!sdata->pal_sdata->compressed && (sdata->pa_sdata->avoid_config_processing & PA_PAL_CARD_AVOID_PROCESSING_FOR_BIT_WIDTH)) {
-
-        sdata->pal_sdata->stream_attributes->out_media_config.bit_width = pa_sample_size_of_format(ss->format) * PA_BITS_PER_BYTE;
-        switch (sdata->pal_sdata->stream_attributes->out_media_config.bit_width) {
-            case 32:
-                if (ss->format == PA_SAMPLE_S24_32LE) {
-                    /**<24bit in 32bit word (LSB aligned) little endian PCM*/
-                    sdata->pal_sdata->stream_attributes->out_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S24_LE;
-                }
-                else
-                    sdata->pal_sdata->stream_attributes->out_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S32_LE;
-                break;
-            case 24:
-                sdata->pal_sdata->stream_attributes->out_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S24_3LE;
-                break;
-            default:
-                sdata->pal_sdata->stream_attributes->out_media_config.aud_fmt_id = PAL_AUDIO_FMT_DEFAULT_PCM;
-                break;
-        }
-    } else {
+    /* pcm goes to PAL in the sample format of the sink, whether it was
+     * picked by avoid-processing or is the configured default */
+    if (encoding == PA_ENCODING_PCM)
+        sdata->pal_sdata->stream_attributes->out_media_config.aud_fmt_id =
+            pa_pal_util_get_pal_pcm_format(ss->format, &sdata->pal_sdata->stream_attributes->out_media_config.bit_width);
+    else
         sdata->pal_sdata->stream_attributes->out_media_config.aud_fmt_id = pal_format;
-    }
 
     sdata->pal_sdata->stream_attributes->out_media_config.sample_rate = ss->rate;
+    pa_mutex_lock(sdata->pal_sdata->device_mutex);
     sdata->pal_sdata->pal_device->config.sample_rate = ss->rate;
+    sdata->pal_sdata->n_pal_devices = pa_pal_util_fill_port_devices(sdata->pal_sdata->pal_device, port_device_data);
+    pa_mutex_unlock(sdata->pal_sdata->device_mutex);
     if (!pa_pal_channel_map_to_pal(map, &sdata->pal_sdata->stream_attributes->out_media_config.ch_info)) {
         pa_log_error("%s: unsupported channel map", __func__);
         return -1;
     }
 
     sdata->pal_sdata->compressed = (pal_format != PAL_AUDIO_FMT_PCM_S16_LE ? true : false);
+    sdata->pal_sdata->convert_float = !sdata->pal_sdata->compressed && ss->format == PA_SAMPLE_FLOAT32LE;
+    sdata->pal_sdata->encoding = encoding;
+    pa_atomic_store(&sdata->pal_sdata->track_drained, 0);
 
     rc = open_pal_sink(sdata);
     if (rc) {
         pa_log_error("open_pal_sink failed during recreation, error %d", rc);
     }
 
+    /* a wav file has a single spec, start a new one on change, none while compressed */
+    if (sdata->pal_sdata->pcm_tap_prefix) {
+        if (sdata->pal_sdata->compressed) {
+            if (sdata->pal_sdata->pcm_tap)
+                pa_pal_sink_attach_pcm_tap(sdata, ss, NULL);
+        } else if (!sdata->pal_sdata->pcm_tap ||
+                   !pa_sample_spec_equal(ss, pa_pal_pcm_tap_get_sample_spec(sdata->pal_sdata->pcm_tap))) {
+            pa_pal_sink_attach_pcm_tap(sdata, ss, sdata->pal_sdata->pcm_tap_prefix);
+        }
+    }
+
 exit:
     return rc;
 }
@@ -1383,24 +2233,22 @@ static void free_pal_sink_thread_resources(pal_sink_data *pal_sdata){
     pa_log_debug("%s Freeing pal sink thread resources", __func__);
 
     if (pal_sdata->pal_thread) {
-        pa_asyncmsgq_send(pal_sdata->pal_thread_mq.inq, NULL, PA_MESSAGE_SHUTDOWN, NULL, 0, NULL);
+        pa_atomic_store(&pal_sdata->pal_thread_exit, 1);
+        pa_atomic_store(&pal_sdata->close_output, 1);
+        pa_fdsem_post(pal_sdata->pal_fdsem);
         pa_thread_free(pal_sdata->pal_thread);
         pal_sdata->pal_thread = NULL;
     }
 
-    if (pal_sdata->pal_rtpoll_item)
-        pa_rtpoll_item_free(pal_sdata->pal_rtpoll_item);
-
-    if (pal_sdata->pal_thread_rtpoll)
-        pa_rtpoll_free(pal_sdata->pal_thread_rtpoll);
-
-    if (pal_sdata->pal_fdsem)
+    if (pal_sdata->pal_fdsem) {
         pa_fdsem_free(pal_sdata->pal_fdsem);
+        pal_sdata->pal_fdsem = NULL;
+    }
 
-    pa_thread_mq_done(&pal_sdata->pal_thread_mq);
-
-    if (pal_sdata->pal_msg)
-        pa_xfree(pal_sdata->pal_msg);
+    if (pal_sdata->offload_queue) {
+        pa_pal_chunk_queue_free(pal_sdata->offload_queue);
+        pal_sdata->offload_queue = NULL;
+    }
 }
 
 static int free_pal_sink(pa_pal_sink_data *sdata) {
@@ -1409,7 +2257,7 @@ static int free_pal_sink(pa_pal_sink_data *sdata) {
     pa_assert(sdata);
     pa_assert(sdata->pal_sdata);
 
-    if (!sdata->pal_sdata->standby) {
+    if (sdata->pal_sink_opened) {
         rc = close_pal_sink(sdata);
         if (rc) {
             pa_log_error("close_pal_sink failed, error %d", rc);
@@ -1420,7 +2268,18 @@ static int free_pal_sink(pa_pal_sink_data *sdata) {
         free_pal_sink_thread_resources(sdata->pal_sdata);
     }
     pa_mutex_free(sdata->pal_sdata->mutex);
-    pa_cond_free(sdata->pal_sdata->cond_ctrl_thread);
+    pa_mutex_free(sdata->pal_sdata->device_mutex);
+    if (sdata->pal_sdata->staging)
+        pa_memblockq_free(sdata->pal_sdata->staging);
+    if (sdata->pal_sdata->smoother)
+        pa_pal_latency_smoother_free(sdata->pal_sdata->smoother);
+    if (sdata->pal_sdata->stats)
+        pa_pal_stats_free(sdata->pal_sdata->stats);
+    if (sdata->pal_sdata->pcm_tap)
+        pa_pal_pcm_tap_free(sdata->pal_sdata->pcm_tap);
+    pa_xfree(sdata->pal_sdata->pcm_tap_prefix);
+    pa_xfree(sdata->pal_sdata->convert_buf);
+    pa_xfree(sdata->pal_sdata->hw_volume);
     pa_xfree(sdata->pal_sdata->stream_attributes);
     pa_xfree(sdata->pal_sdata->pal_snd_dec);
     pa_xfree(sdata->pal_sdata->pal_device);
@@ -1435,6 +2294,8 @@ static int create_pal_sink(pa_pal_sink_config *sink, pa_pal_card_port_device_dat
 
     sdata->pal_sdata = pa_xnew0(pal_sink_data, 1);
     sdata->pal_sdata->mutex = pa_mutex_new(false /* recursive  */, false /* inherit_priority */);
+    sdata->pal_sdata->device_mutex = pa_mutex_new(false /* recursive  */, false /* inherit_priority */);
+    sdata->pal_sdata->hw_volume = pa_xmalloc0(PA_PAL_VOLUME_DATA_SIZE(PA_CHANNELS_MAX));
 
     rc = pa_pal_sink_fill_info(sink, sdata->pal_sdata, port_device_data, PAL_AUDIO_FMT_DEFAULT_PCM);
     if (rc) {
@@ -1456,6 +2317,170 @@ static int pa_pal_sink_free_common_resources(pa_pal_sink_data *sdata) {
     return 0;
 }
 
+/* Called from main context, publishes pal.stats.* whenever they changed */
+static void pa_pal_sink_stats_publish_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *t, void *userdata) {
+    pa_pal_sink_data *sdata = (pa_pal_sink_data *)userdata;
+    pa_pal_stats *stats = sdata->pal_sdata->stats;
+    pa_sink *s = sdata->pa_sdata->sink;
+    pa_proplist *p;
+    int generation;
+
+    generation = pa_atomic_load(&stats->io_count) + pa_atomic_load(&stats->xruns) +
+                 pa_atomic_load(&stats->io_errors) + pa_atomic_load(&stats->late_wakeups);
+
+    if (generation != sdata->pa_sdata->stats_generation && PA_SINK_IS_LINKED(s->state)) {
+        sdata->pa_sdata->stats_generation = generation;
+
+        p = pa_proplist_new();
+        pa_pal_stats_to_proplist(stats, p);
+        pa_sink_update_proplist(s, PA_UPDATE_REPLACE, p);
+        pa_proplist_free(p);
+    }
+
+    pa_core_rttime_restart(s->core, e, pa_rtclock_now() + PA_PAL_STATS_PUBLISH_INTERVAL_MS * PA_USEC_PER_MSEC);
+}
+
+char* pa_pal_sink_get_stats(pa_sink *s) {
+    pa_pal_sink_data *sdata;
+
+    pa_assert(s);
+
+    sdata = (pa_pal_sink_data *)s->userdata;
+    if (!sdata || !sdata->pal_sdata || !pa_idxset_get_by_data(mdata->sinks, sdata, NULL))
+        return NULL;
+
+    return pa_pal_stats_to_string(sdata->pal_sdata->stats);
+}
+
+/* Called from main thread context, a NULL prefix detaches the tap */
+static void pa_pal_sink_attach_pcm_tap(pa_pal_sink_data *sdata, const pa_sample_spec *ss, const char *prefix) {
+    pa_pal_pcm_tap *tap = NULL;
+
+    if (prefix)
+        tap = pa_pal_pcm_tap_new(prefix, ss, PA_PAL_PCM_TAP_MAX_FILE_SIZE);
+
+    /* the IO thread drops its reference before the old tap is freed */
+    pa_assert_se(pa_asyncmsgq_send(sdata->pa_sdata->sink->asyncmsgq, PA_MSGOBJECT(sdata->pa_sdata->sink),
+                                   PA_PAL_SINK_MESSAGE_SET_PCM_TAP, &tap, 0, NULL) == 0);
+    if (tap)
+        pa_pal_pcm_tap_free(tap);
+}
+
+int pa_pal_sink_set_pcm_tap(pa_sink *s, const char *prefix) {
+    pa_pal_sink_data *sdata;
+    pal_sink_data *pal_sdata;
+
+    pa_assert(s);
+
+    sdata = (pa_pal_sink_data *)s->userdata;
+    if (!sdata || !sdata->pal_sdata || !pa_idxset_get_by_data(mdata->sinks, sdata, NULL))
+        return -1;
+
+    pal_sdata = sdata->pal_sdata;
+    if (prefix && pal_sdata->compressed) {
+        pa_log_error("%s: no pcm tap on compressed sink %s", __func__, s->name);
+        return -1;
+    }
+
+    pa_xfree(pal_sdata->pcm_tap_prefix);
+    pal_sdata->pcm_tap_prefix = pa_xstrdup(prefix);
+
+    pa_pal_sink_attach_pcm_tap(sdata, &s->sample_spec, prefix);
+
+    if (prefix && !pal_sdata->pcm_tap) {
+        pa_xfree(pal_sdata->pcm_tap_prefix);
+        pal_sdata->pcm_tap_prefix = NULL;
+        return -1;
+    }
+
+    pa_log_info("%s: pcm tap %s%s", s->name, prefix ? "writing to " : "stopped", prefix ? prefix : "");
+
+    return 0;
+}
+
+/* Called from prewarm thread context */
+static void pa_pal_sink_prewarm_open(pa_pal_sink_data *sdata) {
+    pal_sink_data *pal_sdata = sdata->pal_sdata;
+    pa_usec_t start;
+    int rc = 0;
+
+    pa_mutex_lock(pal_sdata->mutex);
+
+    /* a restart reopens the session itself */
+    if (pal_sdata->prewarm && !pal_sdata->dynamic_usecase && !sdata->pal_sink_opened && pal_sdata->standby &&
+            !pa_atomic_load(&pal_sdata->restart_in_progress)) {
+        start = pa_rtclock_now();
+        rc = open_pal_sink(sdata);
+        pa_log_info("%s: prewarm open %s in %" PRIu64 "us", sdata->pa_sdata->sink->name,
+                    rc ? "failed" : "done", pa_rtclock_now() - start);
+    }
+
+    pa_mutex_unlock(pal_sdata->mutex);
+}
+
+static void pa_pal_sink_prewarm_thread_func(void *userdata) {
+    pa_pal_sink_data *sdata;
+
+    pa_log_debug("Prewarm thread starting up");
+
+    pa_mutex_lock(mdata->prewarm_mutex);
+
+    while (true) {
+        while (!mdata->prewarm_exit && pa_idxset_isempty(mdata->prewarm_pending))
+            pa_cond_wait(mdata->prewarm_cond, mdata->prewarm_mutex);
+
+        if (mdata->prewarm_exit)
+            break;
+
+        sdata = pa_idxset_steal_first(mdata->prewarm_pending, NULL);
+        mdata->prewarm_current = sdata;
+        pa_mutex_unlock(mdata->prewarm_mutex);
+
+        pa_pal_sink_prewarm_open(sdata);
+
+        pa_mutex_lock(mdata->prewarm_mutex);
+        mdata->prewarm_current = NULL;
+        pa_cond_signal(mdata->prewarm_cond, 1);
+    }
+
+    pa_mutex_unlock(mdata->prewarm_mutex);
+
+    pa_log_debug("Prewarm thread shutting down");
+}
+
+/* Queue the sink for a background open, called at creation and after every close */
+static void pa_pal_sink_prewarm_request(pa_pal_sink_data *sdata) {
+    if (!sdata->pal_sdata->prewarm || !mdata->prewarm_thread)
+        return;
+
+    pa_mutex_lock(mdata->prewarm_mutex);
+    pa_idxset_put(mdata->prewarm_pending, sdata, NULL);
+    pa_cond_signal(mdata->prewarm_cond, 1);
+    pa_mutex_unlock(mdata->prewarm_mutex);
+}
+
+/* Called from main context. Drops a queued prewarm of the sink and waits
+ * for one in progress, prewarm stays enabled */
+static void pa_pal_sink_prewarm_wait(pa_pal_sink_data *sdata) {
+    if (!mdata->prewarm_thread)
+        return;
+
+    pa_mutex_lock(mdata->prewarm_mutex);
+    pa_idxset_remove_by_data(mdata->prewarm_pending, sdata, NULL);
+    while (mdata->prewarm_current == sdata)
+        pa_cond_wait(mdata->prewarm_cond, mdata->prewarm_mutex);
+    pa_mutex_unlock(mdata->prewarm_mutex);
+}
+
+/* Called from main context before the sink is torn down */
+static void pa_pal_sink_prewarm_cancel(pa_pal_sink_data *sdata) {
+    if (!sdata->pal_sdata->prewarm)
+        return;
+
+    sdata->pal_sdata->prewarm = false;
+    pa_pal_sink_prewarm_wait(sdata);
+}
+
 static int pa_pal_sink_alloc_common_resources(pa_pal_sink_data *sdata) {
     pa_assert(sdata);
 
@@ -1531,7 +2556,8 @@ static int create_pa_sink(pa_module *m, char *sink_name, char *description, pa_i
     pa_proplist_sets(new_data.proplist, PA_PROP_DEVICE_STRING, pa_pal_sink_get_name_from_type(sdata->pal_sdata->stream_attributes->type));
     pa_proplist_sets(new_data.proplist, PA_PROP_DEVICE_DESCRIPTION, description);
 
-    pa_sdata->sink = pa_sink_new(m->core, &new_data, PA_SINK_HARDWARE | PA_SINK_LATENCY );
+    pa_sdata->sink = pa_sink_new(m->core, &new_data, PA_SINK_HARDWARE | PA_SINK_LATENCY |
+                                 (sdata->pal_sdata->dynamic_latency ? PA_SINK_DYNAMIC_LATENCY : 0));
     pa_sink_new_data_done(&new_data);
 
     if (!pa_sdata->sink) {
@@ -1582,12 +2608,21 @@ static int create_pa_sink(pa_module *m, char *sink_name, char *description, pa_i
     pa_sink_set_asyncmsgq(pa_sdata->sink, pa_sdata->thread_mq.inq);
     pa_sink_set_rtpoll(pa_sdata->sink, pa_sdata->rtpoll);
     pa_sink_set_max_request(pa_sdata->sink, sdata->pal_sdata->buffer_size);
-    pa_sink_set_max_rewind(pa_sdata->sink, 0);
-    pa_sink_set_fixed_latency(pa_sdata->sink, sdata->pal_sdata->sink_latency_us);
+    pa_sink_set_max_rewind(pa_sdata->sink, pa_pal_sink_get_max_rewind(sdata->pal_sdata));
+
+    if (sdata->pal_sdata->dynamic_latency) {
+        pa_sdata->sink->update_requested_latency = pa_pal_sink_update_requested_latency_cb;
+        pa_sink_set_latency_range(pa_sdata->sink, sdata->pal_sdata->min_latency_us, sdata->pal_sdata->max_latency_us);
+    } else {
+        pa_sink_set_fixed_latency(pa_sdata->sink, sdata->pal_sdata->sink_latency_us);
+    }
 
     if (use_hw_volume) {
         pa_sdata->sink->n_volume_steps = PA_VOLUME_NORM+1; /* FIXME: What should be value */
         pa_sink_set_set_volume_callback(pa_sdata->sink, pa_pal_sink_set_volume_cb);
+        pa_sink_set_set_mute_callback(pa_sdata->sink, pa_pal_sink_set_mute_cb);
+        /* PAL gain is linear per channel, so the dB scale is exact */
+        pa_sink_enable_decibel_volume(pa_sdata->sink, true);
     }
 
     pa_sdata->thread = pa_thread_new(sink_name, pa_pal_sink_thread_func, sdata);
@@ -1616,6 +2651,9 @@ static int free_pa_sink(pa_pal_sink_data *sdata) {
 
     pa_log_debug("closing pa sink %p", sdata->pa_sdata->sink);
 
+    if (pa_sdata->stats_event)
+        pa_sdata->sink->core->mainloop->time_free(pa_sdata->stats_event);
+
     if (pa_sdata->sink) {
         if (PA_SINK_IS_OPENED(pa_sdata->sink->thread_info.state))
             pa_sink_suspend(pa_sdata->sink, PA_SINK_SUSPENDED, PA_SUSPEND_USER);
@@ -1660,6 +2698,50 @@ bool pa_pal_sink_is_supported_sample_rate(uint32_t sample_rate) {
     return supported;
 }
 
+#ifndef PAL_DISABLE_COMPRESS_AUDIO_SUPPORT
+/* PAL has no decoder capability query, so every compressed encoding of an
+ * offload sink gets a session opened and closed once. Encodings the DSP
+ * can't take are dropped before the sink advertises them. */
+static void pa_pal_sink_probe_offload_formats(pal_sink_data *pal_sdata, pa_idxset *formats) {
+    struct pal_stream_attributes attributes;
+    pal_stream_handle_t *handle;
+    pal_snd_dec_t snd_dec;
+    pal_audio_fmt_t pal_format;
+    pa_idxset *probed;
+    pa_format_info *f;
+    int rc;
+
+    probed = pa_idxset_new(NULL, NULL);
+
+    while ((f = pa_idxset_steal_first(formats, NULL))) {
+        rc = 0;
+
+        /* aac only knows its pal format once a stream set it, keep it */
+        if (pa_format_info_is_compressed(f) &&
+                (pal_format = pa_pal_util_get_pal_format_from_pa_encoding(f->encoding, &snd_dec))) {
+            attributes = *pal_sdata->stream_attributes;
+            attributes.out_media_config.aud_fmt_id = pal_format;
+
+            handle = NULL;
+            if (!(rc = pal_stream_open(&attributes, pal_sdata->n_pal_devices, pal_sdata->pal_device, 0, NULL, NULL, 0, &handle)))
+                pal_stream_close(handle);
+        }
+
+        if (rc) {
+            pa_log_warn("%s: dsp can't offload %s, error %d", __func__, pa_encoding_to_string(f->encoding), rc);
+            pa_format_info_free(f);
+        } else {
+            pa_idxset_put(probed, f, NULL);
+        }
+    }
+
+    while ((f = pa_idxset_steal_first(probed, NULL)))
+        pa_idxset_put(formats, f, NULL);
+
+    pa_idxset_free(probed, NULL);
+}
+#endif
+
 int pa_pal_sink_create(pa_module *m, pa_card *card, const char *driver, const char *module_name, pa_pal_sink_config *sink, pa_pal_sink_handle_t **handle) {
     int rc = -1;
     pa_pal_sink_data *sdata;
@@ -1721,6 +2803,11 @@ int pa_pal_sink_create(pa_module *m, pa_card *card, const char *driver, const ch
         goto exit;
     }
 
+#ifndef PAL_DISABLE_COMPRESS_AUDIO_SUPPORT
+    if (sdata->pal_sdata->stream_attributes->type == PAL_STREAM_COMPRESSED)
+        pa_pal_sink_probe_offload_formats(sdata->pal_sdata, sink->formats);
+#endif
+
     rc = create_pa_sink(m, sink->name, sink->description, sink->formats, &sink->default_spec, &sink->default_map, sink->use_hw_volume, sink->alternate_sample_rate, card, sink->avoid_config_processing, ports, driver, sdata);
     pa_hashmap_free(ports);
     if (PA_UNLIKELY(rc)) {
@@ -1735,6 +2822,19 @@ int pa_pal_sink_create(pa_module *m, pa_card *card, const char *driver, const ch
     *handle = (pa_pal_sink_handle_t *)sdata;
     pa_idxset_put(mdata->sinks, sdata, NULL);
 
+    sdata->pa_sdata->stats_event = pa_core_rttime_new(m->core,
+            pa_rtclock_now() + PA_PAL_STATS_PUBLISH_INTERVAL_MS * PA_USEC_PER_MSEC, pa_pal_sink_stats_publish_cb, sdata);
+
+    if (sdata->pal_sdata->prewarm) {
+        if (!mdata->prewarm_thread &&
+                !(mdata->prewarm_thread = pa_thread_new("pal-sink-prewarm", pa_pal_sink_prewarm_thread_func, NULL))) {
+            pa_log_error("%s: could not create prewarm thread, disabling prewarm", sink->name);
+            sdata->pal_sdata->prewarm = false;
+        }
+
+        pa_pal_sink_prewarm_request(sdata);
+    }
+
 exit:
     return rc;
 }
@@ -1744,6 +2844,7 @@ void pa_pal_sink_close(pa_pal_sink_handle_t *handle) {
 
     pa_assert(sdata);
 
+    pa_pal_sink_prewarm_cancel(sdata);
     free_pa_sink(sdata);
     free_pal_sink(sdata);
     pa_pal_sink_free_common_resources(sdata);
@@ -1757,6 +2858,19 @@ void pa_pal_sink_module_deinit() {
 
     pa_assert(mdata);
 
+    if (mdata->prewarm_thread) {
+        pa_mutex_lock(mdata->prewarm_mutex);
+        mdata->prewarm_exit = true;
+        pa_cond_signal(mdata->prewarm_cond, 1);
+        pa_mutex_unlock(mdata->prewarm_mutex);
+
+        pa_thread_free(mdata->prewarm_thread);
+    }
+
+    pa_idxset_free(mdata->prewarm_pending, NULL);
+    pa_cond_free(mdata->prewarm_cond);
+    pa_mutex_free(mdata->prewarm_mutex);
+
     pa_idxset_free(mdata->sinks, NULL);
 
     pa_xfree(mdata);
@@ -1768,4 +2882,8 @@ void pa_pal_sink_module_init() {
     mdata = pa_xnew0(pa_pal_sink_module_data, sizeof(pa_pal_sink_module_data));
 
     mdata->sinks = pa_idxset_new(NULL, NULL);
+
+    mdata->prewarm_mutex = pa_mutex_new(false /* recursive  */, false /* inherit_priority */);
+    mdata->prewarm_cond = pa_cond_new();
+    mdata->prewarm_pending = pa_idxset_new(NULL, NULL);
 }
@@ -24,10 +24,14 @@
 #include <pulsecore/memchunk.h>
 #include <pulsecore/core-format.h>
 #include <pulsecore/core-util.h>
+#include <pulsecore/fdsem.h>
+#include <pulsecore/sample-util.h>
 #include <pulse/util.h>
 
 #include "pal-source.h"
 #include "pal-utils.h"
+#include "pal-pcm-tap.h"
+#include "pal-stats.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -40,16 +44,18 @@
 #define PA_DEFAULT_SOURCE_FORMAT PA_SAMPLE_S16LE
 #define PA_DEFAULT_SOURCE_RATE 48000
 #define PA_DEFAULT_SOURCE_CHANNELS 2
-#define PA_NUM_DEVICES 1
 #define PA_BITS_PER_BYTE 8
 #define PA_DEFAULT_BUFFER_DURATION_MS 25
 #define PA_LOW_LATENCY_DURATION_MS 5
 #define PA_DEEP_BUFFER_DURATION_MS 20
+#define PA_TIMESTAMP_FETCH_INTERVAL_MS 20
+#define PA_SOURCE_RING_EXTRA_BLOCKS 4
 
 static int restart_pal_source(pa_pal_source_data *sdata, pa_encoding_t encoding, pa_sample_spec *ss, pa_channel_map *map);
 static int create_pal_source(pa_pal_source_config *source, pa_pal_card_port_device_data *port_device_data, pa_pal_source_data *sdata);
 static int close_pal_source(pa_pal_source_data *sdata);
 static int open_pal_source(pa_pal_source_data *sdata);
+static void pa_pal_source_attach_pcm_tap(pa_pal_source_data *sdata, const pa_sample_spec *ss, const char *prefix);
 
 static const uint32_t supported_source_rates[] =
                           {8000, 11025, 16000, 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000, 352800, 384000};
@@ -121,67 +127,57 @@ static const char *pa_pal_source_get_name_from_type(pal_stream_type_t type) {
     return name;
 }
 
+/* Hand a control command to the IO thread, it is applied between two
+ * reads and comes back as PA_PAL_SOURCE_MESSAGE_CTRL_DONE. Never blocks. */
+static void pa_pal_source_post_ctrl(pa_pal_source_data *sdata, pa_pal_ctrl_cmd *cmd) {
+    pa_asyncmsgq_post(sdata->pa_sdata->thread_mq.inq, PA_MSGOBJECT(sdata->pa_sdata->source),
+                      PA_PAL_SOURCE_MESSAGE_CTRL, cmd, 0, NULL, NULL);
+}
+
+/* Called from main context */
 static void pa_pal_source_set_volume_cb(pa_source *s) {
     pa_pal_source_data *sdata = NULL;
-    float gain;
-    int rc;
-    pa_volume_t volume;
+    pa_pal_ctrl_cmd *cmd;
     pal_source_data *pal_sdata = NULL;
-    struct pal_volume_data *volume_data = NULL;
-    uint32_t i,no_vol_pair;
-    uint32_t channel_mask = 1;
+    pa_cvolume hw_volume;
+    uint32_t i;
 
     pa_assert(s);
     sdata = (pa_pal_source_data *)s->userdata;
 
-    if (!PA_SOURCE_IS_RUNNING(s->state)) {
-        pa_log_error("set volume is supported only when source is in RUNNING state\n");
-        return;
-    }
     pa_assert(sdata);
     pa_assert(sdata->pal_sdata);
-    pa_assert(sdata->pal_sdata->stream_handle);
 
     pal_sdata = sdata->pal_sdata;
-    no_vol_pair = pal_sdata->stream_attributes->in_media_config.ch_info.channels;
-
-    gain = ((float) pa_cvolume_max(&s->real_volume) * (float)PAL_MAX_GAIN) / (float)PA_VOLUME_NORM;
-    volume = (pa_volume_t) roundf((float) gain * PA_VOLUME_NORM / PAL_MAX_GAIN);
 
-    volume_data = (struct pal_volume_data *)malloc(sizeof(uint32_t) +
-                                                 (sizeof(struct pal_channel_vol_kv) * (no_vol_pair)));
-    if (!volume_data) {
-        pa_log_error("malloc failed for size %zu", sizeof(uint32_t) +
-                 (sizeof(struct pal_channel_vol_kv) * (no_vol_pair)));
-        return;
-    }
+    /* PAL gain stops at 0dB, anything above is left to software volume */
+    hw_volume = s->real_volume;
+    for (i = 0; i < hw_volume.channels; i++)
+        hw_volume.values[i] = PA_MIN(hw_volume.values[i], PA_VOLUME_NORM);
 
-    volume_data->no_of_volpair = no_vol_pair;
+    pa_sw_cvolume_divide(&s->soft_volume, &s->real_volume, &hw_volume);
 
-    for (i = 0; i < no_vol_pair; i++) {
-        channel_mask = (channel_mask | pal_sdata->stream_attributes->out_media_config.ch_info.ch_map[i]);
-    }
+    /* also posted in standby, the IO thread applies it once the session starts */
+    cmd = pa_pal_ctrl_cmd_new(PA_PAL_VOLUME_APPLY);
+    pa_pal_util_fill_volume_data(cmd->volume_data, &hw_volume, &pal_sdata->stream_attributes->in_media_config.ch_info);
+    pa_pal_source_post_ctrl(sdata, cmd);
 
-    channel_mask = (channel_mask << 1);
+    return;
+}
 
-    for (i = 0; i < no_vol_pair; i++) {
-        volume_data->volume_pair[i].channel_mask = channel_mask;
-        volume_data->volume_pair[i].vol = gain;
-    }
+/* Called from main context */
+static void pa_pal_source_set_mute_cb(pa_source *s) {
+    pa_pal_source_data *sdata = NULL;
+    pa_pal_ctrl_cmd *cmd;
 
-    pal_sdata->source_event_id = PA_PAL_VOLUME_APPLY;
-    pa_mutex_lock(pal_sdata->mutex);
-    rc = pal_stream_set_volume(pal_sdata->stream_handle, volume_data);
-    pal_sdata->source_event_id = PA_PAL_NO_EVENT;
-    pa_mutex_unlock(pal_sdata->mutex);
-    pa_cond_signal(pal_sdata->cond_ctrl_thread, 0);
-    if (rc)
-        pa_log_error("pal stream : unable to set volume error %d\n", rc);
-    else
-        pa_cvolume_set(&s->real_volume, s->real_volume.channels, volume); /* TODO: Is this correct?  */
+    pa_assert(s);
+    sdata = (pa_pal_source_data *)s->userdata;
+    pa_assert(sdata);
 
-    pa_xfree(volume_data);
-    return;
+    /* also posted in standby, the IO thread applies it once the session starts */
+    cmd = pa_pal_ctrl_cmd_new(PA_PAL_MUTE_APPLY);
+    cmd->mute = s->muted;
+    pa_pal_source_post_ctrl(sdata, cmd);
 }
 
 static int pa_pal_source_fill_info(pa_pal_source_config *source, pal_source_data *pal_sdata, pa_pal_card_port_device_data *port_device_data) {
@@ -199,19 +195,8 @@ static int pa_pal_source_fill_info(pa_pal_source_config *source, pal_source_data
     pal_sdata->stream_attributes->direction = PAL_AUDIO_INPUT;
 
     pal_sdata->stream_attributes->in_media_config.sample_rate = source->default_spec.rate;
-    pal_sdata->stream_attributes->in_media_config.bit_width = pa_sample_size_of_format(source->default_spec.format) * PA_BITS_PER_BYTE;
-
-    switch (pal_sdata->stream_attributes->in_media_config.bit_width) {
-        case 32:
-            pal_sdata->stream_attributes->in_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S32_LE;
-            break;
-        case 24:
-            pal_sdata->stream_attributes->in_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S24_3LE;
-            break;
-        default:
-            pal_sdata->stream_attributes->in_media_config.aud_fmt_id = PAL_AUDIO_FMT_DEFAULT_PCM;
-            break;
-    }
+    pal_sdata->stream_attributes->in_media_config.aud_fmt_id =
+        pa_pal_util_get_pal_pcm_format(source->default_spec.format, &pal_sdata->stream_attributes->in_media_config.bit_width);
 
     if (!pa_pal_channel_map_to_pal(&source->default_map, &pal_sdata->stream_attributes->in_media_config.ch_info)) {
         pa_log_error("%s: unsupported channel map", __func__);
@@ -224,7 +209,7 @@ static int pa_pal_source_fill_info(pa_pal_source_config *source, pal_source_data
     pal_sdata->pal_device->id = port_device_data->device;
     pal_sdata->dynamic_usecase = (source->usecase_type == PA_PAL_CARD_USECASE_TYPE_DYNAMIC) ? true : false;
     pal_sdata->pal_device->config.sample_rate = port_device_data->default_spec.rate;
-    pal_sdata->pal_device->config.bit_width = 16;
+    pal_sdata->pal_device->config.bit_width = port_device_data->bit_width;
 
     if (port_device_data->pal_devicepp_config){
         pa_strlcpy(pal_sdata->pal_device->custom_config.custom_key, port_device_data->pal_devicepp_config,
@@ -242,14 +227,47 @@ static int pa_pal_source_fill_info(pa_pal_source_config *source, pal_source_data
     pal_sdata->index = source->id;
     pal_sdata->buffer_size = (size_t)(source->buffer_size);
     pal_sdata->buffer_count = (size_t)(source->buffer_count);
-    pal_sdata->source_event_id = PA_PAL_NO_EVENT;
-    pal_sdata->cond_ctrl_thread = pa_cond_new();
+    pal_sdata->standby_hysteresis_us = source->standby_hysteresis_ms * PA_USEC_PER_MSEC;
+    pal_sdata->standby_close_time = 0;
+    pal_sdata->non_blocking = source->non_blocking;
+    pal_sdata->dsp_effect = source->dsp_effect;
+    pal_sdata->smoother = pa_pal_latency_smoother_new(PA_TIMESTAMP_FETCH_INTERVAL_MS * PA_USEC_PER_MSEC);
+    pal_sdata->stats = pa_pal_stats_new(true);
 
     pal_sdata->standby = true;
 
     return 0;
 }
 
+/* Called from IO thread context. The DSP session time counts what was
+ * captured, everything beyond what was read is still queued in PAL */
+static uint64_t pa_pal_source_get_latency(pa_pal_source_data *sdata) {
+    pal_source_data *pal_sdata = sdata->pal_sdata;
+    pa_sample_spec *ss = &sdata->pa_sdata->source->sample_spec;
+    uint64_t session_time_us = 0, read_us, latency;
+
+    /* what the capture thread queued, and the period it is reading */
+    if (pal_sdata->consumer)
+        return pal_sdata->standby ? 0 : pa_bytes_to_usec(pa_pal_capture_consumer_get_queued(pal_sdata->consumer), ss) +
+                                        pa_pal_capture_consumer_get_period_usec(pal_sdata->consumer);
+
+    if (!pal_sdata->stream_handle || pal_sdata->standby)
+        return 0;
+
+    read_us = pa_bytes_to_usec(pal_sdata->bytes_read, ss);
+
+    if (!pa_pal_latency_smoother_get(pal_sdata->smoother, pal_sdata->stream_handle, &session_time_us)) {
+        latency = session_time_us > read_us ? session_time_us - read_us : 0;
+        /* a late timestamp must not claim more than PAL can hold */
+        latency = PA_MIN(latency, pa_bytes_to_usec(pal_sdata->buffer_size * PA_MAX(pal_sdata->buffer_count, 1), ss));
+    } else {
+        /* no timestamp, the period being captured is pending at least */
+        latency = pa_bytes_to_usec(pal_sdata->buffer_size, ss);
+    }
+
+    return latency;
+}
+
 static int pa_pal_source_start(pa_pal_source_data *sdata) {
     int rc = 0;
     pa_assert(sdata);
@@ -257,6 +275,17 @@ static int pa_pal_source_start(pa_pal_source_data *sdata) {
     pal_source_data *pal_sdata = sdata->pal_sdata;
     pa_log_debug("%s", __func__);
 
+    pal_sdata->standby_close_time = 0;
+
+    /* the shared stream is opened by its capture thread */
+    if (pal_sdata->consumer) {
+        if (pal_sdata->standby)
+            pa_pal_capture_consumer_attach(pal_sdata->consumer);
+
+        pal_sdata->standby = false;
+        return 0;
+    }
+
     if (pal_sdata->standby) {
         if (!sdata->pal_source_opened) {
             rc = open_pal_source(sdata);
@@ -269,6 +298,13 @@ static int pa_pal_source_start(pa_pal_source_data *sdata) {
         }
         rc = pal_stream_start(pal_sdata->stream_handle);
         pa_log_debug("pal_stream_start returned %d", rc);
+
+        /* a new session starts at unity gain */
+        if (!rc && pal_sdata->hw_volume->no_of_volpair && pal_stream_set_volume(pal_sdata->stream_handle, pal_sdata->hw_volume))
+            pa_log_error("could not restore volume");
+        if (!rc && pal_sdata->hw_mute && pal_stream_set_mute(pal_sdata->stream_handle, true))
+            pa_log_error("could not restore mute");
+
         pal_sdata->standby = false;
     } else {
         pa_log_debug("pal_stream already started");
@@ -276,7 +312,48 @@ static int pa_pal_source_start(pa_pal_source_data *sdata) {
     return rc;
 }
 
-static int pa_pal_source_standby(pa_pal_source_data *sdata) {
+/* Stop the session but keep it open, it is closed by the IO thread once
+ * standby_close_time passes without a new start */
+static void pa_pal_source_stop(pa_pal_source_data *sdata) {
+    pal_source_data *pal_sdata = sdata->pal_sdata;
+    int rc;
+
+    pa_mutex_lock(pal_sdata->mutex);
+
+    if ((rc = pal_stream_stop(pal_sdata->stream_handle)))
+        pa_log_error("pal_stream_stop failed for %p error %d", pal_sdata->stream_handle, rc);
+
+    pal_sdata->standby = true;
+    pal_sdata->standby_close_time = pa_rtclock_now() + pal_sdata->standby_hysteresis_us;
+    pal_sdata->bytes_read = 0;
+    pa_pal_latency_smoother_reset(pal_sdata->smoother);
+    pa_pal_stats_session_reset(pal_sdata->stats);
+
+    pa_mutex_unlock(pal_sdata->mutex);
+
+    pa_log_debug("pal source %p stopped, closing in %" PRIu64 "us", pal_sdata->stream_handle, pal_sdata->standby_hysteresis_us);
+}
+
+/* Called from IO thread context */
+static void pa_pal_source_standby_timeout(pa_pal_source_data *sdata) {
+    pal_source_data *pal_sdata = sdata->pal_sdata;
+
+    if (!pal_sdata->standby_close_time || !pal_sdata->standby)
+        return;
+
+    if (pa_rtclock_now() < pal_sdata->standby_close_time) {
+        pa_rtpoll_set_timer_absolute(sdata->pa_sdata->rtpoll, pal_sdata->standby_close_time);
+        return;
+    }
+
+    pal_sdata->standby_close_time = 0;
+
+    if (sdata->pal_source_opened && close_pal_source(sdata))
+        pa_log_error("Could not close source handle %p after standby hysteresis", pal_sdata->stream_handle);
+}
+
+/* keep_warm only stops the session if a standby hysteresis is configured */
+static int pa_pal_source_standby(pa_pal_source_data *sdata, bool keep_warm) {
     int rc = 0;
 
     pa_assert(sdata);
@@ -284,7 +361,18 @@ static int pa_pal_source_standby(pa_pal_source_data *sdata) {
 
     pa_log_debug("%s",__func__);
 
-    if (sdata->pal_source_opened) {
+    if (sdata->pal_sdata->consumer) {
+        if (!sdata->pal_sdata->standby)
+            pa_pal_capture_consumer_detach(sdata->pal_sdata->consumer);
+
+        sdata->pal_sdata->standby = true;
+        return 0;
+    }
+
+    if (sdata->pal_source_opened && keep_warm && sdata->pal_sdata->standby_hysteresis_us) {
+        if (!sdata->pal_sdata->standby)
+            pa_pal_source_stop(sdata);
+    } else if (sdata->pal_source_opened) {
         rc = close_pal_source(sdata);
         if (PA_UNLIKELY(rc)) {
             pa_log_error("Could not close source handle %p, error  %d", sdata->pal_sdata->stream_handle, rc);
@@ -296,24 +384,11 @@ static int pa_pal_source_standby(pa_pal_source_data *sdata) {
     return 0;
 }
 
-static int pa_pal_set_device(pal_stream_handle_t *stream_handle,
-                          pa_pal_card_port_device_data *param_device_connection) {
-    struct pal_device device_connect;
-    int ret = 0;
-
-    device_connect.id = param_device_connection->device;
-
-    ret = pal_stream_set_device(stream_handle, PA_NUM_DEVICES, &device_connect);
-    if(ret)
-        pa_log_error("pal source switch device %d failed %d", device_connect.id, ret);
-
-    return ret;
-}
-
 static int pa_pal_source_set_port_cb(pa_source *s, pa_device_port *p) {
     int ret = 0;
     pal_param_device_connection_t param_device_connection;
     pa_pal_card_port_device_data *active_port_device_data;
+    pa_pal_ctrl_cmd *cmd;
     bool port_changed = false;
     bool dp_port_changed = false;
     bool hdmi_port_changed = false;
@@ -330,6 +405,13 @@ static int pa_pal_source_set_port_cb(pa_source *s, pa_device_port *p) {
     active_port_device_data = PA_DEVICE_PORT_DATA(s->active_port);
     pa_assert(active_port_device_data);
 
+    /* a share group member has no stream of its own, it captures from the device of the group */
+    if (sdata->pal_sdata->consumer && port_device_data->device != pa_pal_capture_share_get_device_id(sdata->pal_sdata->share)) {
+        pa_log_error("%s: port %s is not on device %d of its share group", s->name, p->name,
+                     pa_pal_capture_share_get_device_id(sdata->pal_sdata->share));
+        return -1;
+    }
+
     /* For Headset-in device, need set connect state */
     if (port_device_data->device == PAL_DEVICE_IN_WIRED_HEADSET || active_port_device_data->device == PAL_DEVICE_IN_WIRED_HEADSET) {
          param_device_connection.id = PAL_DEVICE_IN_WIRED_HEADSET;
@@ -415,6 +497,7 @@ static int pa_pal_source_set_port_cb(pa_source *s, pa_device_port *p) {
 
     /* Update required port info as per PA active port for next run */
     sdata->pal_sdata->pal_device->id = port_device_data->device;
+    sdata->pal_sdata->pal_device->config.bit_width = port_device_data->bit_width;
     if (port_device_data->pal_devicepp_config) {
         pa_strlcpy(sdata->pal_sdata->pal_device->custom_config.custom_key, port_device_data->pal_devicepp_config,
                 sizeof(sdata->pal_sdata->pal_device->custom_config.custom_key));
@@ -424,25 +507,11 @@ static int pa_pal_source_set_port_cb(pa_source *s, pa_device_port *p) {
                 sizeof(sdata->pal_sdata->pal_device->custom_config.custom_key));
     }
 
-    if (PA_SOURCE_IS_OPENED(s->state)) {
-        pa_assert(sdata->pal_sdata->stream_handle);
-    }
-    else {
-        return ret;
-    }
-
-    param_device_connection.id = port_device_data->device;
-
-    sdata->pal_sdata->source_event_id = PA_PAL_DEVICE_SWITCH;
-    pa_mutex_lock(sdata->pal_sdata->mutex);
-    ret = pa_pal_set_device(sdata->pal_sdata->stream_handle, (pa_pal_card_port_device_data *)&param_device_connection);
-    sdata->pal_sdata->source_event_id = PA_PAL_NO_EVENT;
-    pa_mutex_unlock(sdata->pal_sdata->mutex);
-    pa_cond_signal(sdata->pal_sdata->cond_ctrl_thread, 0);
-    if (ret != 0) {
-        pa_log_error("pal source switch device failed %d", ret);
-        return ret;
-    }
+    /* also posted while suspended, a stopped keep-warm session is still open */
+    cmd = pa_pal_ctrl_cmd_new(PA_PAL_DEVICE_SWITCH);
+    cmd->devices[0] = *sdata->pal_sdata->pal_device;
+    cmd->n_devices = 1;
+    pa_pal_source_post_ctrl(sdata, cmd);
 
     return ret;
 }
@@ -468,7 +537,7 @@ static int pa_pal_source_set_state_in_io_thread_cb(pa_source *s, pa_source_state
     else if (PA_SOURCE_IS_OPENED(new_state) && !PA_SOURCE_IS_OPENED(s->thread_info.state))
         r = pa_pal_source_start(source_data);
     else if (new_state == PA_SOURCE_SUSPENDED || (new_state == PA_SINK_UNLINKED && source_data->pal_source_opened))
-        r = pa_pal_source_standby(source_data);
+        r = pa_pal_source_standby(source_data, new_state == PA_SOURCE_SUSPENDED);
 
     return r;
 }
@@ -485,7 +554,54 @@ static int pa_pal_source_process_msg(pa_msgobject *o, int code, void *data, int6
 
     switch (code) {
         case PA_SOURCE_MESSAGE_GET_LATENCY: {
-            *((pa_usec_t*) data) = 0;
+            *((int64_t*) data) = pa_pal_source_get_latency(source_data);
+            return 0;
+        }
+
+        case PA_PAL_SOURCE_MESSAGE_CTRL: {
+            /* IO thread, between two reads */
+            pa_pal_ctrl_cmd *cmd = (pa_pal_ctrl_cmd *)data;
+            pal_source_data *pal_sdata = source_data->pal_sdata;
+
+            cmd->rc = 0;
+            if (cmd->event == PA_PAL_VOLUME_APPLY)
+                memcpy(pal_sdata->hw_volume, cmd->volume_data, PA_PAL_VOLUME_DATA_SIZE(cmd->volume_data->no_of_volpair));
+            else if (cmd->event == PA_PAL_MUTE_APPLY)
+                pal_sdata->hw_mute = cmd->mute;
+
+            if (cmd->event == PA_PAL_DEVICE_SWITCH && source_data->pal_source_opened && pal_sdata->standby) {
+                /* stopped session, the next start opens it on the new device */
+                cmd->rc = close_pal_source(source_data);
+            } else {
+                pa_mutex_lock(pal_sdata->mutex);
+                if (pal_sdata->stream_handle && source_data->pal_source_opened)
+                    pa_pal_ctrl_cmd_apply(pal_sdata->stream_handle, cmd);
+                pa_mutex_unlock(pal_sdata->mutex);
+            }
+
+            pa_asyncmsgq_post(source_data->pa_sdata->thread_mq.outq, o, PA_PAL_SOURCE_MESSAGE_CTRL_DONE, cmd, 0, NULL, NULL);
+            return 0;
+        }
+
+        case PA_PAL_SOURCE_MESSAGE_SET_PCM_TAP: {
+            /* IO thread, hands the replaced tap back to the caller to free */
+            pa_pal_pcm_tap **tap = (pa_pal_pcm_tap **)data;
+            pa_pal_pcm_tap *old = source_data->pal_sdata->pcm_tap;
+
+            source_data->pal_sdata->pcm_tap = *tap;
+            *tap = old;
+            return 0;
+        }
+
+        case PA_PAL_SOURCE_MESSAGE_CTRL_DONE: {
+            /* main thread */
+            pa_pal_ctrl_cmd *cmd = (pa_pal_ctrl_cmd *)data;
+            pa_source *s = source_data->pa_sdata->source;
+
+            if (cmd->rc)
+                pa_log_error("%s: control event %d failed, error %d", s->name, cmd->event, cmd->rc);
+
+            pa_pal_ctrl_cmd_free(cmd);
             return 0;
         }
 
@@ -545,6 +661,12 @@ static void pa_pal_source_reconfigure_cb(pa_source *s, pa_sample_spec *spec, boo
         return;
     }
 
+    /* rate and format of a share group member are fixed, PA converts for its outputs */
+    if (pal_sdata->consumer) {
+        pa_log_info("%s: %s captures from share group, not reconfigured", __func__, s->name);
+        return;
+    }
+
     if (!PA_SOURCE_IS_OPENED(s->state)) {
         pa_channel_map_init_auto(&new_map, spec->channels, PA_CHANNEL_MAP_DEFAULT);
 
@@ -603,6 +725,172 @@ static pa_idxset* pa_pal_source_get_formats(pa_source *s) {
     return pa_idxset_copy(sdata->pa_sdata->formats, (pa_copy_func_t) pa_format_info_copy);
 }
 
+static void pa_pal_source_ring_free(pal_source_data *pal_sdata) {
+    unsigned i;
+
+    for (i = 0; i < pal_sdata->ring_size; i++)
+        if (pal_sdata->ring[i])
+            pa_memblock_unref(pal_sdata->ring[i]);
+
+    pa_xfree(pal_sdata->ring);
+    pal_sdata->ring = NULL;
+    pal_sdata->ring_size = 0;
+    pal_sdata->ring_idx = 0;
+    pal_sdata->ring_block_size = 0;
+}
+
+/* Called from IO thread context. Returns a referenced block of one period.
+ * Blocks come from the core pool, which is shared memory clients import
+ * without a copy when PA runs with memfd, and are only refilled once all
+ * source outputs and clients dropped them. */
+static pa_memblock* pa_pal_source_ring_get(pa_pal_source_data *sdata) {
+    pal_source_data *pal_sdata = sdata->pal_sdata;
+    pa_mempool *pool = sdata->pa_sdata->source->core->mempool;
+    unsigned i, idx;
+
+    /* period size changed with a reconfigure */
+    if (pal_sdata->ring_block_size != pal_sdata->buffer_size) {
+        pa_pal_source_ring_free(pal_sdata);
+        pal_sdata->ring_size = pal_sdata->buffer_count + PA_SOURCE_RING_EXTRA_BLOCKS;
+        pal_sdata->ring = pa_xnew0(pa_memblock *, pal_sdata->ring_size);
+        pal_sdata->ring_block_size = pal_sdata->buffer_size;
+    }
+
+    for (i = 0; i < pal_sdata->ring_size; i++) {
+        idx = (pal_sdata->ring_idx + i) % pal_sdata->ring_size;
+
+        if (!pal_sdata->ring[idx])
+            pal_sdata->ring[idx] = pa_memblock_new(pool, pal_sdata->ring_block_size);
+        else if (!pa_memblock_ref_is_one(pal_sdata->ring[idx]))
+            continue;
+
+        pal_sdata->ring_idx = (idx + 1) % pal_sdata->ring_size;
+        return pa_memblock_ref(pal_sdata->ring[idx]);
+    }
+
+    /* a slow client holds all of them, don't wait for it */
+    return pa_memblock_new(pool, pal_sdata->buffer_size);
+}
+
+/* Called from IO thread context. Reads one period and posts it, a failed read
+ * posts silence so the recording keeps its timeline. The read does not hold
+ * pal_sdata->mutex, the session is only closed by this thread or while the
+ * source is suspended. Returns the PAL result */
+static int pa_pal_source_read_period(pa_pal_source_data *sdata) {
+    pal_source_data *pal_sdata = sdata->pal_sdata;
+    pa_source *s = sdata->pa_sdata->source;
+    pa_usec_t buffered_us = pa_bytes_to_usec(pal_sdata->buffer_size * pal_sdata->buffer_count, &s->sample_spec);
+    struct pal_buffer in_buf;
+    pa_memchunk chunk;
+    pa_usec_t start;
+    void *data;
+    int ret;
+
+    memset(&in_buf, 0, sizeof(struct pal_buffer));
+
+    chunk.memblock = pa_pal_source_ring_get(sdata);
+    data = pa_memblock_acquire(chunk.memblock);
+    chunk.length = pal_sdata->buffer_size;
+    chunk.index = 0;
+
+    in_buf.buffer = data;
+    in_buf.size = chunk.length;
+
+    start = pa_rtclock_now();
+    if ((ret = pal_stream_read(pal_sdata->stream_handle, &in_buf)) <= 0) {
+        pa_log_error("pal_stream_read failed, ret = %d", ret);
+        /* the period is lost, don't hand out what the block held before */
+        pa_silence_memory(data, chunk.length, &s->sample_spec);
+        pa_pal_stats_io_error(pal_sdata->stats);
+        pa_pal_stats_xrun(pal_sdata->stats);
+        pa_pal_stats_session_reset(pal_sdata->stats);
+    } else {
+        pa_pal_stats_io(pal_sdata->stats, start, pa_rtclock_now(), buffered_us);
+        pal_sdata->bytes_read += ret;
+        chunk.length = ret;
+    }
+
+    if (pal_sdata->pcm_tap)
+        pa_pal_pcm_tap_write(pal_sdata->pcm_tap, data, chunk.length);
+
+    pa_memblock_release(chunk.memblock);
+    pa_source_post(s, &chunk);
+    pa_memblock_unref(chunk.memblock);
+
+    return ret;
+}
+
+/* Called from IO thread context. Reads the periods the DSP session time says
+ * are captured already, then sleeps until the next one is due. The timer is
+ * only a fallback, READ_DONE wakes the thread earlier when PAL sends it */
+static void pa_pal_source_nonblock_capture(pa_pal_source_data *sdata) {
+    pal_source_data *pal_sdata = sdata->pal_sdata;
+    pa_source_data *pa_sdata = sdata->pa_sdata;
+    pa_sample_spec *ss = &pa_sdata->source->sample_spec;
+    pa_usec_t period_us = pa_bytes_to_usec(pal_sdata->buffer_size, ss);
+    uint64_t session_time_us, read_us;
+    size_t n = 0;
+
+    /* no timestamp yet, the first read starts the session */
+    if (pa_pal_latency_smoother_get(pal_sdata->smoother, pal_sdata->stream_handle, &session_time_us)) {
+        if (pa_pal_source_read_period(sdata) > 0)
+            pa_rtpoll_set_timer_relative(pa_sdata->rtpoll, period_us / 2);
+        else
+            pa_rtpoll_set_timer_relative(pa_sdata->rtpoll, period_us);
+        return;
+    }
+
+    read_us = pa_bytes_to_usec(pal_sdata->bytes_read, ss);
+
+    /* never more than PAL can hold, the rest is an overrun already */
+    while (session_time_us >= read_us + period_us && n < PA_MAX(pal_sdata->buffer_count, 1)) {
+        if (pa_pal_source_read_period(sdata) <= 0) {
+            pa_rtpoll_set_timer_relative(pa_sdata->rtpoll, period_us);
+            return;
+        }
+
+        read_us = pa_bytes_to_usec(pal_sdata->bytes_read, ss);
+        n++;
+    }
+
+    if (session_time_us >= read_us + period_us)
+        pa_rtpoll_set_timer_relative(pa_sdata->rtpoll, 0);
+    else
+        pa_rtpoll_set_timer_relative(pa_sdata->rtpoll, read_us + period_us - session_time_us);
+}
+
+/* Called from IO thread context. Posts everything the capture thread of the
+ * share group queued for this source */
+static void pa_pal_source_read_shared(pa_pal_source_data *sdata) {
+    pal_source_data *pal_sdata = sdata->pal_sdata;
+    pa_source *s = sdata->pa_sdata->source;
+    pa_memchunk chunk;
+    unsigned overruns;
+    void *data;
+
+    if ((overruns = pa_pal_capture_consumer_take_overruns(pal_sdata->consumer))) {
+        pa_log_debug("%s: %u periods dropped, source read too late", s->name, overruns);
+        while (overruns--)
+            pa_pal_stats_xrun(pal_sdata->stats);
+    }
+
+    while (pa_pal_capture_consumer_get_queued(pal_sdata->consumer) > 0) {
+        chunk.memblock = pa_pal_source_ring_get(sdata);
+        data = pa_memblock_acquire(chunk.memblock);
+        chunk.index = 0;
+        /* the ring only holds whole frames, never empty here */
+        chunk.length = pa_pal_capture_consumer_read(pal_sdata->consumer, data, pal_sdata->buffer_size);
+        pal_sdata->bytes_read += chunk.length;
+
+        if (pal_sdata->pcm_tap)
+            pa_pal_pcm_tap_write(pal_sdata->pcm_tap, data, chunk.length);
+
+        pa_memblock_release(chunk.memblock);
+        pa_source_post(s, &chunk);
+        pa_memblock_unref(chunk.memblock);
+    }
+}
+
 static void pa_pal_source_thread_func(void *userdata) {
     pa_pal_source_data *source_data = (pa_pal_source_data *)userdata;
     pa_source_data *pa_sdata = NULL;
@@ -621,54 +909,34 @@ static void pa_pal_source_thread_func(void *userdata) {
     pa_thread_mq_install(&pa_sdata->thread_mq);
 
     for (;;) {
+        bool capturing;
         int ret;
         pa_rtpoll_set_timer_disabled(pa_sdata->rtpoll);
 
-        if ((!pal_sdata->dynamic_usecase &&
-            PA_SOURCE_IS_OPENED(pa_sdata->source->thread_info.state)) ||
-            PA_SOURCE_IS_RUNNING(pa_sdata->source->thread_info.state)) {
-            pa_memchunk chunk;
-            void *data;
-            struct pal_buffer in_buf;
-
-            memset(&in_buf, 0, sizeof(struct pal_buffer));
-
-            chunk.memblock = pa_memblock_new(pa_sdata->source->core->mempool, pal_sdata->buffer_size);
-            data = pa_memblock_acquire(chunk.memblock);
-            chunk.length = pa_memblock_get_length(chunk.memblock);
-            chunk.index = 0;
-
-            in_buf.buffer = data;
-            in_buf.size = chunk.length;
-
-            pa_mutex_lock(pal_sdata->mutex);
-            if (pal_sdata->source_event_id != PA_PAL_NO_EVENT) {
-                /* wait for response from ctrl thread */
-                pa_cond_wait(pal_sdata->cond_ctrl_thread, pal_sdata->mutex);
-            }
-            if (pal_sdata->stream_handle) {
-                if ((ret = pal_stream_read(pal_sdata->stream_handle, &in_buf)) <= 0) {
-                     pa_log_error("pal_stream_read failed, ret = %d", ret);
-                     pa_msleep(pa_bytes_to_usec(in_buf.size, &pa_sdata->source->sample_spec)/1000);
-                     ret = in_buf.size;
-                }
-                chunk.length = ret;
+        capturing = (!pal_sdata->dynamic_usecase && PA_SOURCE_IS_OPENED(pa_sdata->source->thread_info.state)) ||
+                    PA_SOURCE_IS_RUNNING(pa_sdata->source->thread_info.state);
+
+        if (capturing && pal_sdata->consumer) {
+            /* woken by the consumer fdsem */
+            pa_pal_source_read_shared(source_data);
+        } else if (capturing && pal_sdata->stream_handle) {
+            if (pal_sdata->non_blocking) {
+                pa_pal_source_nonblock_capture(source_data);
+            } else if (pa_pal_source_read_period(source_data) > 0) {
+                /* the next read blocks until PAL has a period */
+                pa_rtpoll_set_timer_absolute(pa_sdata->rtpoll, pa_rtclock_now());
+            } else {
+                /* give a failing DSP a period before trying again */
+                pa_rtpoll_set_timer_relative(pa_sdata->rtpoll,
+                        pa_bytes_to_usec(pal_sdata->buffer_size, &pa_sdata->source->sample_spec));
             }
-            pa_mutex_unlock(pal_sdata->mutex);
-
-#ifdef SOURCE_DUMP_ENABLED
-            pa_log_error(" chunk length %d chunk index %d in_buf.size %d ",chunk.length, chunk.index, ret);
-            if ((ret = write(pal_sdata->write_fd, in_buf.buffer, ret)) < 0)
-                    pa_log_error("write to fd failed %d", ret);
-#endif
-            /* FIXME: don't post if read fails */
-            pa_memblock_release(chunk.memblock);
-            pa_source_post(pa_sdata->source, &chunk);
-            pa_memblock_unref(chunk.memblock);
-
-            pa_rtpoll_set_timer_absolute(pa_sdata->rtpoll, pa_rtclock_now());
+        } else {
+            /* the gap until capture resumes is no overrun */
+            pa_pal_stats_session_reset(pal_sdata->stats);
         }
 
+        pa_pal_source_standby_timeout(source_data);
+
         /* nothing to do. Let's sleep */
         if ((ret = pa_rtpoll_run(pa_sdata->rtpoll)) < 0)
             goto fail;
@@ -687,11 +955,33 @@ finish:
     pa_log_debug("Source IO Thread shutting down");
 }
 
+static int32_t pa_pal_in_cb(pal_stream_handle_t *stream_handle,
+                            uint32_t event_id, uint32_t *event_data,
+                            uint32_t event_size, uint64_t cookie) {
+    pa_pal_source_data *sdata = (pa_pal_source_data *)cookie;
+
+    pa_assert(sdata);
+    pa_assert(sdata->pal_sdata);
+
+    switch (event_id) {
+        case PAL_STREAM_CBK_EVENT_READ_DONE:
+            /* wake up the IO thread, it reads what is captured */
+            if (sdata->pal_sdata->read_fdsem)
+                pa_fdsem_post(sdata->pal_sdata->read_fdsem);
+
+            break;
+
+        default:
+            pa_log_debug("Unhandled event %d handle %p", event_id, stream_handle);
+
+            break;
+    }
+
+    return 0;
+}
+
 static int open_pal_source(pa_pal_source_data *sdata) {
     int rc;
-#ifdef SOURCE_DUMP_ENABLED
-    char *file_name;
-#endif
 
     pal_buffer_config_t out_buf_cfg, in_buf_cfg;
     pal_source_data *pal_sdata = NULL;
@@ -700,22 +990,14 @@ static int open_pal_source(pa_pal_source_data *sdata) {
     pa_assert(sdata->pal_sdata);
 
     pal_sdata = sdata->pal_sdata;
-#ifdef SOURCE_DUMP_ENABLED
-    file_name = pa_sprintf_malloc("/data/pcmdump_source_%d", pal_sdata->index);
-
-    pal_sdata->write_fd = open(file_name, O_RDWR | O_TRUNC | O_CREAT, S_IRWXU);
-    if(pal_sdata->write_fd < 0)
-        pa_log_error("Could not open write fd %d for source index %d", pal_sdata->write_fd, pal_sdata->index);
-
-    pa_xfree(file_name);
-#endif
 
     pa_log_debug("opening source with configuration flag = 0x%x, format %d, sample_rate %d",
                  pal_sdata->stream_attributes->type, pal_sdata->stream_attributes->in_media_config.aud_fmt_id,
                  pal_sdata->stream_attributes->in_media_config.sample_rate);
 
-    rc = pal_stream_open(pal_sdata->stream_attributes, 1, pal_sdata->pal_device, 0, NULL, NULL, 0,
-                             &pal_sdata->stream_handle);
+    rc = pal_stream_open(pal_sdata->stream_attributes, 1, pal_sdata->pal_device, 0, NULL,
+                         pal_sdata->non_blocking ? pa_pal_in_cb : NULL, pal_sdata->non_blocking ? (uint64_t)sdata : 0,
+                         &pal_sdata->stream_handle);
     if (rc) {
         pal_sdata->stream_handle = NULL;
         pa_log_error("Could not open input stream %d", rc);
@@ -737,6 +1019,11 @@ static int open_pal_source(pa_pal_source_data *sdata) {
         pa_log_error("pal_stream_set_buffer_size failed\n");
     }
 
+    /* part of the graph, added once per session before it starts */
+    if (pal_sdata->dsp_effect != PAL_AUDIO_EFFECT_NONE &&
+            pal_add_remove_effect(pal_sdata->stream_handle, pal_sdata->dsp_effect, true))
+        pa_log_error("could not enable dsp effect %d", pal_sdata->dsp_effect);
+
     sdata->pal_source_opened = true;
 
 fail:
@@ -755,13 +1042,16 @@ static int close_pal_source(pa_pal_source_data *sdata) {
     pal_sdata = sdata->pal_sdata;
     pa_sdata = sdata->pa_sdata;
 
-    pa_assert(pal_sdata->stream_handle);
     pa_mutex_lock(pal_sdata->mutex);
 
     pa_log_debug("closing pal source %p", pal_sdata->stream_handle);
 
+    pal_sdata->standby_close_time = 0;
+
     if (PA_UNLIKELY(pal_sdata->stream_handle == NULL)) {
-        pa_log_error("Invalid source handle %p", pal_sdata->stream_handle);
+        /* main and IO thread may race to close a keep-warm session */
+        pa_log_debug("pal source already closed");
+        rc = 0;
     } else {
         rc = pal_stream_stop(pal_sdata->stream_handle);
 
@@ -774,14 +1064,13 @@ static int close_pal_source(pa_pal_source_data *sdata) {
         }
 
         pal_sdata->stream_handle = NULL;
+        pal_sdata->bytes_read = 0;
+        pa_pal_latency_smoother_reset(pal_sdata->smoother);
         pal_sdata->standby = true;
         sdata->pal_source_opened = false;
     }
 
     pa_mutex_unlock(pal_sdata->mutex);
-#ifdef SOURCE_DUMP_ENABLED
-    close(pal_sdata->write_fd);
-#endif
 
     return rc;
 }
@@ -796,8 +1085,8 @@ static int restart_pal_source(pa_pal_source_data *sdata, pa_encoding_t encoding,
 
     pa_sdata = sdata->pa_sdata;
     pal_sdata = sdata->pal_sdata;
-    if (!pal_sdata->standby) {
-        rc = close_pal_source((pa_pal_source_data *)sdata->pal_sdata);
+    if (sdata->pal_source_opened) {
+        rc = close_pal_source(sdata);
         if (rc) {
             pa_log_error("close_pal_source failed, error %d", rc);
             goto exit;
@@ -809,26 +1098,9 @@ static int restart_pal_source(pa_pal_source_data *sdata, pa_encoding_t encoding,
         pa_log_error("%s: unsupported format", __func__);
         return -1;
     }
-    if (pa_sdata->avoid_config_processing & PA_PAL_CARD_AVOID_PROCESSING_FOR_BIT_WIDTH){
-       switch (ss->format) {
-           case PA_SAMPLE_S32LE:
-               sdata->pal_sdata->stream_attributes->in_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S32_LE;
-               sdata->pal_sdata->stream_attributes->in_media_config.bit_width = 32;
-               break;
-           case PA_SAMPLE_S24_32LE:
-               sdata->pal_sdata->stream_attributes->in_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S24_LE;
-               sdata->pal_sdata->stream_attributes->in_media_config.bit_width = 24;
-               break;
-           case PA_SAMPLE_S24LE:
-               sdata->pal_sdata->stream_attributes->in_media_config.aud_fmt_id = PAL_AUDIO_FMT_PCM_S24_3LE;
-               sdata->pal_sdata->stream_attributes->in_media_config.bit_width = 24;
-               break;
-           default:
-               sdata->pal_sdata->stream_attributes->in_media_config.aud_fmt_id = PAL_AUDIO_FMT_DEFAULT_PCM;
-               sdata->pal_sdata->stream_attributes->in_media_config.bit_width = 16;
-               break;
-       }
-    }
+    if (pa_sdata->avoid_config_processing & PA_PAL_CARD_AVOID_PROCESSING_FOR_BIT_WIDTH)
+        sdata->pal_sdata->stream_attributes->in_media_config.aud_fmt_id =
+            pa_pal_util_get_pal_pcm_format(ss->format, &sdata->pal_sdata->stream_attributes->in_media_config.bit_width);
     else
         sdata->pal_sdata->stream_attributes->in_media_config.aud_fmt_id = pal_format;
 
@@ -843,6 +1115,11 @@ static int restart_pal_source(pa_pal_source_data *sdata, pa_encoding_t encoding,
         pa_log_error("open_pal_source failed during recreation, error %d", rc);
     }
 
+    /* a wav file has a single spec, start a new one on change */
+    if (pal_sdata->pcm_tap_prefix && (!pal_sdata->pcm_tap ||
+            !pa_sample_spec_equal(ss, pa_pal_pcm_tap_get_sample_spec(pal_sdata->pcm_tap))))
+        pa_pal_source_attach_pcm_tap(sdata, ss, pal_sdata->pcm_tap_prefix);
+
 exit:
     return rc;
 }
@@ -850,15 +1127,30 @@ exit:
 static int free_pal_source(pal_source_data *pal_sdata) {
     int rc = 0;
 
-    if (!pal_sdata->standby) {
+    if (!pal_sdata->standby && !pal_sdata->consumer) {
         rc = close_pal_source((pa_pal_source_data *)pal_sdata);
         if (rc) {
             pa_log_error("close_pal_source failed, error %d", rc);
         }
     }
 
+    if (pal_sdata->consumer)
+        pa_pal_capture_consumer_free(pal_sdata->consumer);
+    if (pal_sdata->share)
+        pa_pal_capture_share_unref(pal_sdata->share);
+
     pa_mutex_free(pal_sdata->mutex);
-    pa_cond_free(pal_sdata->cond_ctrl_thread);
+    pa_pal_source_ring_free(pal_sdata);
+    if (pal_sdata->read_fdsem)
+        pa_fdsem_free(pal_sdata->read_fdsem);
+    if (pal_sdata->smoother)
+        pa_pal_latency_smoother_free(pal_sdata->smoother);
+    if (pal_sdata->stats)
+        pa_pal_stats_free(pal_sdata->stats);
+    if (pal_sdata->pcm_tap)
+        pa_pal_pcm_tap_free(pal_sdata->pcm_tap);
+    pa_xfree(pal_sdata->pcm_tap_prefix);
+    pa_xfree(pal_sdata->hw_volume);
     pa_xfree(pal_sdata->stream_attributes);
     pa_xfree(pal_sdata->pal_device);
     pa_xfree(pal_sdata);
@@ -873,13 +1165,38 @@ static int create_pal_source(pa_pal_source_config *source, pa_pal_card_port_devi
     sdata->pal_sdata = pa_xnew0(pal_source_data, 1);
 
     sdata->pal_sdata->mutex = pa_mutex_new(false /* recursive  */, false /* inherit_priority */);
+    sdata->pal_sdata->hw_volume = pa_xmalloc0(PA_PAL_VOLUME_DATA_SIZE(PA_CHANNELS_MAX));
     rc = pa_pal_source_fill_info(source, sdata->pal_sdata, port_device_data);
     if (rc) {
         pa_log_error("pal source init failed, error %d", rc);
+        pa_xfree(sdata->pal_sdata->hw_volume);
         pa_xfree(sdata->pal_sdata);
         sdata->pal_sdata = NULL;
         return rc;
     }
+
+    if (source->share_group) {
+        pal_source_data *pal_sdata = sdata->pal_sdata;
+
+        pal_sdata->share = pa_pal_capture_share_get(source->share_group, source->stream_type, pal_sdata->pal_device,
+                                                    &source->default_spec, &source->default_map, pal_sdata->buffer_size,
+                                                    pal_sdata->buffer_count);
+        if (pal_sdata->share && !(pal_sdata->consumer = pa_pal_capture_consumer_new(pal_sdata->share, &source->default_spec,
+                                                                                   &source->default_map, pal_sdata->buffer_size,
+                                                                                   pal_sdata->buffer_count))) {
+            pa_pal_capture_share_unref(pal_sdata->share);
+            pal_sdata->share = NULL;
+        }
+
+        if (!pal_sdata->share)
+            pa_log_error("source %s can not join share group %s, it captures on its own", source->name, source->share_group);
+    }
+
+    if (sdata->pal_sdata->non_blocking && !sdata->pal_sdata->consumer && !(sdata->pal_sdata->read_fdsem = pa_fdsem_new())) {
+        /* reads are still paced by the DSP timestamps */
+        pa_log_error("Could not create read fdsem, source %s relies on its timer", source->name);
+    }
+
     return rc;
 }
 
@@ -946,6 +1263,16 @@ static int create_pa_source(pa_module *m, char *source_name, char *description,
     pa_proplist_sets(new_data.proplist, PA_PROP_DEVICE_STRING, pa_pal_source_get_name_from_type(pal_sdata->stream_attributes->type));
     pa_proplist_sets(new_data.proplist, PA_PROP_DEVICE_DESCRIPTION, description);
 
+    /* module-filter-heuristics adds no cpu echo canceller to phone streams on it */
+    if (pal_sdata->dsp_effect == PAL_AUDIO_EFFECT_EC || pal_sdata->dsp_effect == PAL_AUDIO_EFFECT_ECNS)
+        pa_proplist_sets(new_data.proplist, PA_PROP_DEVICE_INTENDED_ROLES, "phone");
+
+#if HAVE_DECL_PAL_DEVICE_IN_ECHO_REF
+    /* the far end as played by the DSP, after its post processing */
+    if (pal_sdata->pal_device->id == PAL_DEVICE_IN_ECHO_REF)
+        pa_proplist_sets(new_data.proplist, PA_PROP_DEVICE_CLASS, "monitor");
+#endif
+
     pa_sdata->source = pa_source_new(m->core, &new_data, PA_SOURCE_HARDWARE);
     if (!pa_sdata->source) {
         pa_log_error("Could not create source");
@@ -981,9 +1308,20 @@ static int create_pa_source(pa_module *m, char *source_name, char *description,
     pa_source_set_max_rewind(pa_sdata->source, 0);
     pa_source_set_fixed_latency(pa_sdata->source, pa_bytes_to_usec(pal_sdata->buffer_size, ss));
 
+    if (pal_sdata->consumer || pal_sdata->read_fdsem) {
+        pa_sdata->rtpoll_item = pa_rtpoll_item_new_fdsem(pa_sdata->rtpoll, PA_RTPOLL_NORMAL, pal_sdata->consumer ?
+                                                         pa_pal_capture_consumer_get_fdsem(pal_sdata->consumer) : pal_sdata->read_fdsem);
+        if (!pa_sdata->rtpoll_item) {
+            pa_log_error("Could not create rtpoll item");
+            goto fail;
+        }
+    }
+
     if (use_hw_volume) {
         pa_sdata->source->n_volume_steps = PA_VOLUME_NORM+1; /* FIXME: What should be value */
         pa_source_set_set_volume_callback(pa_sdata->source, pa_pal_source_set_volume_cb);
+        pa_source_set_set_mute_callback(pa_sdata->source, pa_pal_source_set_mute_cb);
+        pa_source_enable_decibel_volume(pa_sdata->source, true);
     }
 
     pa_sdata->thread = pa_thread_new(source_name, pa_pal_source_thread_func, source_data);
@@ -997,6 +1335,9 @@ static int create_pa_source(pa_module *m, char *source_name, char *description,
     return 0;
 
 fail :
+    if (pa_sdata->rtpoll_item)
+        pa_rtpoll_item_free(pa_sdata->rtpoll_item);
+
     if (pa_sdata->rtpoll)
         pa_rtpoll_free(pa_sdata->rtpoll);
 
@@ -1021,6 +1362,9 @@ static int free_pa_source(pa_source_data *pa_sdata) {
 
     pa_log_debug("closing pa source %p", pa_sdata->source);
 
+    if (pa_sdata->stats_event)
+        pa_sdata->source->core->mainloop->time_free(pa_sdata->stats_event);
+
     pa_source_unlink(pa_sdata->source);
 
     pa_asyncmsgq_send(pa_sdata->thread_mq.inq, NULL, PA_MESSAGE_SHUTDOWN, NULL, 0, NULL);
@@ -1033,6 +1377,9 @@ static int free_pa_source(pa_source_data *pa_sdata) {
 
     pa_thread_mq_done(&pa_sdata->thread_mq);
 
+    if (pa_sdata->rtpoll_item)
+        pa_rtpoll_item_free(pa_sdata->rtpoll_item);
+
     pa_rtpoll_free(pa_sdata->rtpoll);
 
     pa_xfree(pa_sdata);
@@ -1088,6 +1435,83 @@ int pa_pal_source_get_media_config(pa_pal_source_handle_t *handle, pa_sample_spe
     return ret;
 }
 
+/* Called from main context, publishes pal.stats.* whenever they changed */
+static void pa_pal_source_stats_publish_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *t, void *userdata) {
+    pa_pal_source_data *sdata = (pa_pal_source_data *)userdata;
+    pa_pal_stats *stats = sdata->pal_sdata->stats;
+    pa_source *s = sdata->pa_sdata->source;
+    pa_proplist *p;
+    int generation;
+
+    generation = pa_atomic_load(&stats->io_count) + pa_atomic_load(&stats->xruns) +
+                 pa_atomic_load(&stats->io_errors) + pa_atomic_load(&stats->late_wakeups);
+
+    if (generation != sdata->pa_sdata->stats_generation && PA_SOURCE_IS_LINKED(s->state)) {
+        sdata->pa_sdata->stats_generation = generation;
+
+        p = pa_proplist_new();
+        pa_pal_stats_to_proplist(stats, p);
+        pa_source_update_proplist(s, PA_UPDATE_REPLACE, p);
+        pa_proplist_free(p);
+    }
+
+    pa_core_rttime_restart(s->core, e, pa_rtclock_now() + PA_PAL_STATS_PUBLISH_INTERVAL_MS * PA_USEC_PER_MSEC);
+}
+
+char* pa_pal_source_get_stats(pa_source *s) {
+    pa_pal_source_data *sdata;
+
+    pa_assert(s);
+
+    sdata = (pa_pal_source_data *)s->userdata;
+    if (!sdata || !sdata->pal_sdata || !sdata->pal_sdata->stats)
+        return NULL;
+
+    return pa_pal_stats_to_string(sdata->pal_sdata->stats);
+}
+
+/* Called from main thread context, a NULL prefix detaches the tap */
+static void pa_pal_source_attach_pcm_tap(pa_pal_source_data *sdata, const pa_sample_spec *ss, const char *prefix) {
+    pa_pal_pcm_tap *tap = NULL;
+
+    if (prefix)
+        tap = pa_pal_pcm_tap_new(prefix, ss, PA_PAL_PCM_TAP_MAX_FILE_SIZE);
+
+    /* the IO thread drops its reference before the old tap is freed */
+    pa_assert_se(pa_asyncmsgq_send(sdata->pa_sdata->source->asyncmsgq, PA_MSGOBJECT(sdata->pa_sdata->source),
+                                   PA_PAL_SOURCE_MESSAGE_SET_PCM_TAP, &tap, 0, NULL) == 0);
+    if (tap)
+        pa_pal_pcm_tap_free(tap);
+}
+
+int pa_pal_source_set_pcm_tap(pa_source *s, const char *prefix) {
+    pa_pal_source_data *sdata;
+    pal_source_data *pal_sdata;
+
+    pa_assert(s);
+
+    sdata = (pa_pal_source_data *)s->userdata;
+    if (!sdata || !sdata->pal_sdata || !sdata->pa_sdata)
+        return -1;
+
+    pal_sdata = sdata->pal_sdata;
+
+    pa_xfree(pal_sdata->pcm_tap_prefix);
+    pal_sdata->pcm_tap_prefix = pa_xstrdup(prefix);
+
+    pa_pal_source_attach_pcm_tap(sdata, &s->sample_spec, prefix);
+
+    if (prefix && !pal_sdata->pcm_tap) {
+        pa_xfree(pal_sdata->pcm_tap_prefix);
+        pal_sdata->pcm_tap_prefix = NULL;
+        return -1;
+    }
+
+    pa_log_info("%s: pcm tap %s%s", s->name, prefix ? "writing to " : "stopped", prefix ? prefix : "");
+
+    return 0;
+}
+
 int pa_pal_source_create(pa_module *m, pa_card *card, const char *driver, const char *module_name, pa_pal_source_config *source,
                           pa_pal_source_handle_t **handle) {
     int rc = -1;
@@ -1141,7 +1565,7 @@ int pa_pal_source_create(pa_module *m, pa_card *card, const char *driver, const
         goto exit;
     }
 
-    rc = create_pa_source(m, source->name, source->description, source->formats, &source->default_spec, &source->default_map, source->use_hw_volume, source->alternate_sample_rate, card, source->avoid_config_processing, ports, driver, sdata);
+    rc = create_pa_source(m, source->name, source->description, source->formats, &source->default_spec, &source->default_map, source->use_hw_volume && !sdata->pal_sdata->consumer, source->alternate_sample_rate, card, source->avoid_config_processing, ports, driver, sdata);
     pa_hashmap_free(ports);
     if (PA_UNLIKELY(rc)) {
         pa_log_error("Could not create pa source for source %s, error %d", source->name, rc);
@@ -1152,6 +1576,10 @@ int pa_pal_source_create(pa_module *m, pa_card *card, const char *driver, const
 
     *handle = (pa_pal_source_handle_t *)sdata;
 
+    if (sdata)
+        sdata->pa_sdata->stats_event = pa_core_rttime_new(m->core,
+                pa_rtclock_now() + PA_PAL_STATS_PUBLISH_INTERVAL_MS * PA_USEC_PER_MSEC, pa_pal_source_stats_publish_cb, sdata);
+
 exit:
     return rc;
 }
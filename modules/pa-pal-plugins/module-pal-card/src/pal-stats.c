@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2025 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pulse/xmalloc.h>
+#include <pulsecore/core-util.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/strbuf.h>
+
+#include "pal-stats.h"
+
+#define PA_PAL_STATS_PROP_PREFIX "pal.stats."
+
+/* upper bound of each histogram bucket in usec, the last one is open */
+static const pa_usec_t hist_bounds_us[PA_PAL_STATS_HIST_BUCKETS - 1] = {
+    500, 1000, 2000, 5000, 10000, 20000, 50000
+};
+
+static const char *hist_names[PA_PAL_STATS_HIST_BUCKETS] = {
+    "0.5ms", "1ms", "2ms", "5ms", "10ms", "20ms", "50ms", "inf"
+};
+
+static void pa_pal_stats_update_max(pa_atomic_t *max, pa_usec_t value) {
+    int old, v = (int)PA_MIN(value, (pa_usec_t)INT32_MAX);
+
+    do {
+        old = pa_atomic_load(max);
+        if (v <= old)
+            return;
+    } while (!pa_atomic_cmpxchg(max, old, v));
+}
+
+pa_pal_stats* pa_pal_stats_new(bool capture) {
+    pa_pal_stats *s;
+
+    s = pa_xnew0(pa_pal_stats, 1);
+    s->capture = capture;
+
+    return s;
+}
+
+void pa_pal_stats_free(pa_pal_stats *s) {
+    pa_assert(s);
+
+    pa_xfree(s);
+}
+
+void pa_pal_stats_session_reset(pa_pal_stats *s) {
+    pa_assert(s);
+
+    s->last_io_end = 0;
+}
+
+void pa_pal_stats_io(pa_pal_stats *s, pa_usec_t start, pa_usec_t end, pa_usec_t buffered_us) {
+    pa_usec_t duration = end > start ? end - start : 0;
+    unsigned i;
+
+    pa_assert(s);
+
+    if (s->last_io_end && buffered_us && start > s->last_io_end + buffered_us)
+        pa_atomic_inc(&s->xruns);
+    s->last_io_end = end;
+
+    for (i = 0; i < PA_PAL_STATS_HIST_BUCKETS - 1; i++)
+        if (duration < hist_bounds_us[i])
+            break;
+
+    pa_atomic_inc(&s->io_hist[i]);
+    pa_atomic_inc(&s->io_count);
+    pa_pal_stats_update_max(&s->io_max_us, duration);
+}
+
+void pa_pal_stats_io_error(pa_pal_stats *s) {
+    pa_assert(s);
+
+    pa_atomic_inc(&s->io_errors);
+}
+
+void pa_pal_stats_xrun(pa_pal_stats *s) {
+    pa_assert(s);
+
+    pa_atomic_inc(&s->xruns);
+}
+
+void pa_pal_stats_wakeup(pa_pal_stats *s, pa_usec_t late_us, pa_usec_t period_us) {
+    pa_assert(s);
+
+    if (late_us > period_us / 2)
+        pa_atomic_inc(&s->late_wakeups);
+
+    pa_pal_stats_update_max(&s->wakeup_max_late_us, late_us);
+}
+
+void pa_pal_stats_to_proplist(pa_pal_stats *s, pa_proplist *p) {
+    pa_strbuf *hist;
+    char *str;
+    unsigned i;
+
+    pa_assert(s);
+    pa_assert(p);
+
+    pa_proplist_setf(p, s->capture ? PA_PAL_STATS_PROP_PREFIX "overruns" : PA_PAL_STATS_PROP_PREFIX "underruns",
+                     "%d", pa_atomic_load(&s->xruns));
+    pa_proplist_setf(p, PA_PAL_STATS_PROP_PREFIX "io_count", "%d", pa_atomic_load(&s->io_count));
+    pa_proplist_setf(p, PA_PAL_STATS_PROP_PREFIX "io_errors", "%d", pa_atomic_load(&s->io_errors));
+    pa_proplist_setf(p, PA_PAL_STATS_PROP_PREFIX "io_max_usec", "%d", pa_atomic_load(&s->io_max_us));
+    pa_proplist_setf(p, PA_PAL_STATS_PROP_PREFIX "wakeup_max_late_usec", "%d", pa_atomic_load(&s->wakeup_max_late_us));
+    pa_proplist_setf(p, PA_PAL_STATS_PROP_PREFIX "late_wakeups", "%d", pa_atomic_load(&s->late_wakeups));
+
+    hist = pa_strbuf_new();
+    for (i = 0; i < PA_PAL_STATS_HIST_BUCKETS; i++)
+        pa_strbuf_printf(hist, "%s<%s:%d", i ? " " : "", hist_names[i], pa_atomic_load(&s->io_hist[i]));
+    str = pa_strbuf_to_string_free(hist);
+    pa_proplist_sets(p, PA_PAL_STATS_PROP_PREFIX "io_histogram", str);
+    pa_xfree(str);
+}
+
+char* pa_pal_stats_to_string(pa_pal_stats *s) {
+    pa_proplist *p;
+    char *str;
+
+    pa_assert(s);
+
+    p = pa_proplist_new();
+    pa_pal_stats_to_proplist(s, p);
+    str = pa_proplist_to_string_sep(p, "\n");
+    pa_proplist_free(p);
+
+    return str;
+}
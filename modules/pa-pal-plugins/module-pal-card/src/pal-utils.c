@@ -11,13 +11,44 @@
 #include <pulsecore/log.h>
 #include <pulsecore/core-util.h>
 #include <pulsecore/core-format.h>
+#include <pulsecore/flist.h>
 #include <pulse/channelmap.h>
+#include <pulse/volume.h>
 #include <errno.h>
 #include <math.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PA_PAL_UTIL_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PA_PAL_UTIL_SSE2
+#endif
+
 #include "pal-utils.h"
 
 #define PA_PAL_SINK_PROP_FORMAT_FLAG    "stream-format"
+#define PA_PAL_SINK_PROP_ENCODER_DELAY  "encoder-delay"
+#define PA_PAL_SINK_PROP_ENCODER_PADDING "encoder-padding"
+
+/* codec parameters, all optional, taken from the format info of the stream */
+#define PA_PAL_SINK_PROP_BITS_PER_SAMPLE "bits-per-sample"
+#define PA_PAL_SINK_PROP_MIN_BLOCK_SIZE  "min-block-size"
+#define PA_PAL_SINK_PROP_MAX_BLOCK_SIZE  "max-block-size"
+#define PA_PAL_SINK_PROP_MIN_FRAME_SIZE  "min-frame-size"
+#define PA_PAL_SINK_PROP_MAX_FRAME_SIZE  "max-frame-size"
+#define PA_PAL_SINK_PROP_FRAME_LENGTH    "frame-length"
+#define PA_PAL_SINK_PROP_MAX_RUN         "max-run"
+#define PA_PAL_SINK_PROP_BIT_RATE        "bit-rate"
+#define PA_PAL_SINK_PROP_FORMAT_TAG      "format-tag"
+#define PA_PAL_SINK_PROP_BLOCK_ALIGN     "block-align"
+#define PA_PAL_SINK_PROP_CHANNEL_MASK    "channel-mask"
+#define PA_PAL_SINK_PROP_ENCODE_OPTIONS  "encode-options"
+#define PA_PAL_SINK_PROP_PRE_SKIP        "pre-skip"
+#define PA_PAL_SINK_PROP_OUTPUT_GAIN     "output-gain"
+#define PA_PAL_SINK_PROP_MAPPING_FAMILY  "mapping-family"
+#define PA_PAL_SINK_PROP_STREAM_COUNT    "stream-count"
+#define PA_PAL_SINK_PROP_COUPLED_COUNT   "coupled-count"
 
 #define AAC_AOT_PS    29
 
@@ -36,6 +67,11 @@ typedef union {
 
 pa_pal_util_compress_metadata compress_metadata;
 
+#ifndef PAL_DISABLE_COMPRESS_AUDIO_SUPPORT
+/* decoder config of the last negotiated format for codecs other than aac */
+static pal_snd_dec_t codec_config;
+#endif
+
 typedef struct {
     char *port_name;
     pal_device_id_t pal_device;
@@ -63,6 +99,13 @@ pa_pal_util_port_to_pal_device_mapping port_to_pal_device[] = {
     { (char *)"btsco-out",        PAL_DEVICE_OUT_BLUETOOTH_SCO,         (char *)"PAL_DEVICE_OUT_BLUETOOTH_SCO" },
     { (char *)"hdmi-in",          PAL_DEVICE_IN_HDMI,                   (char *)"PAL_DEVICE_IN_HDMI" },
     { (char *)"dp-in",            PAL_DEVICE_IN_AUX_DIGITAL,            (char *)"PAL_DEVICE_IN_AUX_DIGITAL" },
+#if HAVE_DECL_PAL_DEVICE_OUT_SPDIF
+    { (char *)"spdif-out-optical", PAL_DEVICE_OUT_SPDIF,                (char *)"PAL_DEVICE_OUT_SPDIF" },
+    { (char *)"spdif-out-coaxial", PAL_DEVICE_OUT_SPDIF,                (char *)"PAL_DEVICE_OUT_SPDIF" },
+#endif
+#if HAVE_DECL_PAL_DEVICE_IN_ECHO_REF
+    { (char *)"echo-ref",         PAL_DEVICE_IN_ECHO_REF,               (char *)"PAL_DEVICE_IN_ECHO_REF" },
+#endif
 };
 
 pa_pal_util_jack_type_to_port_name jack_type_to_port_name[] = {
@@ -112,6 +155,37 @@ pal_device_id_t pa_pal_util_device_name_to_enum(const char *device_name) {
     return device;
 }
 
+uint32_t pa_pal_util_fill_port_devices(struct pal_device *devices, const pa_pal_card_port_device_data *port) {
+    uint32_t i;
+
+    pa_assert(devices);
+    pa_assert(port);
+    pa_assert(port->n_devices >= 1 && port->n_devices <= PA_PAL_CARD_MAX_PORT_DEVICES);
+
+    devices[0].id = port->devices[0];
+
+    /* DSP duplicates the stream, every device runs the same config */
+    for (i = 1; i < port->n_devices; i++) {
+        devices[i] = devices[0];
+        devices[i].id = port->devices[i];
+    }
+
+    return port->n_devices;
+}
+
+bool pa_pal_util_port_has_device(const pa_pal_card_port_device_data *port, pal_device_id_t device) {
+    uint32_t i;
+
+    pa_assert(port);
+
+    for (i = 0; i < port->n_devices; i++) {
+        if (port->devices[i] == device)
+            return true;
+    }
+
+    return false;
+}
+
 pal_device_id_t pa_pal_util_port_name_to_enum(const char *port_name) {
     uint32_t count;
     pal_device_id_t device = PAL_DEVICE_NONE;
@@ -131,6 +205,15 @@ pal_device_id_t pa_pal_util_port_name_to_enum(const char *port_name) {
 }
 
 #ifndef PAL_DISABLE_COMPRESS_AUDIO_SUPPORT
+static uint32_t pa_pal_util_get_format_prop_int(const pa_format_info *format, const char *key, uint32_t def) {
+    int value;
+
+    if (pa_format_info_get_prop_int(format, key, &value) || value < 0)
+        return def;
+
+    return (uint32_t)value;
+}
+
 int pa_pal_util_set_pal_metadata_from_pa_format(const pa_format_info *format) {
     int rc = 0;
     char *stream_format;
@@ -157,6 +240,63 @@ int pa_pal_util_set_pal_metadata_from_pa_format(const pa_format_info *format) {
 
             break;
 
+#if HAVE_DECL_PA_ENCODING_FLAC
+        case PA_ENCODING_FLAC:
+            memset(&codec_config, 0, sizeof(codec_config));
+            codec_config.flac_dec.sample_size = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_BITS_PER_SAMPLE, 16);
+            codec_config.flac_dec.min_blk_size = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_MIN_BLOCK_SIZE, 16);
+            codec_config.flac_dec.max_blk_size = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_MAX_BLOCK_SIZE, 16384);
+            codec_config.flac_dec.min_frame_size = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_MIN_FRAME_SIZE, 0);
+            codec_config.flac_dec.max_frame_size = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_MAX_FRAME_SIZE, 0);
+            break;
+#endif
+#if HAVE_DECL_PA_ENCODING_ALAC
+        case PA_ENCODING_ALAC:
+            /* defaults of the ALAC magic cookie */
+            memset(&codec_config, 0, sizeof(codec_config));
+            codec_config.alac_dec.frame_length = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_FRAME_LENGTH, 4096);
+            codec_config.alac_dec.bit_depth = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_BITS_PER_SAMPLE, 16);
+            codec_config.alac_dec.pb = 40;
+            codec_config.alac_dec.mb = 10;
+            codec_config.alac_dec.kb = 14;
+            codec_config.alac_dec.max_run = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_MAX_RUN, 255);
+            codec_config.alac_dec.max_frame_bytes = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_MAX_FRAME_SIZE, 0);
+            codec_config.alac_dec.avg_bit_rate = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_BIT_RATE, 0);
+            break;
+#endif
+#if HAVE_DECL_PA_ENCODING_VORBIS
+        case PA_ENCODING_VORBIS:
+            /* raw vorbis packets, no ogg container */
+            memset(&codec_config, 0, sizeof(codec_config));
+            codec_config.vorbis_dec.bit_stream_fmt = 1;
+            break;
+#endif
+#if HAVE_DECL_PA_ENCODING_OPUS && HAVE_DECL_PAL_AUDIO_FMT_OPUS
+        case PA_ENCODING_OPUS:
+            memset(&codec_config, 0, sizeof(codec_config));
+            codec_config.opus_dec.pre_skip = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_PRE_SKIP, 312);
+            codec_config.opus_dec.output_gain = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_OUTPUT_GAIN, 0);
+            codec_config.opus_dec.mapping_family = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_MAPPING_FAMILY, 0);
+            codec_config.opus_dec.stream_count = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_STREAM_COUNT, 1);
+            codec_config.opus_dec.coupled_count = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_COUPLED_COUNT, 1);
+            break;
+#endif
+#if HAVE_DECL_PA_ENCODING_WMA || HAVE_DECL_PA_ENCODING_WMA_PRO
+#if HAVE_DECL_PA_ENCODING_WMA
+        case PA_ENCODING_WMA:
+#endif
+#if HAVE_DECL_PA_ENCODING_WMA_PRO
+        case PA_ENCODING_WMA_PRO:
+#endif
+            memset(&codec_config, 0, sizeof(codec_config));
+            codec_config.wma_dec.fmt_tag = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_FORMAT_TAG, 0);
+            codec_config.wma_dec.super_block_align = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_BLOCK_ALIGN, 0);
+            codec_config.wma_dec.bits_per_sample = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_BITS_PER_SAMPLE, 16);
+            codec_config.wma_dec.channelmask = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_CHANNEL_MASK, 0);
+            codec_config.wma_dec.encodeopt = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_ENCODE_OPTIONS, 0);
+            codec_config.wma_dec.avg_bit_rate = pa_pal_util_get_format_prop_int(format, PA_PAL_SINK_PROP_BIT_RATE, 0);
+            break;
+#endif
         case PA_ENCODING_MPEG:
         default:
             break;
@@ -164,6 +304,26 @@ int pa_pal_util_set_pal_metadata_from_pa_format(const pa_format_info *format) {
 
     return rc;
 }
+
+/* encoder delay and padding in frames, both are optional and default to 0 */
+int pa_pal_util_get_gapless_metadata_from_pa_format(const pa_format_info *format, struct pal_compr_gapless_mdata *mdata) {
+    int value;
+
+    pa_assert(format);
+    pa_assert(mdata);
+
+    memset(mdata, 0, sizeof(*mdata));
+
+    if (!pa_format_info_get_prop_int(format, PA_PAL_SINK_PROP_ENCODER_DELAY, &value) && value > 0)
+        mdata->encoderDelay = (uint32_t)value;
+
+    if (!pa_format_info_get_prop_int(format, PA_PAL_SINK_PROP_ENCODER_PADDING, &value) && value > 0)
+        mdata->encoderPadding = (uint32_t)value;
+
+    pa_log_debug("%s: encoder delay %u, padding %u", __func__, mdata->encoderDelay, mdata->encoderPadding);
+
+    return 0;
+}
 #endif
 
 /* With reference to the translation table from "Dolby Atmos to Sound Bar Product
@@ -260,6 +420,20 @@ pal_audio_fmt_t pa_pal_util_get_pal_format_from_pa_encoding(pa_encoding_t pa_for
         case PA_ENCODING_PCM:
             pal_format = PAL_AUDIO_FMT_PCM_S16_LE;
             break;
+        /* IEC61937 bursts travel as 16 bit pcm, the receiver decodes them */
+        case PA_ENCODING_AC3_IEC61937:
+        case PA_ENCODING_EAC3_IEC61937:
+        case PA_ENCODING_MPEG_IEC61937:
+        case PA_ENCODING_DTS_IEC61937:
+        case PA_ENCODING_MPEG2_AAC_IEC61937:
+#if HAVE_DECL_PA_ENCODING_TRUEHD_IEC61937
+        case PA_ENCODING_TRUEHD_IEC61937:
+#endif
+#if HAVE_DECL_PA_ENCODING_DTSHD_IEC61937
+        case PA_ENCODING_DTSHD_IEC61937:
+#endif
+            pal_format = PAL_AUDIO_FMT_PCM_S16_LE;
+            break;
 #ifndef PAL_DISABLE_COMPRESS_AUDIO_SUPPORT
         case PA_ENCODING_MPEG:
             pal_format = PAL_AUDIO_FMT_MP3;
@@ -273,6 +447,48 @@ pal_audio_fmt_t pa_pal_util_get_pal_format_from_pa_encoding(pa_encoding_t pa_for
             pal_snd_dec->aac_dec.audio_obj_type = AAC_AOT_PS;
             pal_snd_dec->aac_dec.pce_bits_size = 0;
             break;
+#if HAVE_DECL_PA_ENCODING_FLAC
+        case PA_ENCODING_FLAC:
+            pal_format = PAL_AUDIO_FMT_FLAC;
+            if (pal_snd_dec)
+                *pal_snd_dec = codec_config;
+            break;
+#endif
+#if HAVE_DECL_PA_ENCODING_ALAC
+        case PA_ENCODING_ALAC:
+            pal_format = PAL_AUDIO_FMT_ALAC;
+            if (pal_snd_dec)
+                *pal_snd_dec = codec_config;
+            break;
+#endif
+#if HAVE_DECL_PA_ENCODING_VORBIS
+        case PA_ENCODING_VORBIS:
+            pal_format = PAL_AUDIO_FMT_VORBIS;
+            if (pal_snd_dec)
+                *pal_snd_dec = codec_config;
+            break;
+#endif
+#if HAVE_DECL_PA_ENCODING_OPUS && HAVE_DECL_PAL_AUDIO_FMT_OPUS
+        case PA_ENCODING_OPUS:
+            pal_format = PAL_AUDIO_FMT_OPUS;
+            if (pal_snd_dec)
+                *pal_snd_dec = codec_config;
+            break;
+#endif
+#if HAVE_DECL_PA_ENCODING_WMA
+        case PA_ENCODING_WMA:
+            pal_format = PAL_AUDIO_FMT_WMA_STD;
+            if (pal_snd_dec)
+                *pal_snd_dec = codec_config;
+            break;
+#endif
+#if HAVE_DECL_PA_ENCODING_WMA_PRO
+        case PA_ENCODING_WMA_PRO:
+            pal_format = PAL_AUDIO_FMT_WMA_PRO;
+            if (pal_snd_dec)
+                *pal_snd_dec = codec_config;
+            break;
+#endif
 #endif
         default:
             pa_log_error("PA format encoding not supported in PAL\n");
@@ -282,6 +498,79 @@ pal_audio_fmt_t pa_pal_util_get_pal_format_from_pa_encoding(pa_encoding_t pa_for
     return pal_format;
 }
 
+pal_audio_fmt_t pa_pal_util_get_pal_pcm_format(pa_sample_format_t format, uint32_t *bit_width) {
+    pal_audio_fmt_t pal_format;
+
+    pa_assert(bit_width);
+
+    switch (format) {
+        case PA_SAMPLE_S24LE:
+            pal_format = PAL_AUDIO_FMT_PCM_S24_3LE;
+            *bit_width = 24;
+            break;
+        case PA_SAMPLE_S24_32LE:
+            /* 24bit in 32bit word (LSB aligned) */
+            pal_format = PAL_AUDIO_FMT_PCM_S24_LE;
+            *bit_width = 24;
+            break;
+        case PA_SAMPLE_S32LE:
+        case PA_SAMPLE_FLOAT32LE: /* PAL has no float, converted to S32 on write */
+            pal_format = PAL_AUDIO_FMT_PCM_S32_LE;
+            *bit_width = 32;
+            break;
+        default:
+            pal_format = PAL_AUDIO_FMT_DEFAULT_PCM;
+            *bit_width = 16;
+            break;
+    }
+
+    return pal_format;
+}
+
+/* [-1.0, 1.0] scaled to the full S32 range and saturated, 1.0 itself ends up
+ * as INT32_MAX. NEON truncates instead of rounding, one LSB off at most. */
+void pa_pal_util_float32_to_s32(int32_t *dst, const float *src, size_t samples) {
+    size_t i = 0;
+
+#if defined(PA_PAL_UTIL_NEON)
+    const float32x4_t scale = vdupq_n_f32(2147483648.0f);
+
+    /* vcvtq saturates on overflow */
+    for (; i + 8 <= samples; i += 8) {
+        float32x4_t a = vld1q_f32(src + i);
+        float32x4_t b = vld1q_f32(src + i + 4);
+
+        vst1q_s32(dst + i, vcvtq_s32_f32(vmulq_f32(a, scale)));
+        vst1q_s32(dst + i + 4, vcvtq_s32_f32(vmulq_f32(b, scale)));
+    }
+#elif defined(PA_PAL_UTIL_SSE2)
+    const __m128 scale = _mm_set1_ps(2147483648.0f);
+
+    /* cvtps returns INT32_MIN on overflow, which is right for negative values
+     * only, flip it to INT32_MAX for the positive ones */
+    for (; i + 8 <= samples; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_xor_si128(_mm_cvtps_epi32(a), _mm_castps_si128(_mm_cmpge_ps(a, scale))));
+        _mm_storeu_si128((__m128i *)(dst + i + 4),
+                         _mm_xor_si128(_mm_cvtps_epi32(b), _mm_castps_si128(_mm_cmpge_ps(b, scale))));
+    }
+#endif
+
+    for (; i < samples; i++) {
+        float v = src[i] * 2147483648.0f;
+
+        if (v >= 2147483647.0f)
+            dst[i] = INT32_MAX;
+        else if (v <= -2147483648.0f)
+            dst[i] = INT32_MIN;
+        else
+            dst[i] = (int32_t)lrintf(v);
+    }
+}
+
 uint32_t pa_pal_get_channel_count(pa_channel_map *pa_map) {
     pa_assert(pa_map);
     return pa_map->channels;
@@ -358,6 +647,38 @@ int pa_pal_set_volume(pal_stream_handle_t *handle, uint32_t num_channels, float
     return ret;
 }
 
+void pa_pal_util_fill_volume_data(struct pal_volume_data *data, const pa_cvolume *v, const struct pal_channel_info *ch_info) {
+    uint32_t channels, i, n = 0;
+    uint32_t all_mask = 0;
+
+    pa_assert(data);
+    pa_assert(v);
+    pa_assert(ch_info);
+
+    channels = PA_MIN((uint32_t)v->channels, (uint32_t)ch_info->channels);
+
+    /* the mask bit of a channel is its PAL channel type */
+    for (i = 0; i < channels; i++) {
+        if (ch_info->ch_map[i] >= 32) {
+            pa_log_error("%s: no volume mask bit for pal channel %u", __func__, ch_info->ch_map[i]);
+            continue;
+        }
+
+        data->volume_pair[n].channel_mask = 1U << ch_info->ch_map[i];
+        data->volume_pair[n].vol = (float)pa_sw_volume_to_linear(PA_MIN(v->values[i], PA_VOLUME_NORM));
+        all_mask |= data->volume_pair[n].channel_mask;
+        n++;
+    }
+
+    /* balanced, a single pair lets PAL use the master gain */
+    if (n > 1 && pa_cvolume_channels_equal_to(v, v->values[0])) {
+        data->volume_pair[0].channel_mask = all_mask;
+        n = 1;
+    }
+
+    data->no_of_volpair = n;
+}
+
 int pa_pal_set_device_connection_state(pal_device_id_t pal_dev_id, bool connection_state)
 {
     int ret = 0;
@@ -376,6 +697,80 @@ int pa_pal_set_device_connection_state(pal_device_id_t pal_dev_id, bool connecti
     return ret;
 }
 
+static void pa_pal_ctrl_cmd_destroy(void *p) {
+    pa_pal_ctrl_cmd *cmd = p;
+
+    pa_xfree(cmd->volume_data);
+    pa_xfree(cmd);
+}
+
+/* freed commands are recycled along with their volume data */
+PA_STATIC_FLIST_DECLARE(pal_ctrl_cmds, 0, pa_pal_ctrl_cmd_destroy);
+
+pa_pal_ctrl_cmd* pa_pal_ctrl_cmd_new(pa_pal_ctrl_event_t event) {
+    pa_pal_ctrl_cmd *cmd;
+    struct pal_volume_data *volume_data;
+
+    if ((cmd = pa_flist_pop(PA_STATIC_FLIST_GET(pal_ctrl_cmds)))) {
+        volume_data = cmd->volume_data;
+        memset(cmd, 0, sizeof(*cmd));
+        memset(volume_data, 0, PA_PAL_VOLUME_DATA_SIZE(PA_CHANNELS_MAX));
+    } else {
+        cmd = pa_xnew(pa_pal_ctrl_cmd, 1);
+        memset(cmd, 0, sizeof(*cmd));
+        volume_data = pa_xmalloc0(PA_PAL_VOLUME_DATA_SIZE(PA_CHANNELS_MAX));
+    }
+
+    cmd->event = event;
+    cmd->volume_data = volume_data;
+
+    return cmd;
+}
+
+void pa_pal_ctrl_cmd_free(pa_pal_ctrl_cmd *cmd) {
+    pa_assert(cmd);
+
+    if (cmd->param_payload) {
+        free(cmd->param_payload);
+        cmd->param_payload = NULL;
+    }
+
+    if (pa_flist_push(PA_STATIC_FLIST_GET(pal_ctrl_cmds), cmd) < 0)
+        pa_pal_ctrl_cmd_destroy(cmd);
+}
+
+/* Called from the I/O thread owning handle */
+int pa_pal_ctrl_cmd_apply(pal_stream_handle_t *handle, pa_pal_ctrl_cmd *cmd) {
+    int rc = -EINVAL;
+
+    pa_assert(handle);
+    pa_assert(cmd);
+
+    switch (cmd->event) {
+        case PA_PAL_VOLUME_APPLY:
+            if (cmd->volume_data->no_of_volpair)
+                rc = pal_stream_set_volume(handle, cmd->volume_data);
+            break;
+        case PA_PAL_MUTE_APPLY:
+            rc = pal_stream_set_mute(handle, cmd->mute);
+            break;
+        case PA_PAL_DEVICE_SWITCH:
+            rc = pal_stream_set_device(handle, cmd->n_devices, cmd->devices);
+            break;
+        case PA_PAL_SET_PARAM:
+            if (cmd->param_payload)
+                rc = pal_stream_set_param(handle, cmd->param_id, cmd->param_payload);
+            break;
+        default:
+            pa_log_error("%s: unknown control event %d", __func__, cmd->event);
+            break;
+    }
+
+    cmd->rc = rc;
+
+    return rc;
+}
+
 pa_pal_card_avoid_processing_config_id_t pa_pal_utils_get_config_id_from_string(const char *config_str) {
     pa_pal_card_avoid_processing_config_id_t config_id = PA_PAL_CARD_AVOID_PROCESSING_FOR_NONE;
 